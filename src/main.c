@@ -29,6 +29,20 @@
 
 #include "project.h"
 
+/**
+ * Get a monotonic timestamp, used to measure latencies
+ *
+ * @return The current time in microseconds
+ */
+uint64_t superhid_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void xenstore_handler(int fd, short event, void *priv)
 {
   superxenstore_handler();
@@ -39,54 +53,226 @@ void xenstore_back_handler(int fd, short event, void *priv)
   backend_xenstore_handler(NULL);
 }
 
-int main(int argc, char **argv)
+void stats_handler(int fd, short event, void *priv)
 {
-  struct event xs_event, xs_back_event;
-  int xs_fd, xs_back_fd;
+  int i;
 
-  if (argc != 1)
-    return 1;
+  for (i = 0; i < SUPERHID_MAX_BACKENDS; ++i)
+    if (superbacks[i].di.di_dompath != NULL)
+      superscheduler_print_stats(&superbacks[i]);
+  superfilter_print_stats();
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [options]\n", name);
+  fprintf(stderr, "  -c, --credits  Advertise per-domain credits to input_server\n");
+  fprintf(stderr, "  -e, --evdev    Grab /dev/input/event* instead of using input_server\n");
+  fprintf(stderr, "  -s, --shm      Offer input_server shared rings for the events\n");
+  fprintf(stderr, "  -o, --focus    Only feed the domain that has the input focus, instead\n");
+  fprintf(stderr, "                 of all of them\n");
+  fprintf(stderr, "  -S, --socket=PATH\n");
+  fprintf(stderr, "                 Connect to input_server there (default %s)\n", SOCK_PATH);
+  fprintf(stderr, "  -p, --passthrough=/dev/hidrawN\n");
+  fprintf(stderr, "                 Pass a HID device through to the domains that want it\n");
+  fprintf(stderr, "  -r, --record=FILE\n");
+  fprintf(stderr, "                 Capture all the input to FILE, rotated to FILE.1\n");
+  fprintf(stderr, "  -R, --replay=FILE\n");
+  fprintf(stderr, "                 Replay a capture to the domains, with its timing\n");
+  fprintf(stderr, "  -f, --fast     Replay as fast as possible instead\n");
+  fprintf(stderr, "  -T, --transform=SOURCE:ROTATION[:X,Y,WIDTH,HEIGHT]\n");
+  fprintf(stderr, "                 Rotate the coordinates of a source clockwise, and map\n");
+  fprintf(stderr, "                 them to a rectangle of the screen, in percents\n");
+  fprintf(stderr, "  -F, --filter=SOURCE:TYPE:NAME[:ARG]\n");
+  fprintf(stderr, "                 Filter the frames of a source (or *) that have input\n");
+  fprintf(stderr, "                 for TYPE (all, mouse, digitizer, tablet, keyboard):\n");
+  fprintf(stderr, "                 smooth[:1-8], debounce[:ms], dedupe or predict[:ms]\n");
+  fprintf(stderr, "  -u, --uhid=TYPES\n");
+  fprintf(stderr, "                 Run without Xen, delivering to local uhid devices of\n");
+  fprintf(stderr, "                 the given types (e.g. mouse,digitizer,tablet,keyboard)\n");
+  fprintf(stderr, "  -b, --bench=FILE\n");
+  fprintf(stderr, "                 Measure how fast a capture gets translated, and exit\n");
+  fprintf(stderr, "  -P, --predict-bench=FILE\n");
+  fprintf(stderr, "                 Score the motion prediction on a capture, and exit\n");
+  fprintf(stderr, "  -h, --help     Show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+  struct event xs_event, xs_back_event, stats_event;
+  int xs_fd = -1, xs_back_fd = -1;
+  int opt;
+  const char *passthrough = NULL;
+  const char *record = NULL;
+  const char *replay = NULL;
+  const char *uhid = NULL;
+  bool fast = false;
+  static const struct option options[] = {
+    { "credits", no_argument, NULL, 'c' },
+    { "evdev",   no_argument, NULL, 'e' },
+    { "shm",     no_argument, NULL, 's' },
+    { "focus",   no_argument, NULL, 'o' },
+    { "socket",  required_argument, NULL, 'S' },
+    { "passthrough", required_argument, NULL, 'p' },
+    { "record",  required_argument, NULL, 'r' },
+    { "replay",  required_argument, NULL, 'R' },
+    { "fast",    no_argument,       NULL, 'f' },
+    { "transform", required_argument, NULL, 'T' },
+    { "filter",  required_argument, NULL, 'F' },
+    { "uhid",    required_argument, NULL, 'u' },
+    { "bench",   required_argument, NULL, 'b' },
+    { "predict-bench", required_argument, NULL, 'P' },
+    { "help",    no_argument, NULL, 'h' },
+    { NULL,      0,           NULL, 0 }
+  };
 
   /* Globals init */
   xcg_handle = NULL;
+  superhid_credits = false;
+  superhid_evdev = false;
+  superhid_shm = false;
+  superhid_focus = false;
+  superhid_socket_path = SOCK_PATH;
+  superhid_passthrough_desc = NULL;
+  superfilter_count = 0;
+  supertransform_init();
 
-  /* Initialize XenStore */
-  xs_fd = superxenstore_init();
-  if (xs_fd < 0)
+  while ((opt = getopt_long(argc, argv, "cehsoS:p:r:R:fT:F:u:b:P:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      superhid_credits = true;
+      break;
+    case 'e':
+      superhid_evdev = true;
+      break;
+    case 's':
+      superhid_shm = true;
+      break;
+    case 'o':
+      superhid_focus = true;
+      break;
+    case 'S':
+      superhid_socket_path = optarg;
+      break;
+    case 'p':
+      passthrough = optarg;
+      break;
+    case 'r':
+      record = optarg;
+      break;
+    case 'R':
+      replay = optarg;
+      break;
+    case 'f':
+      fast = true;
+      break;
+    case 'T':
+      if (supertransform_parse(optarg) < 0) {
+        superlog(LOG_ERR, "Invalid transform %s", optarg);
+        return 1;
+      }
+      break;
+    case 'F':
+      if (superfilter_parse(optarg) < 0) {
+        superlog(LOG_ERR, "Invalid filter %s", optarg);
+        return 1;
+      }
+      break;
+    case 'u':
+      uhid = optarg;
+      break;
+    case 'b':
+      /* No need for Xen or anything else */
+      return superreplay_bench(optarg) < 0 ? 1 : 0;
+    case 'P':
+      return superreplay_predict_bench(optarg) < 0 ? 1 : 0;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc) {
+    usage(argv[0]);
     return 1;
+  }
+
+  if (uhid == NULL) {
+    /* Initialize XenStore */
+    xs_fd = superxenstore_init();
+    if (xs_fd < 0)
+      return 1;
 
-  /* Initialize gnttab */
-  if (xcg_handle == NULL) {
-    xcg_handle = xc_gnttab_open(NULL, 0);
+    /* Initialize gnttab */
+    if (xcg_handle == NULL) {
+      xcg_handle = xc_gnttab_open(NULL, 0);
+    }
+    if (xcg_handle == NULL) {
+      superlog(LOG_ERR, "Failed to connect to xc");
+      return 1;
+    }
   }
-  if (xcg_handle == NULL) {
-    superlog(LOG_ERR, "Failed to connect to xc");
+
+  /* Start the flight recorder before any input comes in */
+  if (record != NULL && supercapture_init(record, SUPERHID_CAPTURE_SIZE) < 0)
+    return 1;
+
+  /* Open the passthrough device first, superhid_init() needs its
+   * descriptor */
+  if (passthrough != NULL && superhidraw_init(passthrough) < 0)
     return 1;
-  }
 
   /* Initialize SuperHID */
   superhid_init();
 
   /* Initialize the backend */
-  xs_back_fd = superbackend_init();
-
-  input_grabber = -1;
+  if (uhid == NULL)
+    xs_back_fd = superbackend_init();
 
   event_init();
 
-  event_set(&xs_event, xs_fd, EV_READ | EV_PERSIST,
-            xenstore_handler, NULL);
-  event_add(&xs_event, NULL);
+  /* Or the local devices, when running without Xen */
+  if (uhid != NULL && superuhid_init(uhid) < 0)
+    return 1;
 
-  event_set(&xs_back_event, xs_back_fd, EV_READ | EV_PERSIST,
-            xenstore_back_handler, NULL);
-  event_add(&xs_back_event, NULL);
+  superhidraw_start();
+
+  if (replay != NULL && superreplay_init(replay, fast) < 0)
+    return 1;
+
+  /* Grab the input devices, if we're not going through input_server */
+  if (superhid_evdev && superevdev_init() < 0)
+    return 1;
+
+  if (uhid == NULL) {
+    event_set(&xs_event, xs_fd, EV_READ | EV_PERSIST,
+              xenstore_handler, NULL);
+    event_add(&xs_event, NULL);
+
+    event_set(&xs_back_event, xs_back_fd, EV_READ | EV_PERSIST,
+              xenstore_back_handler, NULL);
+    event_add(&xs_back_event, NULL);
+  }
+
+  /* Dump the per-domain statistics on SIGUSR1 */
+  signal_set(&stats_event, SIGUSR1, stats_handler, NULL);
+  signal_add(&stats_event, NULL);
 
   event_dispatch();
 
   /* Cleanup */
-  superxenstore_close();
-  xc_gnttab_close(xcg_handle);
+  if (superhid_evdev)
+    superevdev_close();
+  superhidraw_close();
+  supercapture_close();
+  if (uhid != NULL) {
+    superuhid_close();
+  } else {
+    superxenstore_close();
+    xc_gnttab_close(xcg_handle);
+  }
 
   return 0;
 }
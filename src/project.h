@@ -80,10 +80,17 @@
 #include <event.h>
 #include <sys/mman.h>
 #include <syslog.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <stdarg.h>
 #include <getopt.h>
 #include <fnmatch.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <linux/hidraw.h>
+#include <limits.h>
+#include <pthread.h>
 #include <xenstore.h>
 #include <xenctrl.h>
 #include <xenbackend.h>
@@ -91,10 +98,12 @@
 #include <linux/usb/ch9.h>
 #include <linux/hid.h>
 #include <linux/hiddev.h>
+#include <linux/uhid.h>
 #include <linux/input.h>
 #include <xen/grant_table.h>
 
 #include "usbif.h"
+#include "superproto.h"
 
 #define EVENT_SIZE             12
 
@@ -104,10 +113,40 @@
 #define SUPERHID_VENDOR        0x4242
 #define SUPERHID_DEVICE        0x4242
 #define SUPERHID_DOMID         0
-#define SUPERHID_REPORT_LENGTH 12
 #define SUPERHID_FINGERS       10
 #define SUPERHID_FINGER_WIDTH  2  /* How many fingers in one report */
+/* Report lengths, report ID included, as the descriptors define them */
+#define SUPERHID_MOUSE_REPORT_LENGTH      5
+#define SUPERHID_MOUSE_WIDE_REPORT_LENGTH 8
+#define SUPERHID_TABLET_REPORT_LENGTH     6
+#define SUPERHID_KEYBOARD_REPORT_LENGTH   9
+#define SUPERHID_DIGITIZER_REPORT_LENGTH  (4 + SUPERHID_FINGER_WIDTH * 5)
+/* Full-frame digitizer reports carry all the fingers */
+#define SUPERHID_FULL_REPORT_LENGTH (4 + SUPERHID_FINGERS * 5)
+#define SUPERHID_MAX_REPORT_LENGTH  64 /* Max packet size of a full speed INT endpoint */
 #define SUPERHID_MAX_BACKENDS  32 /* 32 running VMs should be plenty */
+#define SUPERHID_QUEUE_LENGTH  64 /* Reports queued per domain */
+/* Stop reading input when the queue has less room than a full frame */
+#define SUPERHID_QUEUE_RESERVE (SUPERHID_FINGERS / SUPERHID_FINGER_WIDTH + 4)
+#define SUPERHID_SCHED_QUANTUM 2  /* Reports per round for a weight of 1 */
+#define SUPERHID_DEFAULT_WEIGHT 1
+/* The recent delay moves by 1/this of the difference with every report */
+#define SUPERHID_DELAY_SMOOTHING 8
+/* Identical absolute reports are skipped, unless the last one is older
+ * than this many milliseconds */
+#define SUPERHID_DEFAULT_KEEPALIVE 1000
+/* Max reports a single relative move gets split into, the rest is
+ * carried over to the next frame */
+#define SUPERHID_MOUSE_SPLIT   4
+/* Capture files get rotated when they reach that size, in bytes */
+#define SUPERHID_CAPTURE_SIZE  (64 * 1024 * 1024)
+/* Sources with their own coordinate transform, see supertransform.c */
+#define SUPERTRANSFORM_MAX_SOURCES 32
+/* The filter state of the local input, the domains have their own,
+ * see superfilter.c */
+#define SUPERFILTER_LOCAL      SUPERHID_MAX_BACKENDS
+/* Transformed coordinates go from 0 to that on both axes */
+#define SUPERTRANSFORM_MAX     0x7FFF
 /* The following is from libxenbackend. It should be exported and bigger */
 #define BACKEND_DEVICE_MAX     16
 
@@ -144,29 +183,15 @@ enum superhid_type
   SUPERHID_TYPE_MOUSE,
   SUPERHID_TYPE_DIGITIZER,
   SUPERHID_TYPE_TABLET,
-  SUPERHID_TYPE_KEYBOARD
+  SUPERHID_TYPE_KEYBOARD,
+  SUPERHID_TYPE_DIGITIZER_FULL,
+  SUPERHID_TYPE_MOUSE_WIDE,
+  SUPERHID_TYPE_PASSTHROUGH
 };
+#define SUPERHID_TYPE_LAST SUPERHID_TYPE_PASSTHROUGH
 
-struct superhid_device
-{
-  uint8_t                  devid;
-  xen_backend_t            backend;
-  struct superhid_backend *superback;
-  void                    *page;
-  usbif_back_ring_t        back_ring;
-  bool                     back_ring_ready;
-  int                      evtfd;
-  void                    *priv;
-  uint64_t                 pendings[32];       /* usbif_request_t.id */
-  grant_ref_t              pendingrefs[32];    /* usbif_request_t.u.gref */
-  uint16_t                 pendingoffsets[32]; /* usbif_request_t.offset */
-  uint8_t                  pendinghead;
-  uint8_t                  pendingtail;
-  struct event             event;
-  enum superhid_type       type;
-};
-
-#define buffersize              (EVENT_SIZE*20)
+/* Big enough for the largest v2 frame */
+#define buffersize              FRAME_SIZE(FRAME_MAX_EVENTS)
 
 struct buffer_t
 {
@@ -176,15 +201,8 @@ struct buffer_t
   int s;
   int copy;
   int block;
-};
-
-struct superhid_backend
-{
-  xen_backend_t backend;
-  struct superhid_device *devices[BACKEND_DEVICE_MAX];
-  dominfo_t di;
-  struct buffer_t buffers;
-  struct event input_event;
+  uint64_t stamp;  /* superhid_now() at the last recv() */
+  int version;     /* Protocol version input_server speaks */
 };
 
 struct hid_descriptor {
@@ -224,14 +242,17 @@ struct superhid_finger
 struct superhid_report
 {
   uint8_t  report_id;
-  uint8_t  data[SUPERHID_REPORT_LENGTH - 1];
+  uint8_t  data[SUPERHID_MAX_REPORT_LENGTH - 1];
 } __attribute__ ((__packed__));
 
 struct superhid_report_multitouch
 {
   uint8_t  report_id;     /* Should always be REPORT_ID_MULTITOUCH */
-  uint8_t  count;         /* How many fingers are in the packet (1/2) */
-  struct superhid_finger fingers[SUPERHID_FINGER_WIDTH];
+  uint8_t  count;         /* How many fingers are in the packet */
+  uint16_t scan_time;     /* When the frame came in, in 100us units */
+  /* Only the first SUPERHID_FINGER_WIDTH fingers make it to a regular
+   * digitizer, full-frame digitizers get them all */
+  struct superhid_finger fingers[SUPERHID_FINGERS];
 } __attribute__ ((__packed__));
 
 struct superhid_report_tablet
@@ -244,7 +265,6 @@ struct superhid_report_tablet
   uint16_t  x;              /* Absolute position on the X axis */
   uint16_t  y;              /* Absolute position on the Y axis */
   /* int8_t    wheel;          /\* Vertical scroll wheel. NOT USED *\/ */
-  uint8_t   pad[SUPERHID_REPORT_LENGTH - 6];
 } __attribute__ ((__packed__));
 
 struct superhid_report_keyboard
@@ -253,7 +273,6 @@ struct superhid_report_keyboard
   uint8_t  modifier;
   uint8_t  reserved;
   uint8_t  keycode[6];
-  uint8_t  pad[SUPERHID_REPORT_LENGTH - 9];
 } __attribute__ ((__packed__));
 
 struct superhid_report_mouse
@@ -268,7 +287,20 @@ struct superhid_report_mouse
   uint8_t   x;
   uint8_t   y;
   uint8_t   wheel;
-  uint8_t   pad[SUPERHID_REPORT_LENGTH - 5];
+} __attribute__ ((__packed__));
+
+struct superhid_report_mouse_wide
+{
+  uint8_t   report_id;     /* Should always be REPORT_ID_MOUSE_WIDE */
+  BIT_FIELD left_click:1;
+  BIT_FIELD right_click:1;
+  BIT_FIELD middle_click:1;
+  BIT_FIELD fourth_click:1;
+  BIT_FIELD fifth_click:1;
+  BIT_FIELD placeholder:3;
+  int16_t   x;
+  int16_t   y;
+  int16_t   wheel;
 } __attribute__ ((__packed__));
 
 /* Report IDs for the various devices */
@@ -279,17 +311,187 @@ struct superhid_report_mouse
 #define REPORT_ID_STYLUS        0x05
 #define REPORT_ID_PUCK          0x06
 #define REPORT_ID_FINGER        0x07
+#define REPORT_ID_MOUSE_WIDE    0x08
 /* #define REPORT_ID_MT_MAX_COUNT  0x10 */
 #define REPORT_ID_MT_MAX_COUNT  0x04 /* This doesn't need its own ID */
 #define REPORT_ID_CONFIG        0x11
 #define REPORT_ID_INVALID       0xff
 
-xc_gnttab *xcg_handle;
-struct superhid_backend superbacks[SUPERHID_MAX_BACKENDS];
-int input_grabber;
+struct superhid_device
+{
+  uint8_t                  devid;
+  xen_backend_t            backend;
+  struct superhid_backend *superback;
+  void                    *page;
+  usbif_back_ring_t        back_ring;
+  bool                     back_ring_ready;
+  int                      evtfd;
+  int                      uhid;               /* Local uhid device, or -1 */
+  void                    *priv;
+  uint64_t                 pendings[32];       /* usbif_request_t.id */
+  grant_ref_t              pendingrefs[32];    /* usbif_request_t.u.gref */
+  uint16_t                 pendingoffsets[32]; /* usbif_request_t.offset */
+  uint8_t                  pendinghead;
+  uint8_t                  pendingtail;
+  struct event             event;
+  enum superhid_type       type;
+  struct superhid_report   last_report;        /* Last report delivered */
+  uint64_t                 last_stamp;         /* When it got delivered */
+};
+
+/* This is actually 8, but we don't want to segv if input_server sends
+ * 10 */
+#define SUPERPLUGIN_MAX_FINGERS 10
+
+/**
+ * The input translation state of one domain. Every domain gets its
+ * own, so that several domains can be fed at the same time without
+ * stepping on each other's fingers.
+ */
+struct superplugin_state
+{
+  struct superhid_finger           fingers[SUPERPLUGIN_MAX_FINGERS];
+  struct superhid_report_tablet    tablet;
+  struct superhid_report_keyboard  keyboard;
+  struct superhid_report_mouse     mouse;
+  int                              multitouch_dev;
+  int                              finger;
+  int                              dev_set;
+  uint16_t                         dirty;      /* Contacts changed this frame */
+  uint16_t                         tip_dirty;  /* Contacts touched or lifted */
+  char                             mt_lossless;
+  uint8_t                          tablet_buttons; /* Last queued buttons */
+  uint8_t                          mouse_buttons;
+  uint64_t                         frame_stamp; /* When the frame started */
+  /* Relative moves not reported yet */
+  int32_t                          mouse_x;
+  int32_t                          mouse_y;
+  int32_t                          mouse_wheel;
+  /* The multitouch report being filled */
+  struct superhid_report_multitouch mt;
+  /* Absolute coordinates as the source reported them, they get
+   * transformed when the frame ends */
+  int32_t                          contact_x[SUPERPLUGIN_MAX_FINGERS];
+  int32_t                          contact_y[SUPERPLUGIN_MAX_FINGERS];
+  int32_t                          tablet_x;
+  int32_t                          tablet_y;
+  /* The events of the frame, held for the filters of the source */
+  struct frame_event               held[FRAME_MAX_EVENTS];
+  int                              held_count;
+};
+
+/**
+ * Motion prediction state of one source, see superpredict.c
+ */
+struct superpredict_axis
+{
+  int32_t  position;
+  int32_t  velocity;       /* Units per ms, 8 fractional bits */
+  uint64_t stamp;          /* When position got in */
+  bool     valid;
+};
+
+struct superpredict
+{
+  int                      source; /* For the range of the axes */
+  /* Per slot and axis, the last slot is for ABS_X/ABS_Y */
+  struct superpredict_axis axes[SUPERPLUGIN_MAX_FINGERS + 1][2];
+};
+
+struct superhid_queued_report
+{
+  struct superhid_report report;
+  uint64_t               stamp;   /* superhid_now() when its input got in */
+  uint8_t                length;  /* Passthrough report length, 0 for ours */
+};
+
+struct superhid_queue
+{
+  struct superhid_queued_report reports[SUPERHID_QUEUE_LENGTH];
+  unsigned int                  head;
+  unsigned int                  tail;
+};
+
+/* What to do when a domain doesn't consume its input fast enough */
+enum superhid_overflow
+{
+  SUPERHID_OVERFLOW_BLOCK = 0, /* Stop reading, input waits in the socket */
+  SUPERHID_OVERFLOW_DROP       /* Keep reading, drop the oldest reports */
+};
+
+/* Report classes, in delivery order */
+enum superhid_class
+{
+  SUPERHID_CLASS_LOSSLESS = 0, /* Key and button state changes */
+  SUPERHID_CLASS_MOTION,       /* Moves, can be merged or superseded */
+  SUPERHID_CLASSES
+};
+
+struct superhid_stats
+{
+  uint64_t delivered;
+  uint64_t merged;
+  uint64_t suppressed;   /* Duplicates of the last delivered report */
+  uint64_t dropped;
+  uint64_t expired;      /* Got too old to be worth delivering */
+  uint64_t unroutable;   /* The domain has no device for them */
+  uint64_t delay_total;  /* Sum of the queueing delays, in us */
+  uint64_t delay_max;    /* Worst queueing delay, in us */
+  uint64_t delay_recent; /* Moving average of the recent ones, in us */
+};
+
+struct supershm;
+
+struct superhid_backend
+{
+  xen_backend_t backend;
+  struct superhid_device *devices[BACKEND_DEVICE_MAX];
+  dominfo_t di;
+  struct buffer_t buffers;
+  struct event input_event;
+  struct superplugin_state state;
+  struct superhid_queue queues[SUPERHID_CLASSES];
+  int weight;    /* Share of the delivery work, see superscheduler.c */
+  int deficit;
+  struct superhid_stats stats[SUPERHID_CLASSES];
+  uint64_t focus_stamp;  /* When the input focus got moved here, or 0 */
+  int fingers_per_report; /* Depends on the digitizer the domain has */
+  bool wide_mouse;        /* The mouse takes 16 bits moves */
+  bool passthrough;       /* Has a device for the native HID reports */
+  bool input_attached;    /* superplugin_create() got done */
+  bool input_paused;      /* Stopped reading, the queue is full */
+  uint64_t keepalive;     /* Re-send identical reports after that, in us */
+  uint64_t max_age;       /* Motion older than that gets dropped, in us */
+  enum superhid_overflow overflow;
+  bool resync;            /* Lossless reports got dropped */
+  int credits;            /* Last advertised to input_server, or -1 */
+  struct supershm *shm;   /* Shared ring with input_server, or NULL */
+};
 
+/* Set in main(), each of them is defined once in the file named */
+extern xc_gnttab *xcg_handle;              /* superbackend.c */
+/* Advertise credits to input_server, superscheduler.c */
+extern bool superhid_credits;
+/* Read the input devices ourselves, superevdev.c */
+extern bool superhid_evdev;
+/* Offer shared rings to input_server, supershm.c */
+extern bool superhid_shm;
+/* Where input_server listens, superplugin.c */
+extern const char *superhid_socket_path;
+/* Only the focused domain gets the input, superplugin.c */
+extern bool superhid_focus;
+/* Filter stages, nothing gets held when 0, superfilter.c */
+extern int superfilter_count;
+/* The descriptor of the passthrough device, superhidraw.c */
+extern struct hid_report_desc *superhid_passthrough_desc;
+extern struct superhid_backend superbacks[SUPERHID_MAX_BACKENDS]; /* superbackend.c */
+
+uint64_t superhid_now(void);
 void superhid_init(void);
 int  superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type type);
+int  superhid_report_length(enum superhid_type type);
+int  superhid_input_length(enum superhid_type type, uint8_t report_id);
+struct hid_report_desc *superhid_report_desc(enum superhid_type type);
 int  superxenstore_init(void);
 int  superxenstore_create_usb(dominfo_t *domp, usbinfo_t *usbp);
 int  superxenstore_destroy_usb(dominfo_t *domp, usbinfo_t *usbp);
@@ -299,12 +501,76 @@ void superxenstore_close(void);
 int  superbackend_init(void);
 void superbackend_send(struct superhid_device *device, usbif_response_t *rsp);
 int  superbackend_find_slot(int domid);
+void superbackend_setup(struct superhid_backend *superback, dominfo_t di);
 int  superbackend_create(dominfo_t di);
-bool superbackend_all_pending(struct superhid_backend *superback);
-void superbackend_send_report_to_frontends(struct superhid_report *report,
+int  superbackend_send_report_to_frontends(struct superhid_report *report,
                                            struct superhid_backend *superback);
+int  superbackend_send_raw_to_frontends(struct superhid_report *report, int length,
+                                        struct superhid_backend *superback);
+int  superbackend_pending_requests(struct superhid_backend *superback);
 void superbackend_release(int slot);
 int  superplugin_create(struct superhid_backend *superback);
 void superplugin_release(struct superhid_backend *superback);
+int  superplugin_focus(struct superhid_backend *superback);
+struct superhid_backend *superplugin_focused(void);
+int  superplugin_targets(struct superhid_backend **targets);
+void superplugin_resume(struct superhid_backend *superback);
+void superplugin_resync(struct superhid_backend *superback);
+void superplugin_state_init(struct superplugin_state *st);
+void superplugin_credit(struct superhid_backend *superback);
+void superplugin_input(int dev, struct input_event *events, int count,
+                       uint64_t stamp);
+int  superplugin_process(struct superhid_backend *superback,
+                         struct event_record *r, uint64_t stamp);
+int  superscheduler_queue(struct superhid_backend *superback,
+                          struct superhid_report *report,
+                          enum superhid_class cls,
+                          uint64_t stamp);
+int  superscheduler_queue_raw(struct superhid_backend *superback,
+                              const void *data, int length, uint64_t stamp);
+void superscheduler_run(void);
+int  superscheduler_room(struct superhid_backend *superback);
+int  superscheduler_queued(struct superhid_backend *superback);
+int  superscheduler_discard(struct superhid_backend *superback);
+void superscheduler_print_stats(struct superhid_backend *superback);
+int  superevdev_init(void);
+void superevdev_close(void);
+int  superevdev_probe_range(int fd, int source);
+bool superevdev_wanted(int fd);
+int  supershm_offer(struct superhid_backend *superback);
+void supershm_kick(struct superhid_backend *superback);
+void supershm_release(struct superhid_backend *superback);
+int  superhidraw_report_length(const uint8_t *desc, int size);
+bool superhidraw_matches(const struct input_id *id);
+int  superhidraw_init(const char *path);
+void superhidraw_start(void);
+void superhidraw_close(void);
+int  supercapture_init(const char *path, size_t max_size);
+void supercapture_record(int domid, struct event_record *r, uint64_t stamp);
+void supercapture_close(void);
+int  superreplay_init(const char *path, bool fast);
+int  superreplay_bench(const char *path);
+void supertransform_init(void);
+void supertransform_set_range(int source, int32_t min_x, int32_t max_x,
+                              int32_t min_y, int32_t max_y);
+void supertransform_get_range(int source, int axis, int32_t *min, int32_t *max);
+int  supertransform_parse(const char *spec);
+void supertransform_apply(int source, const int32_t *x, const int32_t *y,
+                          uint16_t *out_x, uint16_t *out_y, int count);
+int  superfilter_parse(const char *spec);
+bool superfilter_active(int source);
+int  superfilter_run(int context, int source, struct frame_event *events, int count,
+                     uint64_t stamp);
+void superfilter_release(int context);
+void superfilter_print_stats(void);
+void superpredict_reset(struct superpredict *predict, int slot);
+int32_t superpredict_update(struct superpredict *predict, int slot, int axis,
+                            int32_t value, uint64_t stamp, uint64_t lead);
+uint64_t superpredict_lead(void);
+int  superreplay_predict_bench(const char *path);
+int  superuhid_init(const char *types);
+void superuhid_send(struct superhid_device *dev, struct superhid_report *report,
+                    int length);
+void superuhid_close(void);
 
 #endif 	    /* !PROJECT_H_ */
@@ -29,6 +29,9 @@
 
 #include "project.h"
 
+xc_gnttab *xcg_handle;
+struct superhid_backend superbacks[SUPERHID_MAX_BACKENDS];
+
 static void print_request(usbif_request_t *req)
 {
   superlog(LOG_DEBUG, "***** GOT REQUEST *****");
@@ -63,6 +66,7 @@ static void consume_requests(struct superhid_device *dev)
   uint64_t tocancel;
   int i;
   uint32_t domids[32];
+  bool new_pendings = false;
 
   if (!dev->back_ring_ready) {
     superlog(LOG_ERR, "Backend not ready to consume");
@@ -110,6 +114,7 @@ static void consume_requests(struct superhid_device *dev)
       dev->pendingrefs[dev->pendingtail] = req.u.gref[0];
       dev->pendingoffsets[dev->pendingtail] = req.offset;
       dev->pendingtail = (dev->pendingtail + 1) % 32;
+      new_pendings = true;
       break;
     case USBIF_T_RESET: /* (internal) Reset request, reply and do nothing */
       rsp.id            = req.id;
@@ -176,6 +181,11 @@ static void consume_requests(struct superhid_device *dev)
 
     superlog(LOG_DEBUG, "***********************");
   }
+
+  /* The guest is ready for more input, hand it whatever got queued
+   * while it wasn't */
+  if (new_pendings)
+    superscheduler_run();
 }
 
 static xen_device_t
@@ -189,9 +199,16 @@ superback_alloc(xen_backend_t backend, int devid, void *priv)
   dev->devid = devid;
   dev->backend = backend;
   dev->evtfd = -1;
+  dev->uhid = -1;
   dev->superback = superback;
   dev->type = devid;
   dev->back_ring_ready = false;
+  if (dev->type == SUPERHID_TYPE_DIGITIZER_FULL)
+    superback->fingers_per_report = SUPERHID_FINGERS;
+  if (dev->type == SUPERHID_TYPE_MOUSE_WIDE)
+    superback->wide_mouse = true;
+  if (dev->type == SUPERHID_TYPE_PASSTHROUGH)
+    superback->passthrough = true;
 
   superback->devices[devid] = dev;
 
@@ -240,7 +257,7 @@ superback_connect(xen_device_t xendev)
 
   /* Start grabbing the input events for the domain. After this,
    * input_server will send the events to us instead of the qemu/xenmou. */
-  if (dev->superback->buffers.s == 0 && superplugin_create(dev->superback) != 0) {
+  if (superplugin_create(dev->superback) != 0) {
     superlog(LOG_ERR, "Failed to grab events for domid %d", dev->superback->di.di_domid);
     return -1;
   }
@@ -298,7 +315,7 @@ superback_free(xen_device_t xendev)
   usbinfo_t ui;
 
   /* This function seems to get called with bogus values on shutdown */
-  if (dev != NULL && dev->devid > 0 && dev->devid < 6 &&
+  if (dev != NULL && dev->devid > 0 && dev->devid <= SUPERHID_TYPE_LAST &&
       dev->superback->devices[dev->devid] == dev) {
     superlog(LOG_DEBUG, "free device %d", dev->devid);
     dev->superback->devices[dev->devid] = NULL;
@@ -403,6 +420,29 @@ static int superbackend_find_free_slot(void)
     return i;
 }
 
+/**
+ * Initialize a backend with the default settings, without any device
+ *
+ * @param superback The backend to initialize
+ * @param di        The domain info
+ */
+void superbackend_setup(struct superhid_backend *superback, dominfo_t di)
+{
+  int i;
+
+  for (i = 0; i < BACKEND_DEVICE_MAX; ++i)
+    superback->devices[i] = NULL;
+  superback->di = di;
+  superback->weight = SUPERHID_DEFAULT_WEIGHT;
+  superback->fingers_per_report = SUPERHID_FINGER_WIDTH;
+  superback->wide_mouse = false;
+  superback->passthrough = false;
+  superback->keepalive = SUPERHID_DEFAULT_KEEPALIVE * 1000;
+  /* Every event gets delivered, unless the domain opts out */
+  superback->max_age = 0;
+  superback->overflow = SUPERHID_OVERFLOW_BLOCK;
+}
+
 /**
  * Creates and adds a SuperHID backend for a given domain
  *
@@ -412,7 +452,7 @@ static int superbackend_find_free_slot(void)
  */
 int superbackend_create(dominfo_t di)
 {
-  int slot, i;
+  int slot;
 
   slot = superbackend_find_free_slot();
   if (slot == -1) {
@@ -421,22 +461,27 @@ int superbackend_create(dominfo_t di)
   }
 
   /* Create the backend */
-  for (i = 0; i < BACKEND_DEVICE_MAX; ++i)
-    superbacks[slot].devices[i] = NULL;
   /* printf("SET %d %s %d TO SLOT %d\n", di.di_domid, di.di_name, di.di_dompath, slot); */
-  superbacks[slot].di = di;
+  superbackend_setup(&superbacks[slot], di);
   superbackend_add(di, &superbacks[slot]);
 
   return slot;
 }
 
-static void send_report(struct superhid_report *report, struct superhid_device *dev)
+static void send_report(struct superhid_report *report, int length,
+                        struct superhid_device *dev)
 {
   usbif_response_t rsp;
   unsigned char *data, *target;
 
+  if (dev->uhid >= 0) {
+    /* A local device, no frontend and no request to answer */
+    superuhid_send(dev, report, length);
+    goto sent;
+  }
+
   rsp.id            = dev->pendings[dev->pendinghead];
-  rsp.actual_length = SUPERHID_REPORT_LENGTH;
+  rsp.actual_length = length;
   rsp.data          = 0;
   rsp.status        = USBIF_RSP_OKAY;
 
@@ -449,41 +494,118 @@ static void send_report(struct superhid_report *report, struct superhid_device *
     return;
   }
   data = target + dev->pendingoffsets[dev->pendinghead];
-  memcpy(data, report, SUPERHID_REPORT_LENGTH);
+  memcpy(data, report, length);
 
   xc_gnttab_munmap(xcg_handle, target, 1);
   superbackend_send(dev, &rsp);
 
   dev->pendinghead = (dev->pendinghead + 1) % 32;
+
+sent:
+  memcpy(&dev->last_report, report, length);
+  dev->last_stamp = superhid_now();
 }
 
 /**
- * Checks if there's pending USBIF_T_INT requests for all the devices
- * handled by a given backend.
- * TODO: Make this device-specific. For example, we don't care about
- * pending keyboard requests if we're sending a mouse move.
+ * Checks if a report is the same absolute state as the last one the
+ * device got, recently enough that the guest doesn't need it again
  *
- * @param superback The SuperHID backend
+ * @param report The report about to be sent
+ * @param dev    The SuperHID device
  *
- * @return true if all devices are pending, false otherwise
+ * @return true if sending the report would be a waste
  */
-bool superbackend_all_pending(struct superhid_backend *superback)
+static bool is_duplicate(struct superhid_report *report, struct superhid_device *dev)
+{
+  struct superhid_report_multitouch *mt, *last_mt;
+  size_t offset;
+
+  if (report->report_id != REPORT_ID_TABLET && report->report_id != REPORT_ID_MULTITOUCH)
+    return false;
+  if (report->report_id != dev->last_report.report_id)
+    return false;
+  if (superhid_now() - dev->last_stamp >= dev->superback->keepalive)
+    return false;
+  if (report->report_id == REPORT_ID_TABLET)
+    return !memcmp(report, &dev->last_report,
+                   superhid_input_length(dev->type, report->report_id));
+
+  /* The scan time changes with every frame, only the contacts count */
+  mt = (struct superhid_report_multitouch *)report;
+  last_mt = (struct superhid_report_multitouch *)&dev->last_report;
+  offset = offsetof(struct superhid_report_multitouch, fingers);
+  return mt->count == last_mt->count &&
+    !memcmp(mt->fingers, last_mt->fingers,
+            superhid_input_length(dev->type, report->report_id) - offset);
+}
+
+/**
+ * Count the USBIF_T_INT requests the frontends of a domain left
+ * pending, which is how many reports it can take right now
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of pending requests, cancelled ones excluded
+ */
+int superbackend_pending_requests(struct superhid_backend *superback)
 {
-  int i;
   struct superhid_device *dev;
+  int i, j, ret = 0;
 
   for (i = 0; i < BACKEND_DEVICE_MAX; ++i) {
     dev = superback->devices[i];
-    if (dev != NULL) {
-      while (dev->pendinghead != dev->pendingtail && dev->pendings[dev->pendinghead] == -1)
-        dev->pendinghead = (dev->pendinghead + 1) % 32;
-      if (dev->pendinghead == dev->pendingtail) {
-        return false;
-      }
+    if (dev == NULL)
+      continue;
+    if (dev->uhid >= 0) {
+      /* Local devices take everything */
+      ret += 32;
+      continue;
     }
+    for (j = dev->pendinghead; j != dev->pendingtail; j = (j + 1) % 32)
+      if (dev->pendings[j] != -1)
+        ret++;
   }
 
-  return true;
+  return ret;
+}
+
+/**
+ * Checks if there's a pending USBIF_T_INT request for a device,
+ * skipping the ones that got cancelled
+ *
+ * @param dev The SuperHID device
+ *
+ * @return true if the device is pending, false otherwise
+ */
+static bool device_pending(struct superhid_device *dev)
+{
+  if (dev->uhid >= 0)
+    return true;
+  while (dev->pendinghead != dev->pendingtail && dev->pendings[dev->pendinghead] == -1)
+    dev->pendinghead = (dev->pendinghead + 1) % 32;
+
+  return dev->pendinghead != dev->pendingtail;
+}
+
+/**
+ * Checks if a device takes a given kind of report
+ *
+ * @param dev The SuperHID device
+ * @param id  The report ID
+ *
+ * @return true if the report is for the device
+ */
+static bool device_takes(struct superhid_device *dev, uint8_t id)
+{
+  enum superhid_type type = dev->type;
+
+  return type == SUPERHID_TYPE_MULTI                                    ||
+    (type == SUPERHID_TYPE_MOUSE     && id == REPORT_ID_MOUSE)          ||
+    (type == SUPERHID_TYPE_MOUSE_WIDE && id == REPORT_ID_MOUSE_WIDE)    ||
+    (type == SUPERHID_TYPE_DIGITIZER && id == REPORT_ID_MULTITOUCH)     ||
+    (type == SUPERHID_TYPE_DIGITIZER_FULL && id == REPORT_ID_MULTITOUCH) ||
+    (type == SUPERHID_TYPE_TABLET    && id == REPORT_ID_TABLET)         ||
+    (type == SUPERHID_TYPE_KEYBOARD  && id == REPORT_ID_KEYBOARD);
 }
 
 /**
@@ -491,31 +613,64 @@ bool superbackend_all_pending(struct superhid_backend *superback)
  *
  * @param report    The report to send
  * @param superback The backend to use
+ *
+ * @return 0 on success, 1 if the report was a duplicate and got
+ *         skipped, -1 if no compatible device is pending, -2 if the
+ *         domain has no compatible device at all
  */
-void superbackend_send_report_to_frontends(struct superhid_report *report,
-                                           struct superhid_backend *superback)
+int superbackend_send_report_to_frontends(struct superhid_report *report,
+                                          struct superhid_backend *superback)
 {
-  int i, type, id;
   struct superhid_device *dev;
+  bool found = false;
+  int i;
 
   for (i = 0; i < BACKEND_DEVICE_MAX; ++i) {
     dev = superback->devices[i];
-    if (dev != NULL && dev->pendinghead != dev->pendingtail) {
-      /* This device is pending, send the report if it matches */
-      type = dev->type;
-      id = report->report_id;
-      if ( type == SUPERHID_TYPE_MULTI                                    ||
-          (type == SUPERHID_TYPE_MOUSE     && id == REPORT_ID_MOUSE)      ||
-          (type == SUPERHID_TYPE_DIGITIZER && id == REPORT_ID_MULTITOUCH) ||
-          (type == SUPERHID_TYPE_TABLET    && id == REPORT_ID_TABLET)     ||
-          (type == SUPERHID_TYPE_KEYBOARD  && id == REPORT_ID_KEYBOARD)) {
-        send_report(report, superback->devices[i]);
-        return;
-      }
+    if (dev == NULL || !device_takes(dev, report->report_id))
+      continue;
+    found = true;
+    if (device_pending(dev)) {
+      if (is_duplicate(report, dev))
+        return 1;
+      send_report(report, superhid_input_length(dev->type, report->report_id), dev);
+      return 0;
+    }
+  }
+
+  return found ? -1 : -2;
+}
+
+/**
+ * Send a native HID report to the passthrough device of a domain, as
+ * is
+ *
+ * @param report    The report
+ * @param length    The length of the report
+ * @param superback The backend of the domain
+ *
+ * @return 0 when the report got sent, -1 if the device isn't pending,
+ *         -2 if the domain has no passthrough device
+ */
+int superbackend_send_raw_to_frontends(struct superhid_report *report, int length,
+                                       struct superhid_backend *superback)
+{
+  struct superhid_device *dev;
+  bool found = false;
+  int i;
+
+  for (i = 0; i < BACKEND_DEVICE_MAX; ++i) {
+    dev = superback->devices[i];
+    if (dev == NULL || dev->type != SUPERHID_TYPE_PASSTHROUGH)
+      continue;
+    found = true;
+    if (device_pending(dev)) {
+      send_report(report, length, dev);
+      return 0;
     }
   }
 
-  superlog(LOG_ERR, "COULD NOT SEND REPORT %d", report->report_id);
+  return found ? -1 : -2;
 }
 
 /**
@@ -530,6 +685,7 @@ void superbackend_release(int slot)
 
   superback = &superbacks[slot];
   superplugin_release(superback);
+  superscheduler_print_stats(superback);
   backend_release(superback->backend);
   superxenstore_destroy_backend(&superback->di);
   memset(superback, 0, sizeof(*superback));
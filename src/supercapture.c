@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   supercapture.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 19:47:10 2026
+ *
+ * @brief  Input flight recorder
+ *
+ * When enabled, every event record that gets translated is appended
+ * to a capture file, see struct capture_header in superproto.h.
+ * Recording only copies the record to a ring, a thread writes the ring
+ * to the file in big chunks, so the input path never waits on the
+ * disk. When the file gets too big, it's moved to <path>.1 and a new
+ * one gets started.
+ */
+
+#include "project.h"
+
+/* Records in the ring, has to be a power of 2 */
+#define CAPTURE_RING_RECORDS    65536
+/* How long the writer sleeps when there's nothing to write, in us */
+#define CAPTURE_PERIOD          20000
+
+static struct capture_record *ring = NULL;
+static uint32_t ring_head = 0; /* Writer */
+static uint32_t ring_tail = 0; /* Recorder */
+static uint64_t dropped = 0;   /* Records that never made it to a file */
+
+static const char *capture_path;
+static FILE *capture_file;
+static size_t capture_size;
+static size_t capture_max_size;
+static pthread_t writer;
+static volatile bool running = false;
+
+static int start_file(void)
+{
+  struct capture_header header;
+
+  capture_file = fopen(capture_path, "w");
+  if (capture_file == NULL) {
+    superlog(LOG_ERR, "Failed to create %s: %s", capture_path, strerror(errno));
+    return -1;
+  }
+
+  header.magic = CAPTURE_MAGIC;
+  header.version = CAPTURE_VERSION;
+  header.record_size = sizeof(struct capture_record);
+  header.start = superhid_now();
+  if (fwrite(&header, sizeof(header), 1, capture_file) != 1) {
+    superlog(LOG_ERR, "Failed to write to %s: %s", capture_path, strerror(errno));
+    fclose(capture_file);
+    capture_file = NULL;
+    return -1;
+  }
+  capture_size = sizeof(header);
+
+  return 0;
+}
+
+static void rotate(void)
+{
+  char old[PATH_MAX];
+
+  fclose(capture_file);
+  snprintf(old, PATH_MAX, "%s.1", capture_path);
+  if (rename(capture_path, old) < 0)
+    superlog(LOG_ERR, "Failed to rotate %s: %s", capture_path, strerror(errno));
+  if (start_file() < 0)
+    superlog(LOG_ERR, "The capture stops here");
+}
+
+/**
+ * Write everything the ring has
+ *
+ * @return The number of records written
+ */
+static uint32_t drain(void)
+{
+  uint32_t head, tail, count, index, total;
+  size_t written;
+
+  head = ring_head;
+  tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+  total = tail - head;
+  while (head != tail && capture_file != NULL) {
+    /* Up to the end of the ring at once */
+    index = head % CAPTURE_RING_RECORDS;
+    count = tail - head;
+    if (count > CAPTURE_RING_RECORDS - index)
+      count = CAPTURE_RING_RECORDS - index;
+    written = fwrite(&ring[index], sizeof(struct capture_record), count, capture_file);
+    capture_size += written * sizeof(struct capture_record);
+    head += count;
+    __atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+    if (written < count) {
+      /* Disk full or worse, there's no point in trying again */
+      superlog(LOG_ERR, "Failed to write to %s: %s, the capture stops here",
+               capture_path, strerror(errno));
+      __atomic_fetch_add(&dropped, count - written, __ATOMIC_RELAXED);
+      fclose(capture_file);
+      capture_file = NULL;
+    } else if (capture_size >= capture_max_size) {
+      rotate();
+    }
+  }
+  /* Without a file there's nowhere to write to, forget it */
+  __atomic_fetch_add(&dropped, tail - head, __ATOMIC_RELAXED);
+  __atomic_store_n(&ring_head, tail, __ATOMIC_RELEASE);
+
+  return total;
+}
+
+static void *writer_thread(void *arg)
+{
+  while (running) {
+    if (drain() == 0 && capture_file != NULL)
+      fflush(capture_file);
+    usleep(CAPTURE_PERIOD);
+  }
+  drain();
+
+  return NULL;
+}
+
+/**
+ * Start capturing the input
+ *
+ * @param path     The path of the capture file
+ * @param max_size The size at which the file gets rotated, in bytes
+ *
+ * @return 0 on success, -1 on error
+ */
+int supercapture_init(const char *path, size_t max_size)
+{
+  ring = calloc(CAPTURE_RING_RECORDS, sizeof(struct capture_record));
+  if (ring == NULL)
+    return -1;
+
+  capture_path = path;
+  capture_max_size = max_size;
+  if (start_file() < 0)
+    goto fail;
+
+  running = true;
+  if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+    superlog(LOG_ERR, "Failed to start the capture thread");
+    running = false;
+    fclose(capture_file);
+    goto fail;
+  }
+  superlog(LOG_INFO, "Capturing the input to %s", path);
+
+  return 0;
+
+fail:
+  free(ring);
+  ring = NULL;
+  return -1;
+}
+
+/**
+ * Record an event record. Only copies it to the ring, or drops it if
+ * the writer is lagging that much behind.
+ *
+ * @param domid The domain the record is for
+ * @param r     The record
+ * @param stamp superhid_now() when it got in
+ */
+void supercapture_record(int domid, struct event_record *r, uint64_t stamp)
+{
+  struct capture_record *record;
+  uint32_t tail;
+
+  if (ring == NULL)
+    return;
+
+  tail = ring_tail;
+  if (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) >= CAPTURE_RING_RECORDS) {
+    __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  record = &ring[tail % CAPTURE_RING_RECORDS];
+  record->stamp = stamp;
+  record->domid = domid;
+  record->itype = r->itype;
+  record->icode = r->icode;
+  record->ivalue = r->ivalue;
+  __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Stop capturing, after writing everything that's left
+ */
+void supercapture_close(void)
+{
+  if (ring == NULL)
+    return;
+
+  running = false;
+  pthread_join(writer, NULL);
+  /* What's still buffered gets written now */
+  if (capture_file != NULL && fclose(capture_file) != 0)
+    superlog(LOG_ERR, "Failed to write to %s: %s", capture_path, strerror(errno));
+  capture_file = NULL;
+  if (dropped > 0)
+    superlog(LOG_INFO, "%"PRIu64" records didn't make it to the capture", dropped);
+  dropped = 0;
+  free(ring);
+  ring = NULL;
+}
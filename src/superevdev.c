@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superevdev.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 15:02:17 2026
+ *
+ * @brief  Direct evdev input source
+ *
+ * This is an alternative to input_server. The input devices are opened
+ * and grabbed directly, their events are read in batches and fed to
+ * all the domains, or to the one that has the input focus in focus
+ * mode.
+ * Devices that show up or go away later are picked up through inotify
+ * on /dev/input.
+ * Only pointing devices and keyboards get grabbed. Power buttons, lid
+ * switches and the like stay with the host, and so do our own uhid
+ * devices, which would otherwise feed their reports back to us. The
+ * passthrough device is left alone too, see superhidraw.c.
+ */
+
+#include "project.h"
+
+#define EVDEV_PATH              "/dev/input"
+#define EVDEV_PATTERN           "event*"
+#define EVDEV_MAX_DEVICES       32
+#define EVDEV_BATCH             64 /* Events read at once */
+
+#define BITS_PER_LONG           (sizeof(unsigned long) * 8)
+#define NLONGS(x)               (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(bit, array)    ((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+struct evdev_device
+{
+  int               fd;
+  char              name[NAME_MAX + 1];
+  struct event      event;
+};
+
+static struct evdev_device devices[EVDEV_MAX_DEVICES];
+static int inotify_fd = -1;
+static struct event inotify_event;
+
+bool superhid_evdev;
+
+static void close_device(int index)
+{
+  struct evdev_device *device = &devices[index];
+
+  superlog(LOG_INFO, "Releasing input device %s", device->name);
+  event_del(&device->event);
+  ioctl(device->fd, EVIOCGRAB, 0);
+  close(device->fd);
+  device->fd = -1;
+}
+
+static void device_handler(int fd, short event, void *priv)
+{
+  int index = (intptr_t)priv;
+  struct input_event events[EVDEV_BATCH];
+  uint64_t stamp;
+  ssize_t n;
+  int count;
+
+  /* Drain everything the device has, a batch at a time. The absolute
+   * coordinates go as is, the transform knows the range of the device */
+  while ((n = read(fd, events, sizeof(events))) > 0) {
+    stamp = superhid_now();
+    count = n / sizeof(struct input_event);
+    superplugin_input(index, events, count, stamp);
+  }
+
+  if (n < 0 && errno != EAGAIN && errno != EINTR)
+    /* The device went away */
+    close_device(index);
+}
+
+static bool get_range(int fd, int code_x, int code_y,
+                      struct input_absinfo *x, struct input_absinfo *y)
+{
+  /* Devices answer for the axes they don't have too, with an empty
+   * range */
+  return ioctl(fd, EVIOCGABS(code_x), x) == 0 && ioctl(fd, EVIOCGABS(code_y), y) == 0 &&
+    x->maximum > x->minimum && y->maximum > y->minimum;
+}
+
+/**
+ * Tell the transform the range of the absolute axes of a device, the
+ * multitouch ones first, the others are usually the same. Devices
+ * without absolute axes get the input_server range, which may not be
+ * what the previous device of the source had.
+ *
+ * @param fd     The device
+ * @param source The source its events come from
+ *
+ * @return 0 if the device has absolute axes, -1 otherwise
+ */
+int superevdev_probe_range(int fd, int source)
+{
+  struct input_absinfo x, y;
+
+  if (get_range(fd, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, &x, &y) ||
+      get_range(fd, ABS_X, ABS_Y, &x, &y)) {
+    supertransform_set_range(source, x.minimum, x.maximum, y.minimum, y.maximum);
+    return 0;
+  }
+
+  supertransform_set_range(source, 0, SUPERTRANSFORM_MAX, 0, SUPERTRANSFORM_MAX);
+  return -1;
+}
+
+/**
+ * Check whether an input device is one we should take: something with
+ * relative or absolute axes, or a keyboard. Keys alone don't make a
+ * keyboard, power buttons and the like have some too, so it takes
+ * letters.
+ *
+ * @param fd The device
+ *
+ * @return true if the device should be grabbed, false otherwise
+ */
+bool superevdev_wanted(int fd)
+{
+  unsigned long types[NLONGS(EV_CNT)] = { 0 };
+  unsigned long keys[NLONGS(KEY_CNT)] = { 0 };
+  struct input_id id;
+
+  if (ioctl(fd, EVIOCGID, &id) == 0) {
+    if (id.vendor == SUPERHID_VENDOR && id.product == SUPERHID_DEVICE)
+      /* One of ours, see superuhid.c */
+      return false;
+    if (superhidraw_matches(&id))
+      /* Its reports already go through as is */
+      return false;
+  }
+
+  if (ioctl(fd, EVIOCGBIT(0, sizeof(types)), types) < 0)
+    return false;
+  if (TEST_BIT(EV_REL, types) || TEST_BIT(EV_ABS, types))
+    return true;
+  if (!TEST_BIT(EV_KEY, types))
+    return false;
+  if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keys)), keys) < 0)
+    return false;
+
+  return TEST_BIT(KEY_A, keys) && TEST_BIT(KEY_Z, keys);
+}
+
+/**
+ * Open and grab an input device, unless we already have it
+ *
+ * @param name The name of the device node in /dev/input
+ *
+ * @return 0 on success, -1 on error
+ */
+static int open_device(const char *name)
+{
+  char path[256];
+  struct evdev_device *device;
+  int i, fd, free_slot = -1;
+
+  if (fnmatch(EVDEV_PATTERN, name, 0))
+    return -1;
+
+  for (i = 0; i < EVDEV_MAX_DEVICES; ++i) {
+    if (devices[i].fd < 0) {
+      if (free_slot == -1)
+        free_slot = i;
+    } else if (!strcmp(devices[i].name, name))
+      return 0;
+  }
+  if (free_slot == -1) {
+    superlog(LOG_ERR, "Too many input devices, ignoring %s", name);
+    return -1;
+  }
+
+  snprintf(path, 256, "%s/%s", EVDEV_PATH, name);
+  fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    /* udev may not be done with it, we'll retry on IN_ATTRIB */
+    superlog(LOG_DEBUG, "Failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+  if (!superevdev_wanted(fd)) {
+    superlog(LOG_DEBUG, "Leaving %s alone", path);
+    close(fd);
+    return -1;
+  }
+  if (ioctl(fd, EVIOCGRAB, 1) < 0) {
+    superlog(LOG_ERR, "Failed to grab %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  device = &devices[free_slot];
+  memset(device, 0, sizeof(*device));
+  device->fd = fd;
+  strncpy(device->name, name, NAME_MAX);
+  /* The device is the source of its events */
+  superevdev_probe_range(fd, free_slot);
+
+  event_set(&device->event, fd, EV_READ | EV_PERSIST,
+            device_handler, (void *)(intptr_t)free_slot);
+  event_add(&device->event, NULL);
+  superlog(LOG_INFO, "Grabbed input device %s", path);
+
+  return 0;
+}
+
+static void inotify_handler(int fd, short event, void *priv)
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t n;
+  char *p;
+  int i;
+
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *)p;
+      if (ev->len == 0)
+        continue;
+      if (ev->mask & (IN_CREATE | IN_ATTRIB))
+        open_device(ev->name);
+      if (ev->mask & IN_DELETE)
+        for (i = 0; i < EVDEV_MAX_DEVICES; ++i)
+          if (devices[i].fd >= 0 && !strcmp(devices[i].name, ev->name))
+            close_device(i);
+    }
+  }
+}
+
+/**
+ * Grab all the input devices and start watching for new ones. Must be
+ * called after event_init().
+ *
+ * @return 0 on success, -1 on error
+ */
+int superevdev_init(void)
+{
+  DIR *dir;
+  struct dirent *entry;
+  int i;
+
+  for (i = 0; i < EVDEV_MAX_DEVICES; ++i)
+    devices[i].fd = -1;
+
+  /* Watch first, so that no device falls in between */
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0) {
+    superlog(LOG_ERR, "Failed to initialize inotify: %s", strerror(errno));
+    return -1;
+  }
+  if (inotify_add_watch(inotify_fd, EVDEV_PATH, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+    superlog(LOG_ERR, "Failed to watch %s: %s", EVDEV_PATH, strerror(errno));
+    close(inotify_fd);
+    return -1;
+  }
+  event_set(&inotify_event, inotify_fd, EV_READ | EV_PERSIST,
+            inotify_handler, NULL);
+  event_add(&inotify_event, NULL);
+
+  dir = opendir(EVDEV_PATH);
+  if (dir == NULL) {
+    superlog(LOG_ERR, "Failed to open %s: %s", EVDEV_PATH, strerror(errno));
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL)
+    open_device(entry->d_name);
+  closedir(dir);
+
+  return 0;
+}
+
+/**
+ * Release all the input devices
+ */
+void superevdev_close(void)
+{
+  int i;
+
+  for (i = 0; i < EVDEV_MAX_DEVICES; ++i)
+    if (devices[i].fd >= 0)
+      close_device(i);
+
+  if (inotify_fd >= 0) {
+    event_del(&inotify_event);
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+}
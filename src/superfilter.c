@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superfilter.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Wed Oct 21 10:17:44 2026
+ *
+ * @brief  Input filters
+ *
+ * Every source (DEV_SET device) can have a pipeline of filter stages.
+ * The events of a source that has one are held until the end of the
+ * frame (SYN_REPORT), then every stage gets to modify or drop events
+ * of the whole frame, in the order they got added, before it gets
+ * translated. A stage can be limited to the frames that carry input
+ * for some device types, like only the keyboard frames.
+ * The stages keep state, like the last positions. Each domain with its
+ * own input_server connection gets its own state, created on its first
+ * frame, so domains never see each other's frames. The local input
+ * (evdev, hidraw, replay) gets filtered once for all the domains it
+ * goes to, with a state of its own.
+ * Sources without filters don't get held, and when no filter is
+ * configured at all it only costs the translation a test.
+ * The time spent in each stage gets measured, and logged with the
+ * rest of the statistics on SIGUSR1.
+ */
+
+#include "project.h"
+
+#define SUPERFILTER_MAX_STAGES  8  /* Per source */
+#define SUPERFILTER_MAX_CODES   0x120 /* Keys and the mouse buttons */
+/* The domains, then the local input */
+#define SUPERFILTER_CONTEXTS    (SUPERFILTER_LOCAL + 1)
+/* Fractional bits of the smoothed positions */
+#define SMOOTH_FRAC             8
+#define DEBOUNCE_DEFAULT        20 /* ms */
+#define SMOOTH_DEFAULT          2
+
+struct superfilter_ops
+{
+  const char *name;
+  int         arg_min;   /* The range of the optional argument */
+  int         arg_max;
+  void *(*create)(int source, int arg);
+  /* Filter a frame in place, returns the number of events left */
+  int (*run)(void *priv, struct frame_event *events, int count, uint64_t stamp);
+};
+
+struct superfilter_stage
+{
+  const struct superfilter_ops *ops;
+  int       arg;         /* 0 for the default */
+  void     *priv[SUPERFILTER_CONTEXTS]; /* Created on the first frame */
+  int       types;       /* Bitmask of enum superhid_type */
+  /* Statistics */
+  uint64_t  frames;
+  uint64_t  dropped;     /* Events */
+  uint64_t  time_total;  /* ns */
+  uint64_t  time_max;    /* ns */
+};
+
+static struct superfilter_stage pipelines[SUPERTRANSFORM_MAX_SOURCES][SUPERFILTER_MAX_STAGES];
+static int lengths[SUPERTRANSFORM_MAX_SOURCES];
+
+int superfilter_count;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The stages track the contacts by slot. A slot we have no room for
+ * isn't tracked, its events go as they are until the next valid
+ * ABS_MT_SLOT, and the translation ignores them.
+ */
+static int valid_slot(uint32_t slot)
+{
+  return slot < SUPERPLUGIN_MAX_FINGERS ? slot : -1;
+}
+
+/**
+ * Smoothing: exponential moving average of the absolute positions,
+ * value += (new - value) >> strength. New contacts start where they
+ * touch.
+ */
+struct smooth
+{
+  int     strength;
+  int     slot;
+  /* Per slot, the last one is for ABS_X/ABS_Y */
+  bool    fresh_x[SUPERPLUGIN_MAX_FINGERS + 1];
+  bool    fresh_y[SUPERPLUGIN_MAX_FINGERS + 1];
+  int32_t x[SUPERPLUGIN_MAX_FINGERS + 1];
+  int32_t y[SUPERPLUGIN_MAX_FINGERS + 1];
+};
+
+static void *smooth_create(int source, int arg)
+{
+  struct smooth *smooth = calloc(1, sizeof(*smooth));
+  int i;
+
+  if (smooth == NULL)
+    return NULL;
+  smooth->strength = arg > 0 ? arg : SMOOTH_DEFAULT;
+  for (i = 0; i <= SUPERPLUGIN_MAX_FINGERS; ++i)
+    smooth->fresh_x[i] = smooth->fresh_y[i] = true;
+
+  return smooth;
+}
+
+static uint32_t smooth_value(struct smooth *smooth, int32_t *value, bool *fresh, uint32_t raw)
+{
+  int32_t target = (int32_t)raw << SMOOTH_FRAC;
+
+  if (*fresh)
+    *value = target;
+  else
+    *value += (target - *value) >> smooth->strength;
+  *fresh = false;
+
+  return *value >> SMOOTH_FRAC;
+}
+
+static int smooth_run(void *priv, struct frame_event *events, int count, uint64_t stamp)
+{
+  struct smooth *smooth = priv;
+  int i, index;
+
+  for (i = 0; i < count; ++i) {
+    if (events[i].type != EV_ABS)
+      continue;
+    index = events[i].code > ABS_MT_SLOT ? smooth->slot : SUPERPLUGIN_MAX_FINGERS;
+    if (index < 0)
+      continue;
+    switch (events[i].code) {
+    case ABS_MT_SLOT:
+      smooth->slot = valid_slot(events[i].value);
+      break;
+    case ABS_MT_TRACKING_ID:
+      smooth->fresh_x[index] = smooth->fresh_y[index] = true;
+      break;
+    case ABS_X:
+    case ABS_MT_POSITION_X:
+      events[i].value = smooth_value(smooth, &smooth->x[index],
+                                     &smooth->fresh_x[index], events[i].value);
+      break;
+    case ABS_Y:
+    case ABS_MT_POSITION_Y:
+      events[i].value = smooth_value(smooth, &smooth->y[index],
+                                     &smooth->fresh_y[index], events[i].value);
+      break;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Debouncing: a key or button that gets pressed again within the
+ * window after a release is chattering. That press and its release
+ * get dropped.
+ */
+struct debounce
+{
+  uint64_t window; /* us */
+  uint64_t released[SUPERFILTER_MAX_CODES];
+  bool     swallowed[SUPERFILTER_MAX_CODES];
+};
+
+static void *debounce_create(int source, int arg)
+{
+  struct debounce *debounce = calloc(1, sizeof(*debounce));
+
+  if (debounce == NULL)
+    return NULL;
+  debounce->window = (arg > 0 ? arg : DEBOUNCE_DEFAULT) * 1000;
+
+  return debounce;
+}
+
+static int debounce_run(void *priv, struct frame_event *events, int count, uint64_t stamp)
+{
+  struct debounce *debounce = priv;
+  uint16_t code;
+  int i, kept = 0;
+  bool drop;
+
+  for (i = 0; i < count; ++i) {
+    drop = false;
+    code = events[i].code;
+    if (events[i].type == EV_KEY && code < SUPERFILTER_MAX_CODES) {
+      if (events[i].value == 1) {
+        if (debounce->released[code] != 0 &&
+            stamp - debounce->released[code] < debounce->window) {
+          debounce->swallowed[code] = true;
+          drop = true;
+        }
+      } else if (events[i].value == 0) {
+        if (debounce->swallowed[code]) {
+          debounce->swallowed[code] = false;
+          drop = true;
+        } else
+          debounce->released[code] = stamp;
+      }
+    }
+    if (!drop)
+      events[kept++] = events[i];
+  }
+
+  return kept;
+}
+
+/**
+ * Dedupe: absolute positions that didn't change since the last time
+ * the same contact reported them get dropped.
+ */
+struct dedupe
+{
+  int      slot;
+  uint32_t x[SUPERPLUGIN_MAX_FINGERS + 1];
+  uint32_t y[SUPERPLUGIN_MAX_FINGERS + 1];
+};
+
+static void *dedupe_create(int source, int arg)
+{
+  struct dedupe *dedupe = calloc(1, sizeof(*dedupe));
+
+  if (dedupe != NULL) {
+    memset(dedupe->x, 0xFF, sizeof(dedupe->x));
+    memset(dedupe->y, 0xFF, sizeof(dedupe->y));
+  }
+
+  return dedupe;
+}
+
+static int dedupe_run(void *priv, struct frame_event *events, int count, uint64_t stamp)
+{
+  struct dedupe *dedupe = priv;
+  uint32_t *last = NULL;
+  int i, index, kept = 0;
+
+  for (i = 0; i < count; ++i) {
+    last = NULL;
+    index = events[i].code > ABS_MT_SLOT ? dedupe->slot : SUPERPLUGIN_MAX_FINGERS;
+    if (events[i].type == EV_ABS && index >= 0) {
+      switch (events[i].code) {
+      case ABS_MT_SLOT:
+        dedupe->slot = valid_slot(events[i].value);
+        break;
+      case ABS_MT_TRACKING_ID:
+        /* A new contact has to say where it is */
+        dedupe->x[index] = dedupe->y[index] = 0xFFFFFFFF;
+        break;
+      case ABS_X:
+      case ABS_MT_POSITION_X:
+        last = &dedupe->x[index];
+        break;
+      case ABS_Y:
+      case ABS_MT_POSITION_Y:
+        last = &dedupe->y[index];
+        break;
+      }
+    }
+    if (last != NULL) {
+      if (*last == events[i].value)
+        continue;
+      *last = events[i].value;
+    }
+    events[kept++] = events[i];
+  }
+
+  return kept;
+}
+
+/**
+ * Prediction: absolute positions get extrapolated by the time they
+ * take to reach the guest, see superpredict.c. That's a fixed lead in
+ * ms, or the measured delay of the slowest domain by default.
+ */
+struct predict
+{
+  uint64_t            lead; /* us, 0 for the measured one */
+  int                 slot;
+  struct superpredict predict;
+};
+
+static void *predict_create(int source, int arg)
+{
+  struct predict *predict = calloc(1, sizeof(*predict));
+
+  if (predict == NULL)
+    return NULL;
+  predict->predict.source = source;
+  if (arg > 0)
+    predict->lead = arg * 1000;
+
+  return predict;
+}
+
+static int predict_run(void *priv, struct frame_event *events, int count, uint64_t stamp)
+{
+  struct predict *predict = priv;
+  uint64_t lead;
+  int i, index;
+
+  lead = predict->lead != 0 ? predict->lead : superpredict_lead();
+  for (i = 0; i < count; ++i) {
+    if (events[i].type != EV_ABS)
+      continue;
+    index = events[i].code > ABS_MT_SLOT ? predict->slot : SUPERPLUGIN_MAX_FINGERS;
+    if (index < 0)
+      continue;
+    switch (events[i].code) {
+    case ABS_MT_SLOT:
+      predict->slot = valid_slot(events[i].value);
+      break;
+    case ABS_MT_TRACKING_ID:
+      superpredict_reset(&predict->predict, index);
+      break;
+    case ABS_X:
+    case ABS_MT_POSITION_X:
+      events[i].value = superpredict_update(&predict->predict, index, 0,
+                                            events[i].value, stamp, lead);
+      break;
+    case ABS_Y:
+    case ABS_MT_POSITION_Y:
+      events[i].value = superpredict_update(&predict->predict, index, 1,
+                                            events[i].value, stamp, lead);
+      break;
+    }
+  }
+
+  return count;
+}
+
+static const struct superfilter_ops filters[] = {
+  { "smooth",   1, 8,    smooth_create,   smooth_run },
+  { "debounce", 1, 1000, debounce_create, debounce_run },
+  { "dedupe",   0, 0,    dedupe_create,   dedupe_run },
+  { "predict",  0, 50,   predict_create,  predict_run },
+};
+
+static int parse_types(const char *name)
+{
+  if (!strcmp(name, "all"))
+    return ~0;
+  if (!strcmp(name, "mouse"))
+    return 1 << SUPERHID_TYPE_MOUSE | 1 << SUPERHID_TYPE_MOUSE_WIDE;
+  if (!strcmp(name, "digitizer"))
+    return 1 << SUPERHID_TYPE_DIGITIZER | 1 << SUPERHID_TYPE_DIGITIZER_FULL;
+  if (!strcmp(name, "tablet"))
+    return 1 << SUPERHID_TYPE_TABLET;
+  if (!strcmp(name, "keyboard"))
+    return 1 << SUPERHID_TYPE_KEYBOARD;
+
+  return 0;
+}
+
+/**
+ * Figure out which device types a frame has input for, the same way
+ * process_absolute_event() dispatches the events
+ */
+static int frame_types(struct frame_event *events, int count)
+{
+  int i, types = 0;
+
+  for (i = 0; i < count; ++i) {
+    switch (events[i].type) {
+    case EV_REL:
+      types |= parse_types("mouse");
+      break;
+    case EV_ABS:
+      if (events[i].code >= ABS_MT_SLOT)
+        types |= parse_types("digitizer");
+      else
+        types |= parse_types("tablet");
+      break;
+    case EV_KEY:
+      if (events[i].code < BTN_MISC)
+        types |= parse_types("keyboard");
+      else
+        types |= parse_types("tablet") | parse_types("mouse");
+      break;
+    }
+  }
+
+  return types;
+}
+
+static int add_stage(int source, int types, const struct superfilter_ops *ops, int arg)
+{
+  struct superfilter_stage *stage;
+
+  if (lengths[source] == SUPERFILTER_MAX_STAGES)
+    return -1;
+
+  stage = &pipelines[source][lengths[source]];
+  memset(stage, 0, sizeof(*stage));
+  stage->ops = ops;
+  stage->types = types;
+  stage->arg = arg;
+  lengths[source]++;
+  superfilter_count++;
+
+  return 0;
+}
+
+/**
+ * Add a filter stage from a string like "SOURCE:TYPE:NAME[:ARG]".
+ * SOURCE is a DEV_SET device or "*" for all of them, TYPE is all,
+ * mouse, digitizer, tablet or keyboard, NAME is smooth (ARG: strength,
+ * 1-8), debounce (ARG: window in ms, up to 1000), dedupe or predict
+ * (ARG: lead in ms, up to 50, measured by default or with 0).
+ *
+ * @param spec The filter
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int superfilter_parse(const char *spec)
+{
+  char source[16], type[16], name[16];
+  const struct superfilter_ops *ops = NULL;
+  int i, n, types, arg = 0, first, last;
+
+  n = sscanf(spec, "%15[^:]:%15[^:]:%15[^:]:%d", source, type, name, &arg);
+  if (n < 3)
+    return -1;
+
+  types = parse_types(type);
+  for (i = 0; i < sizeof(filters) / sizeof(filters[0]); ++i)
+    if (!strcmp(name, filters[i].name))
+      ops = &filters[i];
+  if (types == 0 || ops == NULL)
+    return -1;
+  if (n == 4 && (arg < ops->arg_min || arg > ops->arg_max))
+    return -1;
+
+  if (!strcmp(source, "*")) {
+    first = 0;
+    last = SUPERTRANSFORM_MAX_SOURCES - 1;
+  } else {
+    first = last = strtol(source, NULL, 10);
+    if (first < 0 || first >= SUPERTRANSFORM_MAX_SOURCES)
+      return -1;
+  }
+  /* Every source gets its own, the stages keep per-device state */
+  for (i = first; i <= last; ++i)
+    if (add_stage(i, types, ops, arg) < 0)
+      return -1;
+
+  return 0;
+}
+
+/**
+ * Check if the events of a source have to go through filters
+ *
+ * @param source The source (DEV_SET) device
+ *
+ * @return true if the source has a pipeline
+ */
+bool superfilter_active(int source)
+{
+  return source >= 0 && source < SUPERTRANSFORM_MAX_SOURCES && lengths[source] > 0;
+}
+
+/**
+ * Run a frame through the pipeline of its source
+ *
+ * @param context Whose state to use: the slot of the domain the frame
+ *                came in for, or SUPERFILTER_LOCAL for the local input
+ * @param source  The source (DEV_SET) device
+ * @param events The events of the frame, modified in place
+ * @param count  The number of events
+ * @param stamp  superhid_now() when the frame started
+ *
+ * @return The number of events left
+ */
+int superfilter_run(int context, int source, struct frame_event *events, int count,
+                    uint64_t stamp)
+{
+  struct superfilter_stage *stage;
+  uint64_t start, elapsed;
+  int i, types, left;
+
+  if (!superfilter_active(source))
+    return count;
+
+  types = frame_types(events, count);
+  for (i = 0; i < lengths[source] && count > 0; ++i) {
+    stage = &pipelines[source][i];
+    if (!(stage->types & types))
+      continue;
+    if (stage->priv[context] == NULL) {
+      stage->priv[context] = stage->ops->create(source, stage->arg);
+      if (stage->priv[context] == NULL)
+        continue;
+    }
+    start = now_ns();
+    left = stage->ops->run(stage->priv[context], events, count, stamp);
+    elapsed = now_ns() - start;
+    stage->frames++;
+    stage->dropped += count - left;
+    stage->time_total += elapsed;
+    if (elapsed > stage->time_max)
+      stage->time_max = elapsed;
+    count = left;
+  }
+
+  return count;
+}
+
+/**
+ * Forget the filter state of a domain, when it goes away
+ *
+ * @param context The slot of the domain
+ */
+void superfilter_release(int context)
+{
+  int source, i;
+
+  for (source = 0; source < SUPERTRANSFORM_MAX_SOURCES; ++source) {
+    for (i = 0; i < lengths[source]; ++i) {
+      free(pipelines[source][i].priv[context]);
+      pipelines[source][i].priv[context] = NULL;
+    }
+  }
+}
+
+/**
+ * Log how much the stages that did something cost
+ */
+void superfilter_print_stats(void)
+{
+  struct superfilter_stage *stage;
+  int source, i;
+
+  for (source = 0; source < SUPERTRANSFORM_MAX_SOURCES; ++source) {
+    for (i = 0; i < lengths[source]; ++i) {
+      stage = &pipelines[source][i];
+      if (stage->frames == 0)
+        continue;
+      superlog(LOG_INFO, "source %d %s: %"PRIu64" frames, %"PRIu64" events dropped, "
+               "%"PRIu64"ns average, %"PRIu64"ns max",
+               source, stage->ops->name, stage->frames, stage->dropped,
+               stage->time_total / stage->frames, stage->time_max);
+    }
+  }
+}
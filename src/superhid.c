@@ -58,13 +58,43 @@
     0x75, 0x08,                 /*     REPORT_SIZE (8)              */  \
     0x95, 0x03,                 /*     REPORT_COUNT (3)             */  \
     0x81, 0x06,                 /*     INPUT (Data,Var,Rel)         */  \
-    0x95, 0x07,                 /*     REPORT_COUNT (7)             */  \
-    0x75, 0x08,                 /*     REPORT_SIZE (8)              */  \
+    0xc0,                       /*   END_COLLECTION                 */  \
+    0xc0                        /* END_COLLECTION                   */
+
+#define MOUSE_LENGTH 54
+
+/* This is the same mouse, with 16 bits moves for fast high-DPI mice */
+#define MOUSE_WIDE                                                      \
+    0x05, 0x01,                 /* USAGE_PAGE (Generic Desktop)     */  \
+    0x09, 0x02,                 /* USAGE (Mouse)                    */  \
+    0xa1, 0x01,                 /* COLLECTION (Application)         */  \
+    0x85, REPORT_ID_MOUSE_WIDE, /*   REPORT_ID (8)                  */  \
+    0x09, 0x01,                 /*   USAGE (Pointer)                */  \
+    0xa1, 0x00,                 /*   COLLECTION (Physical)          */  \
+    0x05, 0x09,                 /*     USAGE_PAGE (Button)          */  \
+    0x19, 0x01,                 /*     USAGE_MINIMUM (Button 1)     */  \
+    0x29, 0x05,                 /*     USAGE_MAXIMUM (Button 5)     */  \
+    0x15, 0x00,                 /*     LOGICAL_MINIMUM (0)          */  \
+    0x25, 0x01,                 /*     LOGICAL_MAXIMUM (1)          */  \
+    0x95, 0x05,                 /*     REPORT_COUNT (5)             */  \
+    0x75, 0x01,                 /*     REPORT_SIZE (1)              */  \
+    0x81, 0x02,                 /*     INPUT (Data,Var,Abs)         */  \
+    0x95, 0x01,                 /*     REPORT_COUNT (1)             */  \
+    0x75, 0x03,                 /*     REPORT_SIZE (3)              */  \
     0x81, 0x03,                 /*     INPUT (Cnst,Var,Abs)         */  \
+    0x05, 0x01,                 /*     USAGE_PAGE (Generic Desktop) */  \
+    0x09, 0x30,                 /*     USAGE (X)                    */  \
+    0x09, 0x31,                 /*     USAGE (Y)                    */  \
+    0x09, 0x38,                 /*     USAGE (wheel)                */  \
+    0x16, 0x01, 0x80,           /*     LOGICAL_MINIMUM (-32767)     */  \
+    0x26, 0xff, 0x7f,           /*     LOGICAL_MAXIMUM (32767)      */  \
+    0x75, 0x10,                 /*     REPORT_SIZE (16)             */  \
+    0x95, 0x03,                 /*     REPORT_COUNT (3)             */  \
+    0x81, 0x06,                 /*     INPUT (Data,Var,Rel)         */  \
     0xc0,                       /*   END_COLLECTION                 */  \
     0xc0                        /* END_COLLECTION                   */
 
-#define MOUSE_LENGTH 60
+#define MOUSE_WIDE_LENGTH 56
 
 /* This is an absolute "mouse" with 2 buttons and a vertical wheel. */
 #define TABLET                                                          \
@@ -92,13 +122,10 @@
 0x81, 0x02,                     /*     INPUT (Data, Var, Abs)       */  \
 0x09, 0x31,                     /*     USAGE (Y)                    */  \
 0x81, 0x02,                     /*     INPUT (Data, Var, Abs)       */  \
-0x75, 0x08,                     /*     REPORT_SIZE (8)              */  \
-0x95, 0x06,                     /*     REPORT_COUNT (6)             */  \
-0x81, 0x03,                     /*     INPUT (Cnst,Var,Abs)         */  \
 0xc0,                           /*   END_COLLECTION                 */  \
 0xc0                            /* END_COLLECTION                   */
 
-#define TABLET_LENGTH 57
+#define TABLET_LENGTH 51
 
 #define KEYBOARD                                                       \
 0x05, 0x01,                /*  Usage Page (Desktop),               */  \
@@ -122,11 +149,9 @@
 0x19, 0x00,                /*      Usage Minimum (None),           */  \
 0x2A, 0xFF, 0x00,          /*      Usage Maximum (FFh),            */  \
 0x81, 0x00,                /*      Input,                          */  \
-0x95, 0x03,                /*      REPORT_COUNT (3)                */  \
-0x81, 0x03,                /*      INPUT (Cnst,Var,Abs)            */  \
 0xC0                       /*  End Collection                      */
 
-#define KEYBOARD_LENGTH 49
+#define KEYBOARD_LENGTH 45
 
 #define FINGER                                                                \
 0x05, 0x0D,                     /*      Usage Page (Digitizer),         */    \
@@ -162,6 +187,25 @@
 
 #define FINGER_LENGTH 62
 
+/* When the frame was scanned, in 100us units, so that the guest gets
+ * the actual timing of the contacts however they got batched.
+ * The unit is reset afterwards so that it doesn't apply to the
+ * fingers. */
+#define SCAN_TIME                                                             \
+0x09, 0x56,                     /*      Usage (Scan Time),              */    \
+0x75, 0x10,                     /*      Report Size (16),               */    \
+0x95, 0x01,                     /*      Report Count (1),               */    \
+0x27, 0xFF, 0xFF, 0x00, 0x00,   /*      Logical Maximum (65535),        */    \
+0x35, 0x00,                     /*      Physical Minimum (0),           */    \
+0x47, 0xFF, 0xFF, 0x00, 0x00,   /*      Physical Maximum (65535),       */    \
+0x55, 0x0C,                     /*      Unit Exponent (-4),             */    \
+0x66, 0x01, 0x10,               /*      Unit (Seconds),                 */    \
+0x81, 0x02,                     /*      Input (Variable),               */    \
+0x55, 0x00,                     /*      Unit Exponent (0),              */    \
+0x65, 0x00                      /*      Unit (None),                    */
+
+#define SCAN_TIME_LENGTH 29
+
 /* This digitizer should have SUPERHID_FINGER_WIDTH fingers */
 #define DIGITIZER                                                             \
 0x05, 0x0D,                     /*  Usage Page (Digitizer),             */    \
@@ -175,6 +219,7 @@
 0x25, 0x0C,                     /*      Logical Maximum (12),           */    \
 0x95, 0x01,                     /*      Report Count (1),               */    \
 0x81, 0x02,                     /*      Input (Variable),               */    \
+SCAN_TIME,                                                                    \
 FINGER,                                                                       \
 FINGER,                                                                       \
 0x05, 0x0D,                     /*      Usage Page (Digitizer),         */    \
@@ -186,12 +231,49 @@ FINGER,                                                                       \
 0xB1, 0x02,                     /*      Feature (Variable),             */    \
 0xC0                            /*  End Collection,                     */
 
-#define DIGITIZER_LENGTH (37 + SUPERHID_FINGER_WIDTH * FINGER_LENGTH)
+#define DIGITIZER_LENGTH (37 + SCAN_TIME_LENGTH + SUPERHID_FINGER_WIDTH * FINGER_LENGTH)
+
+/* This digitizer has all the SUPERHID_FINGERS fingers in one report,
+ * so a whole touch frame fits in one transfer */
+#define DIGITIZER_FULL                                                        \
+0x05, 0x0D,                     /*  Usage Page (Digitizer),             */    \
+0x09, 0x04,                     /*  Usage (Touchscreen),                */    \
+0xA1, 0x01,                     /*  Collection (Application),           */    \
+0x85, REPORT_ID_MULTITOUCH,     /*      Report ID (4),                  */    \
+0x05, 0x0D,                     /*      Usage Page (Digitizer),         */    \
+0x09, 0x54,                     /*      Usage (Contact Count),          */    \
+0x75, 0x08,                     /*      Report Size (8),                */    \
+0x15, 0x00,                     /*      Logical Minimum (0),            */    \
+0x25, 0x0C,                     /*      Logical Maximum (12),           */    \
+0x95, 0x01,                     /*      Report Count (1),               */    \
+0x81, 0x02,                     /*      Input (Variable),               */    \
+SCAN_TIME,                                                                    \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+FINGER,                                                                       \
+0x05, 0x0D,                     /*      Usage Page (Digitizer),         */    \
+0x09, 0x55,                     /*      Usage (Contact Count Max),      */    \
+0x15, 0x00,                     /*      Logical Minimum (0),            */    \
+0x25, 0x7F,                     /*      Logical Maximum (127),          */    \
+0x75, 0x08,                     /*      Report Size (8),                */    \
+0x95, 0x01,                     /*      Report Count (1),               */    \
+0xB1, 0x02,                     /*      Feature (Variable),             */    \
+0xC0                            /*  End Collection,                     */
+
+#define DIGITIZER_FULL_LENGTH (37 + SCAN_TIME_LENGTH + SUPERHID_FINGERS * FINGER_LENGTH)
 
 struct hid_report_desc superhid_desc = {
   .subclass = 0, /* No subclass */
   .protocol = 0,
-  .report_length = SUPERHID_REPORT_LENGTH,
+  .report_length = SUPERHID_DIGITIZER_REPORT_LENGTH,
+  /* The longest of the reports below, see superhid_input_length() */
   .report_desc_length = MOUSE_LENGTH + DIGITIZER_LENGTH + TABLET_LENGTH + KEYBOARD_LENGTH,
   .report_desc = {
     MOUSE,
@@ -204,27 +286,47 @@ struct hid_report_desc superhid_desc = {
 struct hid_report_desc superhid_mouse_desc = {
   .subclass = 0, /* No subclass */
   .protocol = 0,
-  .report_length = SUPERHID_REPORT_LENGTH,
+  .report_length = SUPERHID_MOUSE_REPORT_LENGTH,
   .report_desc_length = MOUSE_LENGTH,
   .report_desc = {
     MOUSE
   }
 };
 
+struct hid_report_desc superhid_mouse_wide_desc = {
+  .subclass = 0, /* No subclass */
+  .protocol = 0,
+  .report_length = SUPERHID_MOUSE_WIDE_REPORT_LENGTH,
+  .report_desc_length = MOUSE_WIDE_LENGTH,
+  .report_desc = {
+    MOUSE_WIDE
+  }
+};
+
 struct hid_report_desc superhid_digitizer_desc = {
   .subclass = 0, /* No subclass */
   .protocol = 0,
-  .report_length = SUPERHID_REPORT_LENGTH,
+  .report_length = SUPERHID_DIGITIZER_REPORT_LENGTH,
   .report_desc_length = DIGITIZER_LENGTH,
   .report_desc = {
     DIGITIZER
   }
 };
 
+struct hid_report_desc superhid_digitizer_full_desc = {
+  .subclass = 0, /* No subclass */
+  .protocol = 0,
+  .report_length = SUPERHID_FULL_REPORT_LENGTH,
+  .report_desc_length = DIGITIZER_FULL_LENGTH,
+  .report_desc = {
+    DIGITIZER_FULL
+  }
+};
+
 struct hid_report_desc superhid_tablet_desc = {
   .subclass = 0, /* No subclass */
   .protocol = 0,
-  .report_length = SUPERHID_REPORT_LENGTH,
+  .report_length = SUPERHID_TABLET_REPORT_LENGTH,
   .report_desc_length = TABLET_LENGTH,
   .report_desc = {
     TABLET
@@ -234,7 +336,7 @@ struct hid_report_desc superhid_tablet_desc = {
 struct hid_report_desc superhid_keyboard_desc = {
   .subclass = 0, /* No subclass */
   .protocol = 0,
-  .report_length = SUPERHID_REPORT_LENGTH,
+  .report_length = SUPERHID_KEYBOARD_REPORT_LENGTH,
   .report_desc_length = KEYBOARD_LENGTH,
   .report_desc = {
     KEYBOARD
@@ -333,6 +435,26 @@ static struct hid_descriptor hid_desc_mouse = {
   /* .bAddDescriptorLength = DYNAMIC, */
 };
 
+static struct hid_descriptor hid_desc_mouse_wide = {
+  .bLength = sizeof(struct hid_descriptor),
+  .bDescriptorType = HID_DT_HID,
+  .bcdHID = 0x0111,
+  .bCountryCode = 0x00,
+  .bNumDescriptors = 0x1,
+  .bAddDescriptorType = HID_DT_REPORT,
+  /* .bAddDescriptorLength = DYNAMIC, */
+};
+
+static struct hid_descriptor hid_desc_passthrough = {
+  .bLength = sizeof(struct hid_descriptor),
+  .bDescriptorType = HID_DT_HID,
+  .bcdHID = 0x0111,
+  .bCountryCode = 0x00,
+  .bNumDescriptors = 0x1,
+  .bAddDescriptorType = HID_DT_REPORT,
+  /* .bAddDescriptorLength = DYNAMIC, */
+};
+
 static struct hid_descriptor hid_desc_digitizer = {
   .bLength = sizeof(struct hid_descriptor),
   .bDescriptorType = HID_DT_HID,
@@ -343,6 +465,16 @@ static struct hid_descriptor hid_desc_digitizer = {
   /* .bAddDescriptorLength = DYNAMIC, */
 };
 
+static struct hid_descriptor hid_desc_digitizer_full = {
+  .bLength = sizeof(struct hid_descriptor),
+  .bDescriptorType = HID_DT_HID,
+  .bcdHID = 0x0111,
+  .bCountryCode = 0x00,
+  .bNumDescriptors = 0x1,
+  .bAddDescriptorType = HID_DT_REPORT,
+  /* .bAddDescriptorLength = DYNAMIC, */
+};
+
 static struct hid_descriptor hid_desc_tablet = {
   .bLength = sizeof(struct hid_descriptor),
   .bDescriptorType = HID_DT_HID,
@@ -392,14 +524,118 @@ void superhid_init(void)
   /* DYNAMIC inits */
   hid_desc.wAddDescriptorLength = superhid_desc.report_desc_length;
   hid_desc_mouse.wAddDescriptorLength = superhid_mouse_desc.report_desc_length;
+  hid_desc_mouse_wide.wAddDescriptorLength = superhid_mouse_wide_desc.report_desc_length;
   hid_desc_digitizer.wAddDescriptorLength = superhid_digitizer_desc.report_desc_length;
+  hid_desc_digitizer_full.wAddDescriptorLength = superhid_digitizer_full_desc.report_desc_length;
   hid_desc_tablet.wAddDescriptorLength = superhid_tablet_desc.report_desc_length;
   hid_desc_keyboard.wAddDescriptorLength = superhid_keyboard_desc.report_desc_length;
-  endpoint_in_desc.wMaxPacketSize = superhid_desc.report_length;
+  /* The passthrough descriptor comes from the physical device */
+  if (superhid_passthrough_desc != NULL)
+    hid_desc_passthrough.wAddDescriptorLength = superhid_passthrough_desc->report_desc_length;
+  /* endpoint_in_desc.wMaxPacketSize depends on the device type, see
+   * superhid_report_length() */
   /* Un-comment this if an OUT endpoint is needed */
   /* endpoint_out_desc.wMaxPacketSize = superhid_desc.report_length; */
 }
 
+/**
+ * Get the size of the longest input report of a given type of device,
+ * which is also the max packet size of its interrupt endpoint
+ *
+ * @param type The type of SuperHID device
+ *
+ * @return The report length, in bytes
+ */
+int superhid_report_length(enum superhid_type type)
+{
+  switch (type) {
+  case SUPERHID_TYPE_MULTI:
+    return superhid_desc.report_length;
+  case SUPERHID_TYPE_MOUSE:
+    return superhid_mouse_desc.report_length;
+  case SUPERHID_TYPE_MOUSE_WIDE:
+    return superhid_mouse_wide_desc.report_length;
+  case SUPERHID_TYPE_DIGITIZER:
+    return superhid_digitizer_desc.report_length;
+  case SUPERHID_TYPE_DIGITIZER_FULL:
+    return superhid_digitizer_full_desc.report_length;
+  case SUPERHID_TYPE_TABLET:
+    return superhid_tablet_desc.report_length;
+  case SUPERHID_TYPE_KEYBOARD:
+    return superhid_keyboard_desc.report_length;
+  case SUPERHID_TYPE_PASSTHROUGH:
+    if (superhid_passthrough_desc != NULL)
+      return superhid_passthrough_desc->report_length;
+    return SUPERHID_MAX_REPORT_LENGTH;
+  default:
+    return SUPERHID_MAX_REPORT_LENGTH;
+  }
+}
+
+/**
+ * Get the length of an input report for a given type of device.
+ * Devices with a single kind of report always send
+ * superhid_report_length() bytes, multi devices send each report with
+ * its own length.
+ *
+ * @param type      The type of SuperHID device
+ * @param report_id The ID of the report
+ *
+ * @return The report length, in bytes
+ */
+int superhid_input_length(enum superhid_type type, uint8_t report_id)
+{
+  if (type != SUPERHID_TYPE_MULTI)
+    return superhid_report_length(type);
+
+  switch (report_id) {
+  case REPORT_ID_MOUSE:
+    return SUPERHID_MOUSE_REPORT_LENGTH;
+  case REPORT_ID_MOUSE_WIDE:
+    return SUPERHID_MOUSE_WIDE_REPORT_LENGTH;
+  case REPORT_ID_TABLET:
+    return SUPERHID_TABLET_REPORT_LENGTH;
+  case REPORT_ID_KEYBOARD:
+    return SUPERHID_KEYBOARD_REPORT_LENGTH;
+  case REPORT_ID_MULTITOUCH:
+    return SUPERHID_DIGITIZER_REPORT_LENGTH;
+  default:
+    return superhid_desc.report_length;
+  }
+}
+
+/**
+ * Get the HID report descriptor of a given type of device
+ *
+ * @param type The type of SuperHID device
+ *
+ * @return The descriptor, or NULL if there's none (passthrough without
+ *         a device)
+ */
+struct hid_report_desc *superhid_report_desc(enum superhid_type type)
+{
+  switch (type) {
+  case SUPERHID_TYPE_MULTI:
+    return &superhid_desc;
+  case SUPERHID_TYPE_MOUSE:
+    return &superhid_mouse_desc;
+  case SUPERHID_TYPE_MOUSE_WIDE:
+    return &superhid_mouse_wide_desc;
+  case SUPERHID_TYPE_DIGITIZER:
+    return &superhid_digitizer_desc;
+  case SUPERHID_TYPE_DIGITIZER_FULL:
+    return &superhid_digitizer_full_desc;
+  case SUPERHID_TYPE_TABLET:
+    return &superhid_tablet_desc;
+  case SUPERHID_TYPE_KEYBOARD:
+    return &superhid_keyboard_desc;
+  case SUPERHID_TYPE_PASSTHROUGH:
+    return superhid_passthrough_desc;
+  default:
+    return NULL;
+  }
+}
+
 /**
  * Handle a setup (control) request
  *
@@ -413,6 +649,7 @@ int superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type
 {
   __u16 value, length;
   struct feature_report feature;
+  struct usb_endpoint_descriptor endpoint;
   int total;
 
   value = setup->wValue;
@@ -532,10 +769,18 @@ int superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type
         memcpy(buf + total, &hid_desc_mouse, sizeof(hid_desc_mouse));
         total += sizeof(hid_desc_mouse);
         break;
+      case SUPERHID_TYPE_MOUSE_WIDE:
+        memcpy(buf + total, &hid_desc_mouse_wide, sizeof(hid_desc_mouse_wide));
+        total += sizeof(hid_desc_mouse_wide);
+        break;
       case SUPERHID_TYPE_DIGITIZER:
         memcpy(buf + total, &hid_desc_digitizer, sizeof(hid_desc_digitizer));
         total += sizeof(hid_desc_digitizer);
         break;
+      case SUPERHID_TYPE_DIGITIZER_FULL:
+        memcpy(buf + total, &hid_desc_digitizer_full, sizeof(hid_desc_digitizer_full));
+        total += sizeof(hid_desc_digitizer_full);
+        break;
       case SUPERHID_TYPE_TABLET:
         memcpy(buf + total, &hid_desc_tablet, sizeof(hid_desc_tablet));
         total += sizeof(hid_desc_tablet);
@@ -544,13 +789,19 @@ int superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type
         memcpy(buf + total, &hid_desc_keyboard, sizeof(hid_desc_keyboard));
         total += sizeof(hid_desc_keyboard);
         break;
+      case SUPERHID_TYPE_PASSTHROUGH:
+        memcpy(buf + total, &hid_desc_passthrough, sizeof(hid_desc_passthrough));
+        total += sizeof(hid_desc_passthrough);
+        break;
       }
       printf("%d ", total);
       if (total > length) {
         superlog(LOG_DEBUG, "skipping endpoint 1");
         goto skipstuffs;
       }
-      memcpy(buf + total, &endpoint_in_desc, USB_DT_ENDPOINT_SIZE);
+      endpoint = endpoint_in_desc;
+      endpoint.wMaxPacketSize = superhid_report_length(type);
+      memcpy(buf + total, &endpoint, USB_DT_ENDPOINT_SIZE);
       total += USB_DT_ENDPOINT_SIZE;
       printf("%d ", total);
       if (total > length) {
@@ -638,11 +889,21 @@ int superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type
           length = superhid_mouse_desc.report_desc_length;
         memcpy(buf, superhid_mouse_desc.report_desc, length);
         break;
+      case SUPERHID_TYPE_MOUSE_WIDE:
+        if (superhid_mouse_wide_desc.report_desc_length < length)
+          length = superhid_mouse_wide_desc.report_desc_length;
+        memcpy(buf, superhid_mouse_wide_desc.report_desc, length);
+        break;
       case SUPERHID_TYPE_DIGITIZER:
         if (superhid_digitizer_desc.report_desc_length < length)
           length = superhid_digitizer_desc.report_desc_length;
         memcpy(buf, superhid_digitizer_desc.report_desc, length);
         break;
+      case SUPERHID_TYPE_DIGITIZER_FULL:
+        if (superhid_digitizer_full_desc.report_desc_length < length)
+          length = superhid_digitizer_full_desc.report_desc_length;
+        memcpy(buf, superhid_digitizer_full_desc.report_desc, length);
+        break;
       case SUPERHID_TYPE_TABLET:
         if (superhid_tablet_desc.report_desc_length < length)
           length = superhid_tablet_desc.report_desc_length;
@@ -653,6 +914,13 @@ int superhid_setup(struct usb_ctrlrequest *setup, char *buf, enum superhid_type
           length = superhid_keyboard_desc.report_desc_length;
         memcpy(buf, superhid_keyboard_desc.report_desc, length);
         break;
+      case SUPERHID_TYPE_PASSTHROUGH:
+        if (superhid_passthrough_desc == NULL)
+          goto stall;
+        if (superhid_passthrough_desc->report_desc_length < length)
+          length = superhid_passthrough_desc->report_desc_length;
+        memcpy(buf, superhid_passthrough_desc->report_desc, length);
+        break;
       }
       goto respond;
       break;
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superhidraw.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 18:21:36 2026
+ *
+ * @brief  HID passthrough
+ *
+ * A lot of pen tablets and touchscreens already speak HID. Instead of
+ * decoding their events and encoding them again with our own
+ * descriptors, a hidraw device can be passed through: the domains that
+ * want it get a SuperHID device with the report descriptor of the
+ * physical one, and its reports as is.
+ * Like the rest of the local input, the reports go to all the domains,
+ * or to the one that has the focus in focus mode.
+ * Reading a hidraw node doesn't keep the kernel from decoding the
+ * reports too, so the device also has an evdev node. The evdev source
+ * (-e) leaves that one alone. With input_server, it has to be kept out
+ * of input_server, or the domains get everything twice.
+ */
+
+#include "project.h"
+
+/* The report descriptor items we need, size bits masked */
+#define ITEM_INPUT              0x80
+#define ITEM_REPORT_SIZE        0x74
+#define ITEM_REPORT_ID          0x84
+#define ITEM_REPORT_COUNT       0x94
+#define ITEM_PUSH               0xa4
+#define ITEM_POP                0xb4
+#define ITEM_LONG               0xfe
+#define ITEM_MAX_PUSH           8
+
+struct item_globals
+{
+  uint32_t size;
+  uint32_t count;
+  uint8_t  id;
+};
+
+static int hidraw_fd = -1;
+static struct event hidraw_event;
+static struct hidraw_devinfo hidraw_info;
+static bool hidraw_info_valid;
+static uint64_t oversized;  /* Reports longer than the descriptor says */
+
+struct hid_report_desc *superhid_passthrough_desc;
+
+static void hidraw_handler(int fd, short event, void *priv)
+{
+  struct superhid_backend *targets[SUPERHID_MAX_BACKENDS];
+  uint8_t report[SUPERHID_MAX_REPORT_LENGTH + 1];
+  uint64_t stamp;
+  ssize_t n;
+  int i, count, queued = 0;
+
+  /* One read() is one report, for every domain that wants it. The
+   * buffer has room for one more byte than the longest report, so a
+   * report that doesn't fit shows */
+  while ((n = read(fd, report, sizeof(report))) > 0) {
+    if (n > superhid_passthrough_desc->report_length) {
+      if (oversized++ == 0)
+        superlog(LOG_ERR, "Dropping passthrough reports longer than %d bytes",
+                 superhid_passthrough_desc->report_length);
+      continue;
+    }
+    stamp = superhid_now();
+    count = superplugin_targets(targets);
+    for (i = 0; i < count; ++i)
+      if (targets[i]->passthrough &&
+          superscheduler_queue_raw(targets[i], report, n, stamp) == 0)
+        queued++;
+  }
+
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    superlog(LOG_ERR, "The passthrough device went away: %s", strerror(errno));
+    superhidraw_close();
+  }
+
+  if (queued > 0)
+    superscheduler_run();
+}
+
+/**
+ * Find the length of the longest input report a report descriptor
+ * defines, report ID included. Only the items that matter for that get
+ * looked at.
+ *
+ * @param desc The report descriptor
+ * @param size The size of the descriptor
+ *
+ * @return The length in bytes, or -1 if the descriptor is malformed or
+ *         has no input report
+ */
+int superhidraw_report_length(const uint8_t *desc, int size)
+{
+  struct item_globals globals = { 0, 0, 0 }, stack[ITEM_MAX_PUSH];
+  uint64_t bits[256] = { 0 };
+  bool ids = false;
+  int i = 0, j, len, depth = 0, longest = 0;
+  uint32_t value;
+
+  while (i < size) {
+    if (desc[i] == ITEM_LONG) {
+      /* Size, tag, then the data */
+      if (i + 1 >= size)
+        return -1;
+      i += 3 + desc[i + 1];
+      continue;
+    }
+    len = desc[i] & 0x3;
+    if (len == 3)
+      len = 4;
+    if (i + 1 + len > size)
+      return -1;
+    value = 0;
+    for (j = 0; j < len; ++j)
+      value |= (uint32_t)desc[i + 1 + j] << (8 * j);
+
+    switch (desc[i] & 0xfc) {
+    case ITEM_INPUT:
+      bits[globals.id] += (uint64_t)globals.size * globals.count;
+      break;
+    case ITEM_REPORT_SIZE:
+      globals.size = value;
+      break;
+    case ITEM_REPORT_ID:
+      globals.id = value;
+      ids = true;
+      break;
+    case ITEM_REPORT_COUNT:
+      globals.count = value;
+      break;
+    case ITEM_PUSH:
+      if (depth == ITEM_MAX_PUSH)
+        return -1;
+      stack[depth++] = globals;
+      break;
+    case ITEM_POP:
+      if (depth == 0)
+        return -1;
+      globals = stack[--depth];
+      break;
+    }
+    i += 1 + len;
+  }
+
+  for (i = 0; i < 256; ++i)
+    if (bits[i] > 0 && (bits[i] + 7) / 8 + ids > longest)
+      longest = (bits[i] + 7) / 8 + ids;
+
+  return longest > 0 ? longest : -1;
+}
+
+/**
+ * Check whether an input device is the passthrough one, as seen by
+ * evdev
+ *
+ * @param id The ID of the input device
+ *
+ * @return true if it is, false otherwise
+ */
+bool superhidraw_matches(const struct input_id *id)
+{
+  return hidraw_info_valid && id->bustype == hidraw_info.bustype &&
+    id->vendor == (uint16_t)hidraw_info.vendor &&
+    id->product == (uint16_t)hidraw_info.product;
+}
+
+/**
+ * Open a hidraw device and get its report descriptor. Must be called
+ * before superhid_init().
+ *
+ * @param path The path to the hidraw node
+ *
+ * @return 0 on success, -1 on error
+ */
+int superhidraw_init(const char *path)
+{
+  struct hidraw_report_descriptor rdesc;
+  struct hid_report_desc *desc;
+  int size, length;
+
+  hidraw_fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (hidraw_fd < 0) {
+    superlog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  if (ioctl(hidraw_fd, HIDIOCGRDESCSIZE, &size) < 0 ||
+      size <= 0 || size > HID_MAX_DESCRIPTOR_SIZE) {
+    superlog(LOG_ERR, "Failed to get the descriptor size of %s", path);
+    goto fail;
+  }
+  rdesc.size = size;
+  if (ioctl(hidraw_fd, HIDIOCGRDESC, &rdesc) < 0) {
+    superlog(LOG_ERR, "Failed to get the descriptor of %s", path);
+    goto fail;
+  }
+
+  /* The longest report is the max packet size of the endpoint */
+  length = superhidraw_report_length(rdesc.value, size);
+  if (length < 0) {
+    superlog(LOG_ERR, "%s has no input report we understand", path);
+    goto fail;
+  }
+  if (length > SUPERHID_MAX_REPORT_LENGTH) {
+    superlog(LOG_ERR, "%s has %d bytes reports, more than the %d an endpoint takes",
+             path, length, SUPERHID_MAX_REPORT_LENGTH);
+    goto fail;
+  }
+
+  desc = malloc(sizeof(*desc) + size);
+  if (desc == NULL)
+    goto fail;
+  desc->subclass = 0;
+  desc->protocol = 0;
+  desc->report_length = length;
+  desc->report_desc_length = size;
+  memcpy(desc->report_desc, rdesc.value, size);
+  superhid_passthrough_desc = desc;
+
+  oversized = 0;
+  hidraw_info_valid = ioctl(hidraw_fd, HIDIOCGRAWINFO, &hidraw_info) == 0;
+  if (hidraw_info_valid)
+    superlog(LOG_INFO, "Passing %s (%04hx:%04hx) through, %d bytes reports",
+             path, hidraw_info.vendor, hidraw_info.product, length);
+
+  return 0;
+
+fail:
+  close(hidraw_fd);
+  hidraw_fd = -1;
+  return -1;
+}
+
+/**
+ * Start forwarding the reports of the passthrough device. Must be
+ * called after event_init().
+ */
+void superhidraw_start(void)
+{
+  if (hidraw_fd < 0)
+    return;
+
+  event_set(&hidraw_event, hidraw_fd, EV_READ | EV_PERSIST,
+            hidraw_handler, NULL);
+  event_add(&hidraw_event, NULL);
+}
+
+/**
+ * Stop forwarding the reports of the passthrough device. The domains
+ * keep the device, it just won't report anything anymore.
+ */
+void superhidraw_close(void)
+{
+  if (hidraw_fd < 0)
+    return;
+
+  event_del(&hidraw_event);
+  close(hidraw_fd);
+  hidraw_fd = -1;
+  hidraw_info_valid = false;
+  if (oversized > 0)
+    superlog(LOG_INFO, "%"PRIu64" oversized passthrough reports got dropped", oversized);
+}
@@ -0,0 +1,654 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superload.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Tue Oct 20 11:05:23 2026
+ *
+ * @brief  Synthetic input load generator
+ *
+ * superhid-load stands in for input_server, to stress SuperHID on a
+ * plain Linux box. It listens on the input_server socket, and sends
+ * generated events to the last client that sucked, at a given rate:
+ * multitouch frames, keyboard bursts, relative mouse moves, or all of
+ * them interleaved with DEV_SET switches.
+ * The events go over the socket, or through the shared ring SuperHID
+ * offers when it runs with -s (see supershm.c). The compare mode runs
+ * half of the time on each, for the same client.
+ * It prints the rate it actually achieved every second, and how long
+ * the frames took to get picked up. On the ring, that's when the head
+ * gets past the frame. On the socket, it's when nothing is left unread,
+ * which is exact as long as SuperHID keeps up, and an upper bound
+ * otherwise.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/input.h>
+
+#include "superproto.h"
+
+#define MAX_CLIENTS             16
+/* A mixed frame with all the fingers is below that */
+#define MAX_FRAME_RECORDS       256
+/* Frames waiting to get picked up, for the latency */
+#define MAX_PENDING             4096
+
+/* The source devices, input_server style */
+#define DEV_KEYBOARD            0
+#define DEV_MOUSE               1
+#define DEV_TOUCH               5
+
+enum workload
+{
+  WORKLOAD_TOUCH,
+  WORKLOAD_KEYBOARD,
+  WORKLOAD_MOUSE,
+  WORKLOAD_MIXED
+};
+
+static const char *workload_names[] = { "touch", "keyboard", "mouse", "mixed" };
+
+enum transport
+{
+  TRANSPORT_SOCKET,
+  TRANSPORT_SHM,
+  TRANSPORTS
+};
+
+static const char *transport_names[] = { "socket", "shm" };
+
+struct frame
+{
+  struct event_record records[MAX_FRAME_RECORDS];
+  int                 count;
+};
+
+struct client
+{
+  int              fd;
+  struct shm_ring *ring;   /* The ring it offered, or NULL */
+  size_t           size;
+  int              evfd;
+};
+
+struct stats
+{
+  uint64_t frames;
+  uint64_t records;
+  uint64_t stalls;         /* Times the ring was too full for a frame */
+  uint64_t latency_total;  /* us */
+  uint64_t latency_count;
+  uint64_t latency_max;    /* us */
+};
+
+/* Frames sent and not picked up yet, oldest first */
+struct pending
+{
+  uint64_t sent;
+  uint32_t end;            /* The ring tail after the frame */
+};
+
+static struct pending pending[MAX_PENDING];
+static unsigned int pending_head, pending_tail;
+
+static void add(struct frame *frame, uint16_t itype, uint16_t icode, uint32_t ivalue)
+{
+  struct event_record *r;
+
+  if (frame->count == MAX_FRAME_RECORDS)
+    return;
+  r = &frame->records[frame->count++];
+  r->magic = MAGIC;
+  r->itype = itype;
+  r->icode = icode;
+  r->ivalue = ivalue;
+}
+
+static uint64_t now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Fingers bounce around the screen, each at its own speed */
+static uint32_t bounce(uint64_t tick, int speed)
+{
+  uint32_t pos = (tick * speed) % (2 * 0x7FFF);
+
+  return pos <= 0x7FFF ? pos : 2 * 0x7FFF - pos;
+}
+
+static void touch_frame(struct frame *frame, uint64_t tick, int fingers)
+{
+  int i;
+
+  add(frame, EV_DEV, DEV_SET, DEV_TOUCH);
+  for (i = 0; i < fingers; ++i) {
+    add(frame, EV_ABS, ABS_MT_SLOT, i);
+    if (tick == 0)
+      add(frame, EV_ABS, ABS_MT_TRACKING_ID, i);
+    add(frame, EV_ABS, ABS_MT_POSITION_X, bounce(tick, 64 + i * 16));
+    add(frame, EV_ABS, ABS_MT_POSITION_Y, bounce(tick, 96 + i * 8));
+  }
+  add(frame, EV_SYN, SYN_REPORT, 0);
+}
+
+static void keyboard_frame(struct frame *frame, uint64_t tick)
+{
+  /* Type the alphabet, one key per tick */
+  static const uint16_t keys[] = {
+    KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
+    KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
+    KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
+  };
+  uint16_t key = keys[tick % (sizeof(keys) / sizeof(keys[0]))];
+
+  add(frame, EV_DEV, DEV_SET, DEV_KEYBOARD);
+  add(frame, EV_KEY, key, 1);
+  add(frame, EV_SYN, SYN_REPORT, 0);
+  add(frame, EV_KEY, key, 0);
+  add(frame, EV_SYN, SYN_REPORT, 0);
+}
+
+static void mouse_frame(struct frame *frame, uint64_t tick)
+{
+  /* Small circles-ish */
+  add(frame, EV_DEV, DEV_SET, DEV_MOUSE);
+  add(frame, EV_REL, REL_X, (tick / 64) % 2 ? 3 : -3);
+  add(frame, EV_REL, REL_Y, (tick / 32) % 2 ? 2 : -2);
+  add(frame, EV_SYN, SYN_REPORT, 0);
+}
+
+static void build_frame(struct frame *frame, enum workload workload,
+                        uint64_t tick, int fingers)
+{
+  frame->count = 0;
+  switch (workload) {
+  case WORKLOAD_TOUCH:
+    touch_frame(frame, tick, fingers);
+    break;
+  case WORKLOAD_KEYBOARD:
+    keyboard_frame(frame, tick);
+    break;
+  case WORKLOAD_MOUSE:
+    mouse_frame(frame, tick);
+    break;
+  case WORKLOAD_MIXED:
+    /* Everything at once, switching devices in the middle */
+    touch_frame(frame, tick, fingers);
+    mouse_frame(frame, tick);
+    if (tick % 16 == 0)
+      keyboard_frame(frame, tick / 16);
+    break;
+  }
+}
+
+static int listen_on(const char *path)
+{
+  struct sockaddr_un local;
+  int s;
+
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) {
+    perror("socket");
+    return -1;
+  }
+  memset(&local, 0, sizeof(local));
+  local.sun_family = AF_UNIX;
+  strncpy(local.sun_path, path, sizeof(local.sun_path) - 1);
+  unlink(path);
+  if (bind(s, (struct sockaddr *)&local, sizeof(local)) < 0 || listen(s, MAX_CLIENTS) < 0) {
+    perror(path);
+    close(s);
+    return -1;
+  }
+
+  return s;
+}
+
+static void release_ring(struct client *client)
+{
+  if (client->ring == NULL)
+    return;
+  munmap(client->ring, client->size);
+  close(client->evfd);
+  client->ring = NULL;
+}
+
+/**
+ * Map the ring a client offered, see struct shm_ring
+ *
+ * @return 0 on success, -1 on error
+ */
+static int map_ring(struct client *client, int memfd, int evfd, uint32_t records)
+{
+  struct stat st;
+  size_t size = sizeof(struct shm_ring) + records * sizeof(struct event_record);
+
+  if (records != SHM_RING_RECORDS || fstat(memfd, &st) < 0 || (size_t)st.st_size < size) {
+    fprintf(stderr, "Unexpected shared ring of %u records\n", records);
+    return -1;
+  }
+  client->ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (client->ring == MAP_FAILED || client->ring->magic != MAGIC) {
+    if (client->ring != MAP_FAILED)
+      munmap(client->ring, size);
+    client->ring = NULL;
+    fprintf(stderr, "Failed to map the shared ring\n");
+    return -1;
+  }
+  client->size = size;
+  client->evfd = evfd;
+
+  return 0;
+}
+
+/**
+ * Read the commands of a client
+ *
+ * @param client The client
+ * @param index  Its index in the clients, for target
+ * @param target Set to index if the client sucked
+ * @param shm    true to take the rings offered
+ *
+ * @return false if the client went away
+ */
+static bool handle_client(struct client *client, int index, int *target, bool shm)
+{
+  struct event_record r;
+  struct msghdr msg = { 0 };
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  int fds[2] = { -1, -1 };
+  ssize_t n;
+
+  iov.iov_base = &r;
+  iov.iov_len = sizeof(r);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  n = recvmsg(client->fd, &msg, MSG_WAITALL);
+  if (n <= 0)
+    return false;
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  if (n == sizeof(r) && r.magic == MAGIC && r.itype == EV_CMD) {
+    switch (r.icode) {
+    case CMD_SUCK:
+      printf("domid %u sucked\n", r.ivalue);
+      *target = index;
+      break;
+    case CMD_SHM:
+      if (!shm || fds[0] < 0)
+        break;
+      release_ring(client);
+      if (map_ring(client, fds[0], fds[1], r.ivalue) == 0) {
+        printf("Got a shared ring of %u records\n", r.ivalue);
+        fds[1] = -1;
+      }
+      break;
+    case CMD_CREDIT:
+      /* We're here to push, not to listen */
+      break;
+    default:
+      /* Versions: we only speak v1 streams, which is fine */
+      break;
+    }
+  }
+
+  /* The eventfd is kept with the ring, the memfd isn't needed anymore */
+  if (fds[0] >= 0)
+    close(fds[0]);
+  if (fds[1] >= 0)
+    close(fds[1]);
+
+  return true;
+}
+
+/**
+ * Write a frame to the ring of a client, and wake SuperHID up if it's
+ * asleep
+ *
+ * @return false if there's no room for the whole frame
+ */
+static bool ring_write(struct client *client, const struct frame *frame)
+{
+  struct shm_ring *ring = client->ring;
+  uint32_t head, tail = ring->tail;
+  uint64_t one = 1;
+  int i;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  if (SHM_RING_RECORDS - (tail - head) < (uint32_t)frame->count)
+    return false;
+
+  for (i = 0; i < frame->count; ++i)
+    ring->records[(tail + i) % SHM_RING_RECORDS] = frame->records[i];
+  __atomic_store_n(&ring->tail, tail + frame->count, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&ring->idle, 0, __ATOMIC_SEQ_CST) &&
+      write(client->evfd, &one, sizeof(one)) < 0)
+    perror("eventfd");
+
+  return true;
+}
+
+static void add_latency(struct stats *stats, uint64_t latency)
+{
+  stats->latency_total += latency;
+  stats->latency_count++;
+  if (latency > stats->latency_max)
+    stats->latency_max = latency;
+}
+
+/**
+ * Account for the frames that got picked up since the last time
+ */
+static void check_pickup(struct client *client, enum transport transport,
+                         struct stats *stats)
+{
+  uint64_t now = now_us();
+  uint32_t head;
+  int unread;
+
+  if (pending_head == pending_tail)
+    return;
+
+  if (transport == TRANSPORT_SHM) {
+    head = __atomic_load_n(&client->ring->head, __ATOMIC_ACQUIRE);
+    while (pending_head != pending_tail &&
+           (int32_t)(head - pending[pending_head % MAX_PENDING].end) >= 0)
+      add_latency(stats, now - pending[pending_head++ % MAX_PENDING].sent);
+  } else if (ioctl(client->fd, SIOCOUTQ, &unread) == 0 && unread == 0) {
+    while (pending_head != pending_tail)
+      add_latency(stats, now - pending[pending_head++ % MAX_PENDING].sent);
+  }
+}
+
+static void print_stats(const char *what, enum transport transport,
+                        const struct stats *stats, uint64_t us)
+{
+  printf("%s%s: %"PRIu64" frames, %"PRIu64" records, %"PRIu64" frames/s, "
+         "pickup avg %"PRIu64"us max %"PRIu64"us",
+         what, transport_names[transport], stats->frames, stats->records,
+         us > 0 ? stats->frames * 1000000 / us : 0,
+         stats->latency_count > 0 ? stats->latency_total / stats->latency_count : 0,
+         stats->latency_max);
+  if (stats->stalls > 0)
+    printf(", ring full %"PRIu64" times", stats->stalls);
+  printf("\n");
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr, "Usage: %s [options]\n", name);
+  fprintf(stderr, "  -S, --socket=PATH    Listen there (default %s)\n", SOCK_PATH);
+  fprintf(stderr, "  -w, --workload=NAME  touch, keyboard, mouse or mixed (default touch)\n");
+  fprintf(stderr, "  -n, --fingers=N      Fingers for touch (default 10)\n");
+  fprintf(stderr, "  -z, --rate=HZ        Frames per second (default 120, 8000 for mouse)\n");
+  fprintf(stderr, "  -d, --duration=S     Stop after that many seconds (default: never)\n");
+  fprintf(stderr, "  -m, --shm            Use the shared rings SuperHID offers (superhid -s)\n");
+  fprintf(stderr, "  -c, --compare        Use the socket for the first half of the duration,\n");
+  fprintf(stderr, "                       the shared ring for the second half\n");
+  fprintf(stderr, "  -h, --help           Show this help\n");
+}
+
+int main(int argc, char **argv)
+{
+  static const struct option options[] = {
+    { "socket",   required_argument, NULL, 'S' },
+    { "workload", required_argument, NULL, 'w' },
+    { "fingers",  required_argument, NULL, 'n' },
+    { "rate",     required_argument, NULL, 'z' },
+    { "duration", required_argument, NULL, 'd' },
+    { "shm",      no_argument,       NULL, 'm' },
+    { "compare",  no_argument,       NULL, 'c' },
+    { "help",     no_argument,       NULL, 'h' },
+    { NULL,       0,                 NULL, 0 }
+  };
+  const char *path = SOCK_PATH;
+  enum workload workload = WORKLOAD_TOUCH;
+  enum transport transport, used = TRANSPORT_SOCKET;
+  int fingers = 10, rate = 0, duration = 0;
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct client clients[MAX_CLIENTS + 1];
+  struct client *client;
+  struct stats stats[TRANSPORTS];
+  struct frame frame;
+  int nfds = 1, target = -1, previous;
+  uint64_t start, now, next, period, last_report, last_loop, tick = 0;
+  uint64_t elapsed[TRANSPORTS] = { 0, 0 };
+  uint64_t frames, records, last_frames = 0, last_records = 0;
+  int opt, i, timeout;
+  bool found, shm = false, compare = false, switching, stalled = false;
+
+  while ((opt = getopt_long(argc, argv, "S:w:n:z:d:mch", options, NULL)) != -1) {
+    switch (opt) {
+    case 'S':
+      path = optarg;
+      break;
+    case 'w':
+      found = false;
+      for (i = 0; i <= WORKLOAD_MIXED; ++i)
+        if (!strcmp(optarg, workload_names[i])) {
+          workload = i;
+          found = true;
+        }
+      if (!found) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'n':
+      fingers = atoi(optarg);
+      if (fingers < 1 || fingers > 10)
+        fingers = 10;
+      break;
+    case 'z':
+      rate = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'm':
+      shm = true;
+      break;
+    case 'c':
+      compare = true;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (rate <= 0)
+    rate = workload == WORKLOAD_MOUSE ? 8000 : 120;
+  period = 1000000 / rate;
+  if (compare && duration <= 0) {
+    fprintf(stderr, "The compare mode needs a duration\n");
+    return 1;
+  }
+  if (compare)
+    shm = true;
+  transport = shm && !compare ? TRANSPORT_SHM : TRANSPORT_SOCKET;
+  memset(stats, 0, sizeof(stats));
+
+  fds[0].fd = listen_on(path);
+  if (fds[0].fd < 0)
+    return 1;
+  fds[0].events = POLLIN;
+  printf("Listening on %s, %s at %dHz\n", path, workload_names[workload], rate);
+
+  start = now_us();
+  next = start;
+  last_report = start;
+  last_loop = start;
+  for (;;) {
+    /* Wait for the next tick, or for the clients to talk. Spin while
+     * frames are on their way, for the pickup latency. */
+    now = now_us();
+    timeout = 0;
+    if (target < 0)
+      timeout = 1000;
+    else if (pending_head != pending_tail || stalled)
+      timeout = 0;
+    else if (next > now)
+      timeout = (next - now) / 1000;
+    if (poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      return 1;
+    }
+
+    if (fds[0].revents & POLLIN && nfds <= MAX_CLIENTS) {
+      fds[nfds].fd = accept(fds[0].fd, NULL, NULL);
+      fds[nfds].events = POLLIN;
+      memset(&clients[nfds], 0, sizeof(clients[nfds]));
+      clients[nfds].fd = fds[nfds].fd;
+      if (fds[nfds].fd >= 0)
+        nfds++;
+    }
+    previous = target;
+    for (i = 1; i < nfds; ++i) {
+      if (!(fds[i].revents & (POLLIN | POLLHUP)))
+        continue;
+      if (!handle_client(&clients[i], i, &target, shm)) {
+        if (target == i)
+          target = -1;
+        release_ring(&clients[i]);
+        close(fds[i].fd);
+        nfds--;
+        if (target == nfds)
+          target = i;
+        if (previous == nfds)
+          previous = i;
+        fds[i] = fds[nfds];
+        clients[i] = clients[nfds];
+        i--;
+      }
+    }
+    if (target != previous)
+      /* Whatever the previous target didn't pick up, it never will */
+      pending_head = pending_tail;
+
+    now = now_us();
+    if (target >= 0) {
+      client = &clients[target];
+      elapsed[used] += now - last_loop;
+      check_pickup(client, used, &stats[used]);
+    }
+    last_loop = now;
+
+    /* Half time, let the socket drain before moving to the ring */
+    switching = compare && transport == TRANSPORT_SOCKET &&
+      now - start >= (uint64_t)duration * 1000000 / 2;
+    if (switching && pending_head == pending_tail) {
+      printf("Switching to the shared ring\n");
+      transport = TRANSPORT_SHM;
+      switching = false;
+      next = now;
+    }
+
+    /* Catch up on the ticks we owe, the rate is what matters */
+    while (target >= 0 && !switching && now_us() >= next) {
+      client = &clients[target];
+      if (transport == TRANSPORT_SHM && client->ring != NULL) {
+        if (used != TRANSPORT_SHM)
+          pending_head = pending_tail;
+        used = TRANSPORT_SHM;
+      } else {
+        if (used != TRANSPORT_SOCKET)
+          pending_head = pending_tail;
+        used = TRANSPORT_SOCKET;
+      }
+      build_frame(&frame, workload, tick, fingers);
+      if (used == TRANSPORT_SHM) {
+        if (!ring_write(client, &frame)) {
+          /* SuperHID is behind, try again in a bit */
+          if (!stalled)
+            stats[used].stalls++;
+          stalled = true;
+          break;
+        }
+      } else if (send(client->fd, frame.records, frame.count * sizeof(struct event_record),
+                      MSG_NOSIGNAL) < 0) {
+        perror("send");
+        target = -1;
+        pending_head = pending_tail;
+        break;
+      }
+      stalled = false;
+      if (pending_tail - pending_head < MAX_PENDING) {
+        pending[pending_tail % MAX_PENDING].sent = now_us();
+        pending[pending_tail % MAX_PENDING].end = used == TRANSPORT_SHM ? client->ring->tail : 0;
+        pending_tail++;
+      }
+      tick++;
+      stats[used].frames++;
+      stats[used].records += frame.count;
+      next += period;
+    }
+    if (target < 0)
+      next = now_us();
+
+    if (now_us() - last_report >= 1000000) {
+      frames = stats[TRANSPORT_SOCKET].frames + stats[TRANSPORT_SHM].frames;
+      records = stats[TRANSPORT_SOCKET].records + stats[TRANSPORT_SHM].records;
+      printf("%"PRIu64" frames/s, %"PRIu64" records/s over the %s\n",
+             frames - last_frames, records - last_records, transport_names[used]);
+      fflush(stdout);
+      last_frames = frames;
+      last_records = records;
+      last_report += 1000000;
+    }
+
+    if (duration > 0 && now_us() - start >= (uint64_t)duration * 1000000)
+      break;
+  }
+
+  for (i = 0; i < TRANSPORTS; ++i)
+    if (stats[i].frames > 0 || (compare && i == TRANSPORT_SHM))
+      print_stats("", i, &stats[i], elapsed[i]);
+
+  return 0;
+}
@@ -28,17 +28,19 @@
  * from the input server repository (testsocketclient.c).
  * It allows to grab input events for a given domid, to send them
  * through SuperHID.
+ * Every domain gets its own connection to input_server and its own
+ * translation state, so any number of domains can be fed at once.
+ *
+ * When enabled, SuperHID also tells input_server how many reports each
+ * domain can take right now (its credits), so that input_server can
+ * coalesce events at the source instead of piling them up in the
+ * socket while a guest is slow.
  */
 
 #include "project.h"
 
-#define SOCK_PATH               "/var/run/input_socket"
-#define MAGIC                   0xAD9CBCE9
-
 /* Shouldn't that be defined somewhere already? */
 #define ABS_MT_SLOT             0x2f
-#define EV_DEV                  0x06
-#define DEV_SET                 0x01
 
 /* All the following is specific to the superhid digitizer */
 #define TIP_SWITCH              0x01
@@ -47,18 +49,10 @@
 #define HIGH_X                  0xFFF
 #define LOW_Y                   0
 #define HIGH_Y                  0xFFF
+/* From the transform output (15 bits) to the digitizer range (12 bits) */
+#define DIGITIZER_SHIFT         3
 
-/* This is actually 8, but we don't want to segv if input_server sends
- * 10 */
-#define MAX_FINGERS             10
-
-struct event_record
-{
-  uint32_t magic;
-  uint16_t itype;
-  uint16_t icode;
-  uint32_t ivalue;
-} __attribute__ ((__packed__));
+const char *superhid_socket_path;
 
 static uint8_t find_scancode(uint8_t keycode)
 {
@@ -109,45 +103,229 @@ static uint8_t find_modifier(uint8_t keycode)
   return (1 << i);
 }
 
-static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode, uint32_t ivalue,
-                                   struct superhid_finger *res, struct superhid_report *report)
+/**
+ * Queue a report of any of the SuperHID types
+ *
+ * @param superback The backend of the domain
+ * @param data      The report, starting with its ID
+ * @param length    The size of the report structure
+ * @param cls       SUPERHID_CLASS_LOSSLESS for state changes,
+ *                  SUPERHID_CLASS_MOTION for anything that can be merged
+ */
+static void queue_report(struct superhid_backend *superback, void *data, size_t length,
+                         enum superhid_class cls)
 {
-  static struct superhid_finger fingers[MAX_FINGERS] = { { 0 } };
-  static struct superhid_report_tablet tablet = { 0 };
-  static struct superhid_report_keyboard keyboard = { 0 };
-  static struct superhid_report_mouse mouse = { 0 };
-  static int multitouch_dev = -42;
-  static int finger = 0;
-  int i;
-  static char just_syned = 0;
-  uint8_t prevtip;
-  int scancode, modifier;
+  struct superhid_report report = { 0 };
+  uint64_t stamp = superback->state.frame_stamp;
+
+  /* Reports are stamped with the time their frame started coming in,
+   * or with the current time for the ones we make up */
+  if (stamp == 0)
+    stamp = superhid_now();
+
+  memcpy(&report, data, length);
+  superscheduler_queue(superback, &report, cls, stamp);
+}
+
+static uint8_t tablet_buttons(struct superhid_report_tablet *tablet)
+{
+  return tablet->left_click | tablet->right_click << 1 | tablet->middle_click << 2;
+}
+
+static uint8_t mouse_buttons(struct superhid_report_mouse *mouse)
+{
+  return mouse->left_click | mouse->right_click << 1 | mouse->middle_click << 2 |
+    mouse->fourth_click << 3 | mouse->fifth_click << 4;
+}
+
+/**
+ * Queue the multitouch report being filled, if it has any finger in
+ *
+ * @param superback The backend of the domain
+ *
+ * @return 1 if a report got queued, 0 otherwise
+ */
+static int flush_multitouch(struct superhid_backend *superback)
+{
+  struct superplugin_state *st = &superback->state;
+  struct superhid_report_multitouch *mt = &st->mt;
+  uint64_t stamp = st->frame_stamp;
+
+  if (mt->count == 0)
+    return 0;
+
+  /* The scan time is the source timestamp of the frame, so all the
+   * reports of a frame share it and the guest sees the real spacing of
+   * the frames, however late or merged they get delivered */
+  if (stamp == 0)
+    stamp = superhid_now();
+  mt->scan_time = stamp / 100;
+
+  /* Touches and lift-offs can't get lost, moves can be merged */
+  mt->report_id = REPORT_ID_MULTITOUCH;
+  queue_report(superback, mt, sizeof(*mt),
+               st->mt_lossless ? SUPERHID_CLASS_LOSSLESS : SUPERHID_CLASS_MOTION);
+  memset(mt, 0, sizeof(*mt));
+  st->mt_lossless = 0;
+
+  return 1;
+}
+
+/**
+ * End of a multitouch frame: queue the contacts that changed since the
+ * previous frame, lift-offs included, as few reports as possible.
+ * Contacts that didn't move don't get reported again.
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of reports queued
+ */
+static int flush_contacts(struct superhid_backend *superback)
+{
+  struct superplugin_state *st = &superback->state;
+  int32_t x[SUPERPLUGIN_MAX_FINGERS], y[SUPERPLUGIN_MAX_FINGERS];
+  uint16_t out_x[SUPERPLUGIN_MAX_FINGERS], out_y[SUPERPLUGIN_MAX_FINGERS];
+  int index[SUPERPLUGIN_MAX_FINGERS];
+  int i, count = 0, queued = 0;
+
+  if (st->dirty == 0)
+    return 0;
+
+  /* Transform all the contacts that changed at once */
+  for (i = 0; i < SUPERPLUGIN_MAX_FINGERS; ++i) {
+    if (!(st->dirty & (1 << i)))
+      continue;
+    index[count] = i;
+    x[count] = st->contact_x[i];
+    y[count] = st->contact_y[i];
+    count++;
+  }
+  supertransform_apply(st->dev_set, x, y, out_x, out_y, count);
+
+  for (i = 0; i < count; ++i) {
+    st->fingers[index[i]].x = out_x[i] >> DIGITIZER_SHIFT;
+    st->fingers[index[i]].y = out_y[i] >> DIGITIZER_SHIFT;
+  }
+
+  for (i = 0; i < SUPERPLUGIN_MAX_FINGERS; ++i) {
+    if (!(st->dirty & (1 << i)))
+      continue;
+    st->mt.fingers[st->mt.count++] = st->fingers[i];
+    if (st->tip_dirty & (1 << i))
+      st->mt_lossless = 1;
+    if (st->mt.count == superback->fingers_per_report)
+      queued += flush_multitouch(superback);
+  }
+  queued += flush_multitouch(superback);
+  st->dirty = 0;
+  st->tip_dirty = 0;
+
+  return queued;
+}
+
+static int32_t clamp_move(int32_t *residual, int32_t limit)
+{
+  int32_t move = *residual;
+
+  if (move > limit)
+    move = limit;
+  else if (move < -limit)
+    move = -limit;
+  *residual -= move;
+
+  return move;
+}
+
+/**
+ * Queue the relative moves of the frame. Moves that don't fit in one
+ * report get split over a few, and whatever is left after that gets
+ * carried over to the next frame instead of wrapping around.
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of reports queued
+ */
+static int flush_mouse(struct superhid_backend *superback)
+{
+  struct superplugin_state *st = &superback->state;
+  struct superhid_report_mouse_wide wide;
+  enum superhid_class cls;
+  int32_t limit = superback->wide_mouse ? 32767 : 127;
+  uint8_t buttons;
+  int queued = 0;
+
+  buttons = mouse_buttons(&st->mouse);
+  cls = buttons != st->mouse_buttons ? SUPERHID_CLASS_LOSSLESS : SUPERHID_CLASS_MOTION;
+  st->mouse_buttons = buttons;
 
-  /* Initialize the report array. */
-  if (fingers[1].finger_id == 0)
-    for (i = 0; i < MAX_FINGERS; ++i)
-      fingers[i].finger_id = i;
+  do {
+    if (superback->wide_mouse) {
+      memset(&wide, 0, sizeof(wide));
+      wide.report_id = REPORT_ID_MOUSE_WIDE;
+      wide.left_click = st->mouse.left_click;
+      wide.right_click = st->mouse.right_click;
+      wide.middle_click = st->mouse.middle_click;
+      wide.fourth_click = st->mouse.fourth_click;
+      wide.fifth_click = st->mouse.fifth_click;
+      wide.x = clamp_move(&st->mouse_x, limit);
+      wide.y = clamp_move(&st->mouse_y, limit);
+      wide.wheel = clamp_move(&st->mouse_wheel, limit);
+      queue_report(superback, &wide, sizeof(wide), cls);
+    } else {
+      st->mouse.x = clamp_move(&st->mouse_x, limit);
+      st->mouse.y = clamp_move(&st->mouse_y, limit);
+      st->mouse.wheel = clamp_move(&st->mouse_wheel, limit);
+      queue_report(superback, &st->mouse, sizeof(st->mouse), cls);
+    }
+    cls = SUPERHID_CLASS_MOTION;
+    queued++;
+  } while ((st->mouse_x || st->mouse_y || st->mouse_wheel) &&
+           queued < SUPERHID_MOUSE_SPLIT);
+
+  memset(&st->mouse, 0, sizeof(st->mouse));
+
+  return queued;
+}
+
+/**
+ * Update the state of a domain with an input event. The state of the
+ * multitouch contacts gets assembled over the whole frame, and the
+ * contacts that changed are queued on SYN_REPORT, along with the
+ * other reports.
+ *
+ * @return The number of reports queued
+ */
+static int process_absolute_event(struct superhid_backend *superback, uint16_t itype,
+                                  uint16_t icode, uint32_t ivalue)
+{
+  struct superplugin_state *st = &superback->state;
+  struct superhid_finger *fingers = st->fingers;
+  uint8_t tip, buttons;
+  uint16_t x, y;
+  int scancode, modifier;
+  int queued = 0;
 
-  if (multitouch_dev == -42)
+  if (st->multitouch_dev == -42)
     if (itype == EV_ABS && icode >= ABS_MT_SLOT && icode <= ABS_MAX)
-      multitouch_dev = dev_set;
+      st->multitouch_dev = st->dev_set;
 
   switch (itype)
   {
   case EV_REL:
     switch (icode)
     {
+    /* Moves add up until the end of the frame */
     case REL_X:
-      mouse.report_id = REPORT_ID_MOUSE;
-      mouse.x = ivalue;
+      st->mouse.report_id = REPORT_ID_MOUSE;
+      st->mouse_x += (int32_t)ivalue;
       break;
     case REL_Y:
-      mouse.report_id = REPORT_ID_MOUSE;
-      mouse.y = ivalue;
+      st->mouse.report_id = REPORT_ID_MOUSE;
+      st->mouse_y += (int32_t)ivalue;
       break;
     case REL_WHEEL:
-      mouse.report_id = REPORT_ID_MOUSE;
-      mouse.wheel = ivalue;
+      st->mouse.report_id = REPORT_ID_MOUSE;
+      st->mouse_wheel += (int32_t)ivalue;
       break;
     default:
       superlog(LOG_DEBUG, "%d REL?", icode);
@@ -158,49 +336,59 @@ static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode,
     switch (icode)
     {
     case ABS_WHEEL:
-      /* tablet.report_id = REPORT_ID_TABLET; */
-      /* tablet.wheel = ivalue; */
+      /* st->tablet.report_id = REPORT_ID_TABLET; */
+      /* st->tablet.wheel = ivalue; */
       break;
     case ABS_X:
       /* Sometimes we get ABS_X events from digitizers... */
-      if (multitouch_dev == -42 || dev_set != multitouch_dev) {
-        tablet.report_id = REPORT_ID_TABLET;
-        tablet.x = ivalue;
+      if (st->multitouch_dev == -42 || st->dev_set != st->multitouch_dev) {
+        st->tablet.report_id = REPORT_ID_TABLET;
+        st->tablet_x = ivalue;
       }
       break;
     case ABS_Y:
       /* Sometimes we get ABS_Y events from digitizers... */
-      if (multitouch_dev == -42 || dev_set != multitouch_dev) {
-        tablet.report_id = REPORT_ID_TABLET;
-        tablet.y = ivalue;
+      if (st->multitouch_dev == -42 || st->dev_set != st->multitouch_dev) {
+        st->tablet.report_id = REPORT_ID_TABLET;
+        st->tablet_y = ivalue;
       }
       break;
     case ABS_MT_POSITION_X:
-      fingers[finger].x = ivalue >> 3;
+      if (st->finger < 0)
+        break;
+      if (st->contact_x[st->finger] != (int32_t)ivalue) {
+        st->contact_x[st->finger] = ivalue;
+        st->dirty |= 1 << st->finger;
+      }
       break;
     case ABS_MT_POSITION_Y:
-      fingers[finger].y = ivalue >> 3;
+      if (st->finger < 0)
+        break;
+      if (st->contact_y[st->finger] != (int32_t)ivalue) {
+        st->contact_y[st->finger] = ivalue;
+        st->dirty |= 1 << st->finger;
+      }
       break;
     case ABS_MT_SLOT:
-      /* We force a SYN_REPORT on ABS_MT_SLOT, because the device is
-       * serial. */
-      /* However, we don't want to send twice the same event for
-       * nothing... */
-      if (!just_syned)
-        memcpy(res, &(fingers[finger]), sizeof(struct superhid_finger));
-      finger = ivalue;
-      superlog(LOG_DEBUG, "finger %d", finger);
+      /* The slot changes don't end the frame anymore, all the contacts
+       * of the frame go out together on SYN_REPORT */
+      if (ivalue < SUPERPLUGIN_MAX_FINGERS) {
+        st->finger = ivalue;
+      } else {
+        /* Its events get ignored until the next valid slot */
+        superlog(LOG_DEBUG, "finger %d out of range", ivalue);
+        st->finger = -1;
+      }
+      superlog(LOG_DEBUG, "finger %d", st->finger);
       break;
     case ABS_MT_TRACKING_ID:
-      prevtip = fingers[finger].tip_switch;
-      if (ivalue == 0xFFFFFFFF)
-        fingers[finger].tip_switch = 0;
-      else
-        fingers[finger].tip_switch = 1;
-      if (fingers[finger].tip_switch < prevtip) {
-        /* The finger was just released, we may not get another event
-         * for a while, let's send it */
-        memcpy(res, &(fingers[finger]), sizeof(struct superhid_finger));
+      tip = (ivalue != 0xFFFFFFFF);
+      if (st->finger >= 0 && fingers[st->finger].tip_switch != tip) {
+        /* The finger was just pressed or released, that needs to go
+         * out even if it didn't move */
+        fingers[st->finger].tip_switch = tip;
+        st->dirty |= 1 << st->finger;
+        st->tip_dirty |= 1 << st->finger;
       }
       break;
     default:
@@ -212,16 +400,16 @@ static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode,
     switch (icode)
     {
     case BTN_LEFT:
-      tablet.report_id = REPORT_ID_TABLET;
-      tablet.left_click = !!ivalue;
+      st->tablet.report_id = REPORT_ID_TABLET;
+      st->tablet.left_click = !!ivalue;
       break;
     case BTN_RIGHT:
-      tablet.report_id = REPORT_ID_TABLET;
-      tablet.right_click = !!ivalue;
+      st->tablet.report_id = REPORT_ID_TABLET;
+      st->tablet.right_click = !!ivalue;
       break;
     case BTN_MIDDLE:
-      tablet.report_id = REPORT_ID_TABLET;
-      tablet.middle_click = !!ivalue;
+      st->tablet.report_id = REPORT_ID_TABLET;
+      st->tablet.middle_click = !!ivalue;
       break;
     case BTN_TOUCH:
       /* Am I supposed to do something here? */
@@ -231,20 +419,20 @@ static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode,
       break;
     default:
       if (icode < 0x100) {
-        keyboard.report_id = REPORT_ID_KEYBOARD;
+        st->keyboard.report_id = REPORT_ID_KEYBOARD;
         modifier = find_modifier(icode);
         if (ivalue != 0) {
           if (modifier != 0) {
-            keyboard.modifier |= modifier;
+            st->keyboard.modifier |= modifier;
           } else {
             scancode = find_scancode(icode);
-            keyboard.keycode[0] = scancode;
+            st->keyboard.keycode[0] = scancode;
           }
         } else {
           if (modifier != 0)
-            keyboard.modifier &= ~modifier;
+            st->keyboard.modifier &= ~modifier;
           else
-            keyboard.keycode[0] = 0;
+            st->keyboard.keycode[0] = 0;
         }
       } else
         superlog(LOG_DEBUG, "%d KEY?", icode);
@@ -255,24 +443,35 @@ static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode,
     switch (icode)
     {
     case SYN_REPORT:
-      if (tablet.report_id == REPORT_ID_TABLET) {
-        memcpy(report, &tablet, sizeof(*report));
-        tablet.report_id = 0;
-        /* tablet.wheel = 0; */
-      } else if (keyboard.report_id == REPORT_ID_KEYBOARD) {
-        memcpy(report, &keyboard, sizeof(*report));
-        keyboard.report_id = 0;
-      } else if (mouse.report_id == REPORT_ID_MOUSE) {
-        memcpy(report, &mouse, sizeof(*report));
-        memset(&mouse, 0, sizeof(mouse));
-      } else {
-        memcpy(res, &(fingers[finger]), sizeof(struct superhid_finger));
+      /* The frame is over, every device it touched gets a report.
+       * Button and key changes are lossless, the rest is motion.
+       * They all get delivered together once the input is drained. */
+      if (st->tablet.report_id == REPORT_ID_TABLET) {
+        supertransform_apply(st->dev_set, &st->tablet_x, &st->tablet_y,
+                             &x, &y, 1);
+        st->tablet.x = x;
+        st->tablet.y = y;
+        buttons = tablet_buttons(&st->tablet);
+        queue_report(superback, &st->tablet, sizeof(st->tablet),
+                     buttons != st->tablet_buttons ? SUPERHID_CLASS_LOSSLESS : SUPERHID_CLASS_MOTION);
+        st->tablet_buttons = buttons;
+        st->tablet.report_id = 0;
+        /* st->tablet.wheel = 0; */
+        queued++;
       }
-      just_syned = 1;
-      /* re-init */
-      /* Nothing to do? */
+      if (st->keyboard.report_id == REPORT_ID_KEYBOARD) {
+        queue_report(superback, &st->keyboard, sizeof(st->keyboard),
+                     SUPERHID_CLASS_LOSSLESS);
+        st->keyboard.report_id = 0;
+        queued++;
+      }
+      if (st->mouse.report_id == REPORT_ID_MOUSE ||
+          st->mouse_x || st->mouse_y || st->mouse_wheel) {
+        queued += flush_mouse(superback);
+      }
+      queued += flush_contacts(superback);
+      st->frame_stamp = 0;
       superlog(LOG_DEBUG, "SYN_REPORT");
-      return;
       break;
     default:
       superlog(LOG_DEBUG, "%d SYN?", icode);
@@ -292,51 +491,113 @@ static void process_absolute_event(int dev_set, uint16_t itype, uint16_t icode,
     break;
   }
 
-  just_syned = 0;
+  return queued;
 }
 
-static void process_event(struct event_record *r,
-                          struct buffer_t *b,
-                          struct superhid_finger *finger,
-                          struct superhid_report *report)
+/**
+ * Run the events held for the filters through them, and translate
+ * what's left
+ *
+ * @return The number of reports queued
+ */
+static int flush_held(struct superhid_backend *superback)
 {
+  struct superplugin_state *st = &superback->state;
+  int i, count, queued = 0;
+
+  count = superfilter_run(superback - superbacks, st->dev_set, st->held,
+                         st->held_count, st->frame_stamp);
+  for (i = 0; i < count; ++i)
+    queued += process_absolute_event(superback, st->held[i].type,
+                                     st->held[i].code, st->held[i].value);
+  st->held_count = 0;
+
+  return queued;
+}
+
+/**
+ * Hold an event until the end of the frame, for the filters
+ *
+ * @return The number of reports queued
+ */
+static int hold_event(struct superhid_backend *superback, uint16_t itype,
+                      uint16_t icode, uint32_t ivalue)
+{
+  struct superplugin_state *st = &superback->state;
+  int queued;
+
+  if (itype == EV_SYN && icode == SYN_REPORT) {
+    queued = flush_held(superback);
+    return queued + process_absolute_event(superback, itype, icode, ivalue);
+  }
+
+  st->held[st->held_count].type = itype;
+  st->held[st->held_count].code = icode;
+  st->held[st->held_count].value = ivalue;
+  /* That's a long frame, the filters will get it in pieces */
+  if (++st->held_count == FRAME_MAX_EVENTS)
+    return flush_held(superback);
+
+  return 0;
+}
+
+static int process_event(struct event_record *r,
+                         struct superhid_backend *superback,
+                         uint64_t stamp)
+{
+  struct superplugin_state *st = &superback->state;
   uint16_t itype;
   uint16_t icode;
   uint32_t ivalue;
-  static int dev_set;
+  int queued;
 
   itype = r->itype;
   icode = r->icode;
   ivalue = r->ivalue;
 
+  /* The frame is as old as its first event */
+  if (st->frame_stamp == 0)
+    st->frame_stamp = stamp;
+
+  /* Everything that gets translated goes through here, whatever the
+   * source */
+  supercapture_record(superback->di.di_domid, r, stamp);
+
   if (itype == EV_DEV)
   {
     if (icode == DEV_SET) {
-      dev_set = ivalue;
-      superlog(LOG_DEBUG, "DEV_SET %d", dev_set);
+      /* Whatever the previous source left unfinished goes first */
+      queued = st->held_count > 0 ? flush_held(superback) : 0;
+      st->dev_set = ivalue;
+      superlog(LOG_DEBUG, "DEV_SET %d", st->dev_set);
+      return queued;
     } else {
       superlog(LOG_DEBUG, "EV_DEV %d %d?", icode, ivalue);
     }
-    return;
+    return 0;
   }
 
 /* TODO: Here we need to figure out if dev_set is the touchscreen or not. */
 /* Then we need to fix input_server and send the non-touch events back. */
 #if 0
-  if (dev_set != 5) {
+  if (st->dev_set != 5) {
     /* process_relative_event() didn't do anything, and this is not a
      * touchscreen event (device 6).
      * At this point we'd want to just send that event to the guest
      * unmodified. Unfortunately, event sending seems to be broken... */
     if (itype == EV_KEY) {
       r->magic = MAGIC;
-      send(b->s, r, sizeof(struct event_record), 0);
+      send(superback->buffers.s, r, sizeof(struct event_record), 0);
     }
-    return;
+    return 0;
   }
 #endif
 
-  process_absolute_event(dev_set, itype, icode, ivalue, finger, report);
+  /* Sources with filters get their frames held, see superfilter.c */
+  if (superfilter_count > 0 && superfilter_active(st->dev_set))
+    return hold_event(superback, itype, icode, ivalue);
+
+  return process_absolute_event(superback, itype, icode, ivalue);
 }
 
 static struct event_record *findnext(struct buffer_t *b)
@@ -348,8 +609,6 @@ static struct event_record *findnext(struct buffer_t *b)
   while (b->bytes_remaining >= EVENT_SIZE &&
          (r = (struct event_record *) &b->buffer[b->position]) && r->magic != MAGIC)
   {
-    superlog(LOG_DEBUG, "Junk skipped from input_server buffer");
-    sleep(1);
     b->bytes_remaining--;
     b->position++;
   }
@@ -367,26 +626,121 @@ static struct event_record *findnext(struct buffer_t *b)
     return NULL;
 }
 
+/**
+ * Same as findnext(), for v2 frames
+ *
+ * @param b The receiving buffer
+ *
+ * @return The next complete frame, or NULL
+ */
+static struct frame_header *findnext_frame(struct buffer_t *b)
+{
+  struct frame_header *h;
+  int start = b->position;
+  int length;
+
+  /* Skip junk, a frame that can't be valid is junk too */
+  while (b->bytes_remaining >= sizeof(*h) &&
+         (h = (struct frame_header *) &b->buffer[b->position]) &&
+         (h->magic != MAGIC_V2 || h->count > FRAME_MAX_EVENTS))
+  {
+    b->bytes_remaining--;
+    b->position++;
+  }
+
+  if (start != b->position)
+    superlog(LOG_DEBUG, "Warning: Encountered %d bytes of junk.", b->position - start);
+
+  if (b->bytes_remaining < sizeof(*h))
+    return NULL;
+  length = FRAME_SIZE(h->count);
+  if (b->bytes_remaining < length)
+    return NULL;
+
+  b->bytes_remaining -= length;
+  b->position += length;
+  return h;
+}
+
+/**
+ * Check if the receiving buffer holds a whole record, or a whole frame
+ * in v2, so that it can be parsed without reading more
+ */
+static bool buffer_ready(struct buffer_t *b)
+{
+  struct frame_header *h;
+
+  if (b->version < 2)
+    return b->bytes_remaining >= EVENT_SIZE;
+  if (b->bytes_remaining < sizeof(*h))
+    return false;
+  h = (struct frame_header *) &b->buffer[b->position];
+  if (h->magic != MAGIC_V2 || h->count > FRAME_MAX_EVENTS)
+    /* Junk, findnext_frame() will skip it */
+    return true;
+
+  return b->bytes_remaining >= FRAME_SIZE(h->count);
+}
+
+/**
+ * Translate a v2 frame. The frame carries the time input_server read
+ * it, which is what its reports get stamped with, so the latency
+ * accounting covers input_server too.
+ *
+ * @param superback The backend of the domain
+ * @param h         The frame
+ * @param stamp     superhid_now() when the frame got received
+ *
+ * @return The number of reports queued
+ */
+static int process_frame(struct superhid_backend *superback,
+                         struct frame_header *h, uint64_t stamp)
+{
+  struct frame_event *events = (struct frame_event *)(h + 1);
+  struct event_record r;
+  int i, queued = 0;
+
+  /* Both sides use CLOCK_MONOTONIC, but don't trust it blindly */
+  if (h->timestamp != 0 && h->timestamp <= stamp)
+    stamp = h->timestamp;
+
+  /* Same as a DEV_SET record, so that captures see it too */
+  r.magic = MAGIC;
+  r.itype = EV_DEV;
+  r.icode = DEV_SET;
+  r.ivalue = h->source;
+  process_event(&r, superback, stamp);
+  for (i = 0; i < h->count; ++i) {
+    r.itype = events[i].type;
+    r.icode = events[i].code;
+    r.ivalue = events[i].value;
+    queued += process_event(&r, superback, stamp);
+  }
+
+  return queued;
+}
+
 /**
  * Call this function when there's input events available in the fd or
  * in the remaining buffer. The function will handle one event at
- * most. If it's a touch event, it will return the correponding
- * finger. For any other event, it will fill a generic report.
+ * most, or one frame in v2. The reports get queued at the end of an
+ * input frame.
  *
  * @param superback The SuperHID backend for the domain that select()-ed
  * @param fd        The file descriptor that select()-ed
- * @param finger    A pointer to a SuperHID finger for multitouch events
- * @param report    A pointer to a generic SuperHID report for other events
+ * @param queued    Incremented by the number of reports queued
  *
  * @return It returns the number of bytes remaining in the receiving buffer
  */
 static int superplugin_callback(struct superhid_backend *superback,
                                 int fd,
-                                struct superhid_finger *finger,
-                                struct superhid_report *report)
+                                int *queued)
 {
   int n = 0;
+  bool received = false;
   struct buffer_t *buf;
+  struct event_record *r;
+  struct frame_header *h;
   char *b;
 
   buf = &superback->buffers;
@@ -397,27 +751,41 @@ static int superplugin_callback(struct superhid_backend *superback,
   if (buf->position != 0 && buf->bytes_remaining != 0)
     memmove(b, b + buf->position, buf->bytes_remaining);
   buf->position = 0;
-  if (buf->bytes_remaining < EVENT_SIZE)
+  if (!buffer_ready(buf)) {
     n = recv(fd, &b[buf->bytes_remaining], buffersize - buf->bytes_remaining, 0);
+    received = true;
+  }
 
   if (n < 0) {
     superlog(LOG_ERR, "FAILED TO READ THE FD");
     perror("recv");
     return buf->bytes_remaining;
   }
+  if (received && n == 0) {
+    superlog(LOG_ERR, "input_server closed the connection for domid %d",
+             superback->di.di_domid);
+    return -1;
+  }
+  /* Events are timestamped when they get in */
+  if (n > 0)
+    buf->stamp = superhid_now();
 
-  if (n + buf->bytes_remaining >= EVENT_SIZE)
-  {
-    struct event_record *r = NULL;
-
-    buf->bytes_remaining += n;
+  buf->bytes_remaining += n;
 
+  if (buf->version >= 2) {
+    h = findnext_frame(buf);
+    if (h != NULL)
+      *queued += process_frame(superback, h, buf->stamp);
+  } else if (buf->bytes_remaining >= EVENT_SIZE) {
     r = findnext(buf);
-    if (r != NULL)
-      process_event(r, buf, finger, report);
+    if (r != NULL && r->itype == EV_CMD && r->icode == CMD_VERSION) {
+      /* input_server agreed on a version, frames follow */
+      buf->version = r->ivalue < PROTO_VERSION ? r->ivalue : PROTO_VERSION;
+      superlog(LOG_INFO, "input_server speaks v%d for domid %d",
+               buf->version, superback->di.di_domid);
+    } else if (r != NULL)
+      *queued += process_event(r, superback, buf->stamp);
   }
-  else
-    buf->bytes_remaining += n;
 
   return buf->bytes_remaining;
 }
@@ -434,8 +802,8 @@ static void suck(int s, int d)
   struct event_record e;
 
   e.magic = MAGIC;
-  e.itype = 7;
-  e.icode = 0x2;
+  e.itype = EV_CMD;
+  e.icode = CMD_SUCK;
   e.ivalue = d;
 
   if (send(s, &e, sizeof (struct event_record), 0) == -1)
@@ -445,56 +813,370 @@ static void suck(int s, int d)
   }
 }
 
+/**
+ * Tell input_server the highest protocol version we speak
+ *
+ * @param s   The socket
+ * @param max The version
+ */
+static void version(int s, int max)
+{
+  struct event_record e;
+
+  e.magic = MAGIC;
+  e.itype = EV_CMD;
+  e.icode = CMD_VERSION;
+  e.ivalue = max;
+
+  if (send(s, &e, sizeof (struct event_record), 0) == -1)
+    superlog(LOG_ERR, "Failed to send the protocol version");
+}
+
+/**
+ * Tell input_server how many reports a domain can take
+ *
+ * @param s       The socket
+ * @param d       The domid of the domain
+ * @param credits The number of reports
+ */
+static void credit(int s, int d, int credits)
+{
+  struct event_record e;
+
+  e.magic = MAGIC;
+  e.itype = EV_CMD;
+  e.icode = CMD_CREDIT;
+  e.ivalue = credits;
+
+  if (send(s, &e, sizeof (struct event_record), 0) == -1)
+    superlog(LOG_ERR, "Failed to send credits for domid %d", d);
+}
+
+/**
+ * Advertise the credits of a domain to input_server, if they changed.
+ * Credits are the INT requests the frontends left pending, minus the
+ * reports already waiting for them.
+ *
+ * @param superback The backend of the domain
+ */
+void superplugin_credit(struct superhid_backend *superback)
+{
+  int credits;
+
+  if (superback->buffers.s <= 0)
+    return;
+
+  credits = superbackend_pending_requests(superback) - superscheduler_queued(superback);
+  if (credits < 0)
+    credits = 0;
+  if (credits == superback->credits)
+    return;
+
+  superlog(LOG_DEBUG, "domid %d has %d credits", superback->di.di_domid, credits);
+  credit(superback->buffers.s, superback->di.di_domid, credits);
+  superback->credits = credits;
+}
+
+/**
+ * The domain that has the input focus, in focus mode
+ */
+static struct superhid_backend *focused = NULL;
+
+bool superhid_focus;
+
+/**
+ * Queue reports that release every key, button and finger that is
+ * currently down in a domain, and forget about them.
+ * This is used when the input focus moves away from a domain, so that
+ * nothing stays stuck in there.
+ *
+ * @param superback The backend of the domain
+ */
+static void release_all(struct superhid_backend *superback)
+{
+  struct superplugin_state *st = &superback->state;
+  int i;
+
+  st->frame_stamp = 0;
+
+  memset(&st->keyboard, 0, sizeof(st->keyboard));
+  st->keyboard.report_id = REPORT_ID_KEYBOARD;
+  queue_report(superback, &st->keyboard, sizeof(st->keyboard), SUPERHID_CLASS_LOSSLESS);
+  st->keyboard.report_id = 0;
+
+  st->tablet.left_click = 0;
+  st->tablet.right_click = 0;
+  st->tablet.middle_click = 0;
+  st->tablet.report_id = REPORT_ID_TABLET;
+  queue_report(superback, &st->tablet, sizeof(st->tablet), SUPERHID_CLASS_LOSSLESS);
+  st->tablet.report_id = 0;
+  st->tablet_buttons = 0;
+
+  memset(&st->mouse, 0, sizeof(st->mouse));
+  st->mouse_x = 0;
+  st->mouse_y = 0;
+  st->mouse_wheel = 0;
+
+  for (i = 0; i < SUPERPLUGIN_MAX_FINGERS; ++i) {
+    if (!st->fingers[i].tip_switch)
+      continue;
+    st->fingers[i].tip_switch = 0;
+    st->dirty |= 1 << i;
+    st->tip_dirty |= 1 << i;
+  }
+  flush_contacts(superback);
+}
+
+/**
+ * Queue the current state of the keys, buttons and fingers of a
+ * domain, for when some of its lossless reports got dropped
+ *
+ * @param superback The backend of the domain
+ */
+void superplugin_resync(struct superhid_backend *superback)
+{
+  struct superplugin_state *st = &superback->state;
+  uint8_t report_id;
+  int i;
+
+  superlog(LOG_INFO, "Resyncing the input state of domid %d", superback->di.di_domid);
+
+  /* We may be in the middle of a frame, keep track of what it
+   * changed so far */
+  report_id = st->keyboard.report_id;
+  st->keyboard.report_id = REPORT_ID_KEYBOARD;
+  queue_report(superback, &st->keyboard, sizeof(st->keyboard), SUPERHID_CLASS_LOSSLESS);
+  st->keyboard.report_id = report_id;
+
+  report_id = st->tablet.report_id;
+  st->tablet.report_id = REPORT_ID_TABLET;
+  queue_report(superback, &st->tablet, sizeof(st->tablet), SUPERHID_CLASS_LOSSLESS);
+  st->tablet.report_id = report_id;
+  st->tablet_buttons = tablet_buttons(&st->tablet);
+
+  for (i = 0; i < SUPERPLUGIN_MAX_FINGERS; ++i) {
+    st->dirty |= 1 << i;
+    st->tip_dirty |= 1 << i;
+  }
+  flush_contacts(superback);
+}
+
 static void input_handler(int fd, short event, void *priv)
 {
   struct superhid_backend *superback = priv;
-  struct superhid_report_multitouch report = { 0 };
-  struct superhid_report custom_report = { 0 };
-  struct superhid_finger *finger;
-  int remaining = EVENT_SIZE;
-  int sents = 0;
-
-  /* We send a maximum of 2 packets, because that's usually how
-   * many pending INT requests we have. */
-  while (sents < 2 && remaining >= EVENT_SIZE && superbackend_all_pending(superback))
+  int remaining;
+  int queued = 0;
+
+  if (superback->focus_stamp != 0) {
+    /* First input since we took the focus, the switch is complete */
+    superlog(LOG_INFO, "Input focus reached domid %d in %"PRIu64"us",
+             superback->di.di_domid, superhid_now() - superback->focus_stamp);
+    superback->focus_stamp = 0;
+  }
+
+  /* Translate everything we got, as long as there's room to queue the
+   * reports, or forever if the domain would rather lose old reports.
+   * Their delivery is up to the scheduler, which sends as many as the
+   * frontends have pending INT requests for, and keeps the rest until
+   * more requests come in. */
+  do
   {
-    finger = &report.fingers[report.count];
-    /* I don't think the finger ID can ever be 0xF. Use that to know
-     * if superplugin_callback succeeded */
-    finger->finger_id = 0xF;
-    remaining = superplugin_callback(superback, fd, finger, &custom_report);
-    if (custom_report.report_id != 0) {
-      superbackend_send_report_to_frontends(&custom_report, superback);
-      memset(&custom_report, 0, sizeof(report));
-      sents++;
-      continue;
-    }
-    if (finger->finger_id != 0xF) {
-      report.report_id = REPORT_ID_MULTITOUCH;
-      report.count++;
+    remaining = superplugin_callback(superback, fd, &queued);
+    if (remaining < 0) {
+      /* input_server hung up */
+      event_del(&superback->input_event);
+      break;
     }
-    if (report.count == SUPERHID_FINGER_WIDTH) {
-      /* The report is full, let's send it and start a new one */
-      superbackend_send_report_to_frontends((struct superhid_report *)&report, superback);
-      memset(&report, 0, sizeof(report));
-      sents++;
+    if (superback->overflow == SUPERHID_OVERFLOW_BLOCK &&
+        superscheduler_room(superback) < SUPERHID_QUEUE_RESERVE) {
+      /* The guest isn't keeping up, leave the rest in the socket
+       * until the scheduler frees some room */
+      superback->input_paused = true;
+      event_del(&superback->input_event);
     }
+  } while (buffer_ready(&superback->buffers) && !superback->input_paused);
+
+  /* Hand the reports over to the frontends, this domain and the
+   * others taking turns */
+  superscheduler_run();
+}
+
+/**
+ * Start reading input again for a domain that had its queue fill up
+ *
+ * @param superback The backend object for the domain
+ */
+void superplugin_resume(struct superhid_backend *superback)
+{
+  if (!superback->input_paused || superback->buffers.s <= 0)
+    return;
+
+  superback->input_paused = false;
+  event_add(&superback->input_event, NULL);
+  supershm_kick(superback);
+  /* There may be events left in our buffer, not just in the socket */
+  if (buffer_ready(&superback->buffers))
+    event_active(&superback->input_event, EV_READ, 0);
+}
+
+/**
+ * The frame of local input being assembled. It gets filtered once and
+ * then translated for every domain it goes to, the filters keep state
+ * per source and must not see the same frame twice.
+ */
+static struct frame_event local_held[FRAME_MAX_EVENTS + 1];
+static int local_held_count = 0;
+static int local_dev = -1;
+static uint64_t local_stamp;
+
+/**
+ * Translate events that already went through the filters for a domain
+ *
+ * @param superback The backend of the domain
+ * @param dev       The source device
+ * @param events    The events
+ * @param count     The number of events
+ * @param stamp     superhid_now() when the frame got in
+ */
+static void feed(struct superhid_backend *superback, int dev,
+                 const struct frame_event *events, int count, uint64_t stamp)
+{
+  struct superplugin_state *st = &superback->state;
+  int i;
+
+  /* Whatever the previous source left unfinished goes first */
+  if (st->dev_set != dev && st->held_count > 0)
+    flush_held(superback);
+  st->dev_set = dev;
+  for (i = 0; i < count; ++i) {
+    if (st->frame_stamp == 0)
+      st->frame_stamp = stamp;
+    process_absolute_event(superback, events[i].type, events[i].code, events[i].value);
+  }
+}
+
+/**
+ * Filter what's held of the local frame, and hand it to the domains
+ *
+ * @param targets The domains
+ * @param n       The number of domains
+ * @param syn     The SYN_REPORT that ends the frame, or NULL
+ */
+static void flush_local(struct superhid_backend **targets, int n,
+                        const struct frame_event *syn)
+{
+  int i, count = local_held_count;
+
+  if (superfilter_count > 0 && superfilter_active(local_dev))
+    count = superfilter_run(SUPERFILTER_LOCAL, local_dev, local_held, count, local_stamp);
+  if (syn != NULL)
+    local_held[count++] = *syn;
+  for (i = 0; i < n; ++i)
+    feed(targets[i], local_dev, local_held, count, local_stamp);
+  local_held_count = 0;
+}
+
+/**
+ * Feed input events that didn't come through input_server to the
+ * domains they go to, see superplugin_targets(), and deliver the
+ * resulting reports
+ *
+ * @param dev    An identifier for the source device, like DEV_SET
+ * @param events The events
+ * @param count  The number of events
+ * @param stamp  superhid_now() when the events got in
+ */
+void superplugin_input(int dev, struct input_event *events, int count,
+                       uint64_t stamp)
+{
+  struct superhid_backend *targets[SUPERHID_MAX_BACKENDS];
+  struct frame_event event;
+  struct event_record r;
+  int i, j, n;
+
+  n = superplugin_targets(targets);
+  if (n == 0) {
+    local_held_count = 0;
+    return;
   }
+  if (local_held_count > 0 && local_dev != dev)
+    flush_local(targets, n, NULL);
+  local_dev = dev;
+
+  /* The captures get the events as they came, like with input_server */
+  r.magic = MAGIC;
+  r.itype = EV_DEV;
+  r.icode = DEV_SET;
+  r.ivalue = dev;
+  for (j = 0; j < n; ++j)
+    supercapture_record(targets[j]->di.di_domid, &r, stamp);
+
+  for (i = 0; i < count; ++i) {
+    r.itype = event.type = events[i].type;
+    r.icode = event.code = events[i].code;
+    r.ivalue = event.value = events[i].value;
+    for (j = 0; j < n; ++j)
+      supercapture_record(targets[j]->di.di_domid, &r, stamp);
 
-  if (report.count > 0) {
-    /* The loop ended on a partial report, we need to send it */
-    superbackend_send_report_to_frontends((struct superhid_report *)&report, superback);
+    if (event.type == EV_SYN && event.code == SYN_REPORT) {
+      flush_local(targets, n, &event);
+      continue;
+    }
+    if (local_held_count == 0)
+      local_stamp = stamp;
+    local_held[local_held_count++] = event;
+    /* That's a long frame, the filters will get it in pieces */
+    if (local_held_count == FRAME_MAX_EVENTS)
+      flush_local(targets, n, NULL);
   }
 
-  if (sents == 2 && remaining >= EVENT_SIZE) {
-    /* We sent 2 packets and the input buffer still has at least one
-     * event, we need to get rescheduled even if no more input comes */
-    event_active(&superback->input_event, event, 0);
+  /* Without filters, there's no need to wait for the end of the frame */
+  if (local_held_count > 0 && !(superfilter_count > 0 && superfilter_active(dev)))
+    flush_local(targets, n, NULL);
+
+  superscheduler_run();
+}
+
+/**
+ * Translate an event record that didn't come through the socket
+ * stream, like the ones from the shared ring
+ *
+ * @param superback The backend of the domain
+ * @param r         The record
+ * @param stamp     superhid_now() when the record got in
+ *
+ * @return The number of reports queued
+ */
+int superplugin_process(struct superhid_backend *superback,
+                        struct event_record *r, uint64_t stamp)
+{
+  if (r->magic != MAGIC) {
+    superlog(LOG_DEBUG, "Junk skipped from the shared ring");
+    return 0;
   }
+
+  return process_event(r, superback, stamp);
 }
 
 /**
- * Configures a SuperHID backend for input
+ * Resets the input translation state of a domain
+ *
+ * @param st The state to reset
+ */
+void superplugin_state_init(struct superplugin_state *st)
+{
+  int i;
+
+  memset(st, 0, sizeof(*st));
+  for (i = 0; i < SUPERPLUGIN_MAX_FINGERS; ++i)
+    st->fingers[i].finger_id = i;
+  st->multitouch_dev = -42;
+}
+
+/**
+ * Configures a SuperHID backend for input. Every device of the domain
+ * calls this when its frontend connects, only the first call does
+ * anything until superplugin_release().
  *
  * @param superback The SuperHID backend to initialize
  *
@@ -507,12 +1189,34 @@ int superplugin_create(struct superhid_backend *superback)
   int domid;
   struct event *input_event;
 
+  if (superback->input_attached)
+    return 0;
+
   domid = superback->di.di_domid;
 
-  /* input_server only support one plugin at a time!!??!! :( */
-  if (input_grabber >= 0 || input_grabber == -domid)
-    return -1;
-  input_grabber = domid;
+  superback->buffers.bytes_remaining = 0;
+  superback->buffers.position = 0;
+  superback->buffers.copy = 0;
+  superback->buffers.block = 0;
+  superback->buffers.s = 0;
+  superback->buffers.version = 1;
+  superback->input_paused = false;
+  superback->credits = -1;
+  superplugin_state_init(&superback->state);
+
+  if (superhid_evdev) {
+    /* The events come straight from the devices, see superevdev.c,
+     * and go to every domain, or to the last one that got created or
+     * focused in focus mode */
+    if (superhid_focus) {
+      if (focused != NULL && focused != superback)
+        release_all(focused);
+      focused = superback;
+    }
+    superback->input_attached = true;
+    superlog(LOG_INFO, "Input events for domid %d now come from evdev", domid);
+    return 0;
+  }
 
   /* Trying to connect to input_server to get events */
   if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
@@ -524,7 +1228,8 @@ int superplugin_create(struct superhid_backend *superback)
   superlog(LOG_DEBUG, "Trying to grab events for domid %d...", domid);
 
   remote.sun_family = AF_UNIX;
-  strcpy(remote.sun_path, SOCK_PATH);
+  strncpy(remote.sun_path, superhid_socket_path, sizeof(remote.sun_path) - 1);
+  remote.sun_path[sizeof(remote.sun_path) - 1] = '\0';
   len = strlen(remote.sun_path) + sizeof(remote.sun_family);
   if (connect(s, (struct sockaddr *) &remote, len) == -1)
   {
@@ -532,14 +1237,25 @@ int superplugin_create(struct superhid_backend *superback)
     exit(1);
   }
 
-  superback->buffers.bytes_remaining = 0;
-  superback->buffers.position = 0;
-  superback->buffers.copy = 0;
-  superback->buffers.block = 0;
   superback->buffers.s = s;
 
+  /* Ask for v2 frames, the answer comes in the stream */
+  version(s, PROTO_VERSION);
+
+  /* Offer input_server to skip the socket for the events */
+  if (superhid_shm && supershm_offer(superback) < 0)
+    superlog(LOG_ERR, "Falling back to the socket for domid %d", domid);
+
+  /* Ask input_server for the events of the domain on its connection.
+   * In focus mode, that's also the domain that takes the focus. */
   suck(s, domid);
+  if (superhid_focus) {
+    if (focused != NULL && focused != superback)
+      release_all(focused);
+    focused = superback;
+  }
 
+  superback->input_attached = true;
   superlog(LOG_INFO, "Input events for domid %d are now going through SuperHID", domid);
 
   input_event = &superback->input_event;
@@ -551,7 +1267,8 @@ int superplugin_create(struct superhid_backend *superback)
 }
 
 /**
- * Close the connection to input_server for a given domain
+ * Close the connection to input_server for a given domain. The other
+ * domains keep their own connections.
  *
  * @param superback The backend object for the domain
  */
@@ -559,11 +1276,97 @@ void superplugin_release(struct superhid_backend *superback)
 {
   int domid = superback->di.di_domid;
 
+  if (focused == superback)
+    focused = NULL;
+  superback->input_attached = false;
+  superfilter_release(superback - superbacks);
+  if (superback->buffers.s <= 0)
+    return;
+
   superlog(LOG_INFO, "Closing the input socket for domid %d", domid);
-  if (domid == input_grabber) {
-    close(superback->buffers.s);
-    /* Hack: attempt at blocking that domid from instantly re-grabbing
-     * input before dying... */
-    input_grabber = -input_grabber;
+  supershm_release(superback);
+  event_del(&superback->input_event);
+  close(superback->buffers.s);
+  superback->buffers.s = 0;
+}
+
+/**
+ * Get the domain that has the input focus
+ *
+ * @return The backend of the domain, or NULL if there's none or if
+ *         we're not in focus mode
+ */
+struct superhid_backend *superplugin_focused(void)
+{
+  return focused;
+}
+
+/**
+ * Get the domains that the input which isn't tied to a domain goes
+ * to, like the evdev and hidraw one: the one that has the focus in
+ * focus mode, all of them otherwise
+ *
+ * @param targets Where to put them, room for SUPERHID_MAX_BACKENDS
+ *
+ * @return The number of domains
+ */
+int superplugin_targets(struct superhid_backend **targets)
+{
+  int i, count = 0;
+
+  if (superhid_focus) {
+    if (focused != NULL)
+      targets[count++] = focused;
+    return count;
   }
+
+  for (i = 0; i < SUPERHID_MAX_BACKENDS; ++i)
+    if (superbacks[i].di.di_dompath != NULL)
+      targets[count++] = &superbacks[i];
+
+  return count;
+}
+
+/**
+ * Move the input focus to a given domain. The connection of the
+ * domain is already open, so this only takes telling input_server to
+ * send the events there. The previously focused domain gets
+ * everything released.
+ * Outside of focus mode, every domain gets its input already and this
+ * does nothing.
+ *
+ * @param superback The backend object for the domain
+ *
+ * @return 0 on success, -1 if the domain has no input connection
+ */
+int superplugin_focus(struct superhid_backend *superback)
+{
+  struct superhid_backend *previous = focused;
+  uint64_t start;
+
+  if (!superhid_focus) {
+    superlog(LOG_DEBUG, "Not in focus mode, domid %d already gets its input",
+             superback->di.di_domid);
+    return 0;
+  }
+  if (!superback->input_attached)
+    return -1;
+  if (superback == focused)
+    return 0;
+
+  start = superhid_now();
+  if (!superhid_evdev)
+    suck(superback->buffers.s, superback->di.di_domid);
+  focused = superback;
+  superback->focus_stamp = start;
+  if (previous != NULL) {
+    release_all(previous);
+    superscheduler_run();
+  }
+
+  superlog(LOG_INFO, "Input focus moved from domid %d to domid %d in %"PRIu64"us",
+           previous != NULL ? previous->di.di_domid : -1,
+           superback->di.di_domid, superhid_now() - start);
+
+  return 0;
 }
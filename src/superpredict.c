@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superpredict.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Wed Oct 21 14:40:31 2026
+ *
+ * @brief  Motion prediction
+ *
+ * By the time a guest draws a contact, it has moved on. To hide that,
+ * the positions of the absolute contacts can be extrapolated by the
+ * time it takes them to get to the guest, assuming a constant
+ * velocity. The velocity of every axis of every contact is estimated
+ * from the ingestion timestamps of the frames, and smoothed a bit so
+ * a single jittery sample doesn't throw the prediction off.
+ * It runs as a filter stage (see superfilter.c), so it can be enabled
+ * and tuned per source device.
+ */
+
+#include "project.h"
+
+/* Fractional bits of the velocities, in units per ms */
+#define VELOCITY_FRAC           8
+/* Samples further apart than that don't say much about the velocity */
+#define PREDICT_MAX_GAP         100000 /* us */
+/* How far ahead we're willing to guess */
+#define PREDICT_MAX_LEAD        50000 /* us */
+
+/**
+ * Forget everything about a contact, like when it gets lifted and
+ * another one comes down
+ *
+ * @param predict The predictor of the source
+ * @param slot    The slot of the contact
+ */
+void superpredict_reset(struct superpredict *predict, int slot)
+{
+  memset(predict->axes[slot], 0, sizeof(predict->axes[slot]));
+}
+
+/**
+ * Update the velocity of an axis of a contact with a new position,
+ * and extrapolate it
+ *
+ * @param predict The predictor of the source
+ * @param slot    The slot of the contact, SUPERPLUGIN_MAX_FINGERS for
+ *                ABS_X/ABS_Y
+ * @param axis    0 for X, 1 for Y
+ * @param value   The position
+ * @param stamp   When it got in, in us
+ * @param lead    How far ahead to predict, in us
+ *
+ * @return The predicted position, within the range of the source
+ */
+int32_t superpredict_update(struct superpredict *predict, int slot, int axis,
+                            int32_t value, uint64_t stamp, uint64_t lead)
+{
+  struct superpredict_axis *a = &predict->axes[slot][axis];
+  int64_t velocity, dt, predicted;
+  int32_t min, max;
+
+  dt = stamp - a->stamp;
+  if (!a->valid || dt > PREDICT_MAX_GAP) {
+    a->velocity = 0;
+  } else if (dt > 0) {
+    velocity = ((int64_t)(value - a->position) << VELOCITY_FRAC) * 1000 / dt;
+    /* Half the new estimate, half the old one */
+    a->velocity += (velocity - a->velocity) / 2;
+  }
+  a->position = value;
+  a->stamp = stamp;
+  a->valid = true;
+
+  if (lead > PREDICT_MAX_LEAD)
+    lead = PREDICT_MAX_LEAD;
+
+  /* Overshooting the edge would put the contact where it can't be */
+  predicted = value + (((int64_t)a->velocity * (int64_t)lead / 1000) >> VELOCITY_FRAC);
+  supertransform_get_range(predict->source, axis, &min, &max);
+  if (predicted < min)
+    predicted = min;
+  if (predicted > max)
+    predicted = max;
+
+  return predicted;
+}
+
+/**
+ * Measure how long the motion takes to get to the guests, from the
+ * time it got in to the time it got delivered. That's a moving
+ * average, so it follows the load. The prediction is shared by all the
+ * guests the input goes to, the slowest one sets the lead.
+ *
+ * @return The recent delay, in us, or 0 if nothing got delivered yet
+ */
+uint64_t superpredict_lead(void)
+{
+  struct superhid_backend *targets[SUPERHID_MAX_BACKENDS];
+  uint64_t lead = 0;
+  int i, count;
+
+  count = superplugin_targets(targets);
+  for (i = 0; i < count; ++i)
+    if (targets[i]->stats[SUPERHID_CLASS_MOTION].delay_recent > lead)
+      lead = targets[i]->stats[SUPERHID_CLASS_MOTION].delay_recent;
+
+  return lead;
+}
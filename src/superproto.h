@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superproto.h
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 16:40:05 2026
+ *
+ * @brief  input_server protocol
+ *
+ * The records and commands exchanged with input_server, and the
+ * layout of the shared memory ring it can write them to.
+ * This header doesn't depend on anything Xen, so that tools feeding
+ * SuperHID can use it too.
+ */
+
+#ifndef   	SUPERPROTO_H_
+# define   	SUPERPROTO_H_
+
+#include <stdint.h>
+
+#define SOCK_PATH               "/var/run/input_socket"
+#define MAGIC                   0xAD9CBCE9
+
+/* Shouldn't that be defined somewhere already? */
+#define EV_DEV                  0x06
+#define DEV_SET                 0x01
+
+/* Commands, from SuperHID to input_server */
+#define EV_CMD                  0x07
+#define CMD_SUCK                0x02 /* ivalue: domid */
+#define CMD_CREDIT              0x03 /* ivalue: credits */
+#define CMD_SHM                 0x04 /* ivalue: ring size, fds attached */
+#define CMD_VERSION             0x05 /* ivalue: protocol version */
+
+struct event_record
+{
+  uint32_t magic;
+  uint16_t itype;
+  uint16_t icode;
+  uint32_t ivalue;
+} __attribute__ ((__packed__));
+
+/**
+ * Protocol version 2.
+ * SuperHID sends a CMD_VERSION command with the highest version it
+ * supports right after connecting. An input_server that supports v2
+ * answers with a CMD_VERSION record of its own (still a v1 record),
+ * and everything it sends after that is v2 frames. One that doesn't
+ * just keeps sending v1 records.
+ * A v2 frame is a header followed by count events, all from the same
+ * source device.
+ */
+#define PROTO_VERSION           2
+#define MAGIC_V2                0xAD9CBCEA
+#define FRAME_MAX_EVENTS        256
+
+struct frame_header
+{
+  uint32_t magic;         /* MAGIC_V2 */
+  uint16_t count;         /* Events in the frame, up to FRAME_MAX_EVENTS */
+  uint16_t source;        /* Source device, replaces EV_DEV/DEV_SET */
+  uint64_t timestamp;     /* CLOCK_MONOTONIC when it got read, in us */
+} __attribute__ ((__packed__));
+
+struct frame_event
+{
+  uint16_t type;
+  uint16_t code;
+  uint32_t value;
+} __attribute__ ((__packed__));
+
+#define FRAME_SIZE(count)       (sizeof(struct frame_header) + \
+                                 (count) * sizeof(struct frame_event))
+
+/* Records in a shared ring, has to be a power of 2 */
+#define SHM_RING_RECORDS        4096
+
+/**
+ * A single producer, single consumer ring of event records, in a memfd
+ * that SuperHID sends along with a CMD_SHM command (SCM_RIGHTS), first
+ * the memfd then an eventfd.
+ *
+ * The producer writes records at tail, then bumps tail (release). If
+ * idle was set, it clears it (atomic exchange) and writes 1 to the
+ * eventfd. The consumer sets idle before going to sleep, and checks
+ * tail again right after, so no wakeup is ever lost and a busy
+ * consumer never costs the producer a syscall.
+ * head and tail are free-running, the index is head % SHM_RING_RECORDS.
+ */
+struct shm_ring
+{
+  uint32_t magic;                                  /* MAGIC */
+  uint32_t size;                                   /* SHM_RING_RECORDS */
+  uint32_t head __attribute__ ((aligned(64)));     /* Consumer */
+  uint32_t idle;                                   /* Consumer asleep */
+  uint32_t tail __attribute__ ((aligned(64)));     /* Producer */
+  struct event_record records[] __attribute__ ((aligned(64)));
+};
+
+/**
+ * Capture files.
+ * A capture starts with a header, followed by records. The records are
+ * the event records SuperHID translated, with their domid and the time
+ * they got in. Sources that don't speak in records (v2 frames, evdev)
+ * show up as a DEV_SET record followed by their events.
+ * Files get rotated, every one of them starts with a header.
+ */
+#define CAPTURE_MAGIC           0x50434853 /* "SHCP" */
+#define CAPTURE_VERSION         1
+
+struct capture_header
+{
+  uint32_t magic;         /* CAPTURE_MAGIC */
+  uint16_t version;       /* CAPTURE_VERSION */
+  uint16_t record_size;   /* sizeof(struct capture_record) */
+  uint64_t start;         /* CLOCK_MONOTONIC when the file got created, in us */
+} __attribute__ ((__packed__));
+
+struct capture_record
+{
+  uint64_t stamp;         /* CLOCK_MONOTONIC when it got in, in us */
+  uint16_t domid;
+  uint16_t itype;
+  uint16_t icode;
+  uint32_t ivalue;
+} __attribute__ ((__packed__));
+
+#endif 	    /* !SUPERPROTO_H_ */
@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superreplay.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Tue Oct 20 09:31:58 2026
+ *
+ * @brief  Capture replay
+ *
+ * This replays a capture file (see supercapture.c) through the normal
+ * translation path, either with the recorded timing or as fast as
+ * possible. That gives a reproducible workload without input_server or
+ * any hardware.
+ * The bench mode doesn't even need Xen: it translates the whole
+ * capture for a fake domain, throws the reports away and prints how
+ * long it took. Then it measures how long input focus switches take,
+ * between two fake domains.
+ */
+
+#include "project.h"
+
+/* Records replayed per event loop iteration when going fast */
+#define REPLAY_CHUNK            1024
+/* Predictions waiting for the position they're for, per axis */
+#define BENCH_PENDING           64
+/* Input focus switches measured by the bench */
+#define BENCH_SWITCHES          200
+
+struct capture
+{
+  void                  *map;
+  size_t                 size;
+  struct capture_record *records;
+  size_t                 count;
+};
+
+/* Predictions get scored against what the contact did next */
+struct bench_prediction
+{
+  uint64_t due;          /* When the prediction is for */
+  int32_t  predicted;
+  int32_t  held;         /* What we'd have sent without predicting */
+};
+
+struct bench_axis
+{
+  struct bench_prediction pending[BENCH_PENDING];
+  unsigned int            head;
+  unsigned int            tail;
+  int32_t                 position; /* The latest real position */
+  uint64_t                stamp;    /* When it got in */
+};
+
+struct bench_error
+{
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+};
+
+/* The leads the prediction benchmark tries, in ms */
+static const int bench_leads[] = { 4, 8, 16, 32 };
+
+static struct capture replay;
+static size_t replay_next;
+static uint64_t replay_start;  /* superhid_now() at the first record */
+static bool replay_fast;
+static struct event replay_event;
+
+/**
+ * Map a capture file and check its header
+ *
+ * @param path    The path of the capture
+ * @param capture Filled with the records of the capture
+ *
+ * @return 0 on success, -1 on error
+ */
+static int map_capture(const char *path, struct capture *capture)
+{
+  struct capture_header *header;
+  struct stat st;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    superlog(LOG_ERR, "Failed to open %s: %s", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size < sizeof(*header)) {
+    superlog(LOG_ERR, "%s is not a capture", path);
+    close(fd);
+    return -1;
+  }
+
+  capture->size = st.st_size;
+  /* Fault it all in now, replays shouldn't measure the disk */
+  capture->map = mmap(NULL, capture->size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (capture->map == MAP_FAILED) {
+    superlog(LOG_ERR, "Failed to map %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  header = capture->map;
+  if (header->magic != CAPTURE_MAGIC || header->version != CAPTURE_VERSION ||
+      header->record_size != sizeof(struct capture_record)) {
+    superlog(LOG_ERR, "%s is not a version %d capture", path, CAPTURE_VERSION);
+    munmap(capture->map, capture->size);
+    return -1;
+  }
+
+  capture->records = (struct capture_record *)(header + 1);
+  capture->count = (capture->size - sizeof(*header)) / sizeof(struct capture_record);
+
+  return 0;
+}
+
+/**
+ * Find the backend a captured record goes to: the same domid if it's
+ * still around, the first domain the local input goes to otherwise
+ */
+static struct superhid_backend *find_backend(int domid)
+{
+  struct superhid_backend *targets[SUPERHID_MAX_BACKENDS];
+  int slot = superbackend_find_slot(domid);
+
+  if (slot != -1 && superbacks[slot].di.di_dompath != NULL)
+    return &superbacks[slot];
+
+  return superplugin_targets(targets) > 0 ? targets[0] : NULL;
+}
+
+static void replay_record(struct superhid_backend *superback,
+                          struct capture_record *record, uint64_t stamp)
+{
+  struct event_record r;
+
+  r.magic = MAGIC;
+  r.itype = record->itype;
+  r.icode = record->icode;
+  r.ivalue = record->ivalue;
+  superplugin_process(superback, &r, stamp);
+}
+
+static void replay_handler(int fd, short event, void *priv)
+{
+  struct superhid_backend *superback;
+  struct capture_record *record;
+  struct timeval tv = { 0, 0 };
+  uint64_t now, due;
+  size_t end;
+
+  superback = find_backend(replay.records[replay_next].domid);
+  if (superback == NULL) {
+    /* Nobody to replay to yet */
+    tv.tv_sec = 1;
+    evtimer_add(&replay_event, &tv);
+    return;
+  }
+
+  now = superhid_now();
+  if (replay_start == 0)
+    replay_start = now - (replay.records[replay_next].stamp - replay.records[0].stamp);
+
+  end = replay_next + REPLAY_CHUNK;
+  if (end > replay.count)
+    end = replay.count;
+  while (replay_next < end) {
+    record = &replay.records[replay_next];
+    due = replay_start + (record->stamp - replay.records[0].stamp);
+    if (!replay_fast && due > now) {
+      /* Not yet, come back when it is */
+      tv.tv_sec = (due - now) / 1000000;
+      tv.tv_usec = (due - now) % 1000000;
+      break;
+    }
+    superback = find_backend(record->domid);
+    if (superback != NULL)
+      replay_record(superback, record, replay_fast ? now : due);
+    replay_next++;
+  }
+
+  superscheduler_run();
+
+  if (replay_next == replay.count) {
+    superlog(LOG_INFO, "Replayed %zu records in %"PRIu64"us",
+             replay.count, superhid_now() - replay_start);
+    munmap(replay.map, replay.size);
+    return;
+  }
+  evtimer_add(&replay_event, &tv);
+}
+
+/**
+ * Start replaying a capture to the running domains. Must be called
+ * after event_init().
+ *
+ * @param path The path of the capture
+ * @param fast true to ignore the recorded timing
+ *
+ * @return 0 on success, -1 on error
+ */
+int superreplay_init(const char *path, bool fast)
+{
+  struct timeval tv = { 0, 0 };
+
+  if (map_capture(path, &replay) < 0)
+    return -1;
+  if (replay.count == 0)
+    return 0;
+
+  replay_next = 0;
+  replay_start = 0;
+  replay_fast = fast;
+  evtimer_set(&replay_event, replay_handler, NULL);
+  evtimer_add(&replay_event, &tv);
+  superlog(LOG_INFO, "Replaying %zu records from %s", replay.count, path);
+
+  return 0;
+}
+
+static void bench_domain(struct superhid_backend *superback)
+{
+  memset(superback, 0, sizeof(*superback));
+  superback->weight = SUPERHID_DEFAULT_WEIGHT;
+  superback->fingers_per_report = SUPERHID_FINGER_WIDTH;
+  superback->overflow = SUPERHID_OVERFLOW_DROP;
+  superplugin_state_init(&superback->state);
+}
+
+/**
+ * Switch the input focus back and forth between two fake domains, and
+ * print how long it takes from the switch request to the report of a
+ * key pressed right after it being queued for the new domain. That
+ * covers telling input_server, on a socket pair nobody reads but us,
+ * and releasing everything in the old domain.
+ */
+static void bench_focus(void)
+{
+  struct superhid_backend *domains[2] = { &superbacks[0], &superbacks[1] };
+  struct superhid_backend *to;
+  struct input_event events[2];
+  uint64_t start, elapsed, total = 0, max = 0;
+  bool focus = superhid_focus;
+  int fds[2][2], i, j, missed = 0;
+  char drain[256];
+
+  for (j = 0; j < 2; ++j) {
+    bench_domain(domains[j]);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds[j]) < 0) {
+      superlog(LOG_ERR, "Failed to create a socket pair: %s", strerror(errno));
+      while (j-- > 0) {
+        close(fds[j][0]);
+        close(fds[j][1]);
+      }
+      return;
+    }
+    domains[j]->buffers.s = fds[j][0];
+    domains[j]->input_attached = true;
+  }
+
+  memset(events, 0, sizeof(events));
+  events[0].type = EV_KEY;
+  events[0].code = KEY_A;
+  events[0].value = 1;
+  events[1].type = EV_SYN;
+  events[1].code = SYN_REPORT;
+
+  superhid_focus = true;
+  superplugin_focus(domains[0]);
+  for (i = 0; i < BENCH_SWITCHES; ++i) {
+    to = domains[(i + 1) % 2];
+    start = superhid_now();
+    superplugin_focus(to);
+    superplugin_input(0, events, 2, start);
+    elapsed = superhid_now() - start;
+    if (superscheduler_queued(to) == 0)
+      missed++;
+    total += elapsed;
+    if (elapsed > max)
+      max = elapsed;
+    for (j = 0; j < 2; ++j) {
+      while (read(fds[j][1], drain, sizeof(drain)) > 0)
+        ;
+      superscheduler_discard(domains[j]);
+    }
+  }
+
+  printf("%d focus switches, %"PRIu64"us avg, %"PRIu64"us max to the first report\n",
+         BENCH_SWITCHES, total / BENCH_SWITCHES, max);
+  if (missed > 0)
+    printf("%d switches didn't get the report through\n", missed);
+
+  for (j = 0; j < 2; ++j) {
+    close(fds[j][0]);
+    close(fds[j][1]);
+    domains[j]->buffers.s = 0;
+    superplugin_release(domains[j]);
+    memset(domains[j], 0, sizeof(*domains[j]));
+  }
+  superhid_focus = focus;
+}
+
+/**
+ * Translate a whole capture as fast as possible for a fake domain, and
+ * print the throughput. The reports are thrown away as they come.
+ * Then measure the input focus switches.
+ *
+ * @param path The path of the capture
+ *
+ * @return 0 on success, -1 on error
+ */
+int superreplay_bench(const char *path)
+{
+  struct capture capture;
+  struct superhid_backend *superback = &superbacks[0];
+  uint64_t start, elapsed, reports = 0;
+  size_t i;
+
+  if (map_capture(path, &capture) < 0)
+    return -1;
+
+  /* A domain with nothing to deliver to */
+  bench_domain(superback);
+
+  start = superhid_now();
+  for (i = 0; i < capture.count; ++i) {
+    replay_record(superback, &capture.records[i], start);
+    reports += superscheduler_discard(superback);
+  }
+  elapsed = superhid_now() - start;
+
+  printf("%zu records, %"PRIu64" reports in %"PRIu64"us\n",
+         capture.count, reports, elapsed);
+  if (elapsed > 0)
+    printf("%"PRIu64" records/s, %"PRIu64"ns per record\n",
+           (uint64_t)capture.count * 1000000 / elapsed,
+           capture.count > 0 ? elapsed * 1000 / capture.count : 0);
+
+  munmap(capture.map, capture.size);
+
+  bench_focus();
+
+  return 0;
+}
+
+static void add_error(struct bench_error *error, int32_t guess, int32_t actual)
+{
+  uint64_t distance = guess > actual ? (int64_t)guess - actual : (int64_t)actual - guess;
+
+  error->count++;
+  error->total += distance;
+  if (distance > error->max)
+    error->max = distance;
+}
+
+/**
+ * Score the predictions of an axis that are due by the time of a new
+ * position. Where the contact was when they were due is taken on the
+ * line between the previous position and the new one.
+ */
+static void score(struct bench_axis *axis, int32_t position, uint64_t now,
+                  struct bench_error *predicted, struct bench_error *held)
+{
+  struct bench_prediction *p;
+  int32_t actual;
+
+  while (axis->head != axis->tail) {
+    p = &axis->pending[axis->head % BENCH_PENDING];
+    if (p->due > now)
+      break;
+    actual = axis->position;
+    if (now > axis->stamp)
+      actual += (int64_t)(position - axis->position) * (int64_t)(p->due - axis->stamp) /
+        (int64_t)(now - axis->stamp);
+    add_error(predicted, p->predicted, actual);
+    add_error(held, p->held, actual);
+    axis->head++;
+  }
+}
+
+static void bench_lead(struct capture *capture, uint64_t lead,
+                       struct bench_error *predicted, struct bench_error *held)
+{
+  struct superpredict *predictors;
+  struct bench_axis *axes, *axis;
+  struct bench_prediction *p;
+  struct capture_record *record;
+  int slots[SUPERTRANSFORM_MAX_SOURCES] = { 0 };
+  int source = 0, slot, index;
+  size_t i;
+
+  predictors = calloc(SUPERTRANSFORM_MAX_SOURCES, sizeof(*predictors));
+  axes = calloc(SUPERTRANSFORM_MAX_SOURCES * (SUPERPLUGIN_MAX_FINGERS + 1) * 2,
+                sizeof(*axes));
+  if (predictors == NULL || axes == NULL)
+    goto out;
+  for (source = 0; source < SUPERTRANSFORM_MAX_SOURCES; ++source)
+    predictors[source].source = source;
+  source = 0;
+
+  for (i = 0; i < capture->count; ++i) {
+    record = &capture->records[i];
+    if (record->itype == EV_DEV && record->icode == DEV_SET) {
+      if (record->ivalue < SUPERTRANSFORM_MAX_SOURCES)
+        source = record->ivalue;
+      continue;
+    }
+    if (record->itype != EV_ABS)
+      continue;
+    if (record->icode == ABS_MT_SLOT) {
+      /* The contacts of a slot we have no room for don't get scored,
+       * until the next valid one */
+      slots[source] = record->ivalue < SUPERPLUGIN_MAX_FINGERS ? record->ivalue : -1;
+      continue;
+    }
+    slot = record->icode > ABS_MT_SLOT ? slots[source] : SUPERPLUGIN_MAX_FINGERS;
+    if (slot < 0)
+      continue;
+    index = (source * (SUPERPLUGIN_MAX_FINGERS + 1) + slot) * 2;
+    switch (record->icode) {
+    case ABS_MT_TRACKING_ID:
+      /* A different contact, the pending guesses are moot */
+      superpredict_reset(&predictors[source], slot);
+      axes[index].head = axes[index].tail;
+      axes[index + 1].head = axes[index + 1].tail;
+      continue;
+    case ABS_X:
+    case ABS_MT_POSITION_X:
+      break;
+    case ABS_Y:
+    case ABS_MT_POSITION_Y:
+      index++;
+      break;
+    default:
+      continue;
+    }
+
+    axis = &axes[index];
+    score(axis, record->ivalue, record->stamp, predicted, held);
+    axis->position = record->ivalue;
+    axis->stamp = record->stamp;
+    if (axis->tail - axis->head == BENCH_PENDING)
+      axis->head++;
+    p = &axis->pending[axis->tail++ % BENCH_PENDING];
+    p->due = record->stamp + lead;
+    p->held = record->ivalue;
+    p->predicted = superpredict_update(&predictors[source], slot, index % 2,
+                                       record->ivalue, record->stamp, lead);
+  }
+
+out:
+  free(predictors);
+  free(axes);
+}
+
+/**
+ * Score the motion prediction on a capture: for a few leads, compare
+ * how far the predicted positions and the plain ones are from where
+ * the contacts actually were by then, and print it
+ *
+ * @param path The path of the capture
+ *
+ * @return 0 on success, -1 on error
+ */
+int superreplay_predict_bench(const char *path)
+{
+  struct capture capture;
+  struct bench_error predicted, held;
+  size_t i;
+
+  if (map_capture(path, &capture) < 0)
+    return -1;
+
+  printf("lead   samples  predicted avg/max  held avg/max\n");
+  for (i = 0; i < sizeof(bench_leads) / sizeof(bench_leads[0]); ++i) {
+    memset(&predicted, 0, sizeof(predicted));
+    memset(&held, 0, sizeof(held));
+    bench_lead(&capture, bench_leads[i] * 1000, &predicted, &held);
+    if (predicted.count == 0) {
+      printf("No absolute contacts in %s\n", path);
+      break;
+    }
+    printf("%2dms %9"PRIu64" %9"PRIu64" %8"PRIu64" %7"PRIu64" %7"PRIu64"\n",
+           bench_leads[i], predicted.count,
+           predicted.total / predicted.count, predicted.max,
+           held.total / held.count, held.max);
+  }
+
+  munmap(capture.map, capture.size);
+
+  return 0;
+}
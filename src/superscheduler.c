@@ -0,0 +1,679 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superscheduler.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 10:12:41 2026
+ *
+ * @brief  Report scheduling across domains
+ *
+ * Reports built by the input plugin are queued per domain, and
+ * delivered to the frontends in a weighted round-robin fashion, so
+ * that a domain flooding touch events can't starve the others.
+ *
+ * Every domain has one queue per class of report. Lossless reports
+ * (key and button state changes) go out first and never get merged.
+ * Motion reports go out when there's nothing lossless left, and a new
+ * motion report gets merged into a queued one of the same kind when
+ * possible, so a slow guest gets fewer, fresher reports.
+ *
+ * Reports carry the time their input got in. Motion that got older
+ * than the max age of the domain while waiting is dropped when it's
+ * relative, or when a newer report queued behind it says the same
+ * thing, so a guest coming back from a stall isn't replayed seconds
+ * worth of pointer moves.
+ */
+
+#include "project.h"
+
+static const char *class_names[SUPERHID_CLASSES] = {
+  "lossless",
+  "motion"
+};
+
+/**
+ * Index of the backend that gets served first on the next run, so
+ * that no domain is always first in line.
+ */
+static int next_slot = 0;
+
+bool superhid_credits;
+
+static bool queue_empty(struct superhid_queue *queue)
+{
+  return queue->head == queue->tail;
+}
+
+static bool queue_full(struct superhid_queue *queue)
+{
+  return (queue->tail + 1) % SUPERHID_QUEUE_LENGTH == queue->head;
+}
+
+static int queue_room(struct superhid_queue *queue)
+{
+  return SUPERHID_QUEUE_LENGTH - 1 -
+    (queue->tail + SUPERHID_QUEUE_LENGTH - queue->head) % SUPERHID_QUEUE_LENGTH;
+}
+
+/**
+ * Remove an entry from the middle of a queue, keeping the order of the
+ * other ones
+ *
+ * @param queue The queue
+ * @param index The index of the entry to remove
+ */
+static void queue_remove(struct superhid_queue *queue, unsigned int index)
+{
+  unsigned int next;
+
+  while ((next = (index + 1) % SUPERHID_QUEUE_LENGTH) != queue->tail) {
+    queue->reports[index] = queue->reports[next];
+    index = next;
+  }
+  queue->tail = index;
+}
+
+/**
+ * Get the number of reports that can still be queued for a domain in
+ * all of its classes
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of free entries in the fullest queue
+ */
+int superscheduler_room(struct superhid_backend *superback)
+{
+  int cls, room, ret = SUPERHID_QUEUE_LENGTH;
+
+  for (cls = 0; cls < SUPERHID_CLASSES; ++cls) {
+    room = queue_room(&superback->queues[cls]);
+    if (room < ret)
+      ret = room;
+  }
+
+  return ret;
+}
+
+/**
+ * Get the number of reports waiting for delivery to a domain
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of queued reports, all classes included
+ */
+int superscheduler_queued(struct superhid_backend *superback)
+{
+  int cls, ret = 0;
+
+  for (cls = 0; cls < SUPERHID_CLASSES; ++cls)
+    ret += SUPERHID_QUEUE_LENGTH - 1 - queue_room(&superback->queues[cls]);
+
+  return ret;
+}
+
+static bool merge_mouse(struct superhid_report_mouse *old,
+                        struct superhid_report_mouse *new)
+{
+  int x = (int8_t)old->x + (int8_t)new->x;
+  int y = (int8_t)old->y + (int8_t)new->y;
+  int wheel = (int8_t)old->wheel + (int8_t)new->wheel;
+
+  /* The buttons didn't change (or it would be lossless), but the sum
+   * of the moves has to fit */
+  if (x < -127 || x > 127 || y < -127 || y > 127 || wheel < -127 || wheel > 127)
+    return false;
+
+  old->x = x;
+  old->y = y;
+  old->wheel = wheel;
+
+  return true;
+}
+
+static bool merge_mouse_wide(struct superhid_report_mouse_wide *old,
+                             struct superhid_report_mouse_wide *new)
+{
+  int x = old->x + new->x;
+  int y = old->y + new->y;
+  int wheel = old->wheel + new->wheel;
+
+  if (x < -32767 || x > 32767 || y < -32767 || y > 32767 ||
+      wheel < -32767 || wheel > 32767)
+    return false;
+
+  old->x = x;
+  old->y = y;
+  old->wheel = wheel;
+
+  return true;
+}
+
+static bool merge_multitouch(struct superhid_report_multitouch *old,
+                             struct superhid_report_multitouch *new,
+                             int fingers_per_report)
+{
+  int i, j, count = old->count;
+
+  /* Check that the union of the contacts fits in one report */
+  for (i = 0; i < new->count; ++i) {
+    for (j = 0; j < old->count; ++j)
+      if (old->fingers[j].finger_id == new->fingers[i].finger_id)
+        break;
+    if (j == old->count)
+      count++;
+  }
+  if (count > fingers_per_report)
+    return false;
+
+  /* Newer positions supersede the older ones */
+  for (i = 0; i < new->count; ++i) {
+    for (j = 0; j < old->count; ++j)
+      if (old->fingers[j].finger_id == new->fingers[i].finger_id)
+        break;
+    old->fingers[j] = new->fingers[i];
+    if (j == old->count)
+      old->count++;
+  }
+  old->scan_time = new->scan_time;
+
+  return true;
+}
+
+/**
+ * Try to merge a motion report into one of the same kind that's
+ * still waiting in the motion queue. The merged report is as recent
+ * as its newest input.
+ *
+ * @param superback The backend of the domain
+ * @param report    The new motion report
+ * @param stamp     superhid_now() when the input of the report got in
+ *
+ * @return true if the report got merged, false if it needs an entry
+ */
+static bool merge(struct superhid_backend *superback,
+                  struct superhid_report *report, uint64_t stamp)
+{
+  struct superhid_queue *queue = &superback->queues[SUPERHID_CLASS_MOTION];
+  struct superhid_queued_report *entry = NULL;
+  struct superhid_report *old;
+  unsigned int i;
+  bool merged;
+
+  /* Find the most recent queued report of the same kind */
+  for (i = queue->head; i != queue->tail; i = (i + 1) % SUPERHID_QUEUE_LENGTH)
+    if (queue->reports[i].report.report_id == report->report_id)
+      entry = &queue->reports[i];
+  if (entry == NULL)
+    return false;
+  old = &entry->report;
+
+  switch (report->report_id) {
+  case REPORT_ID_TABLET:
+    /* Absolute, the new position is all that matters */
+    memcpy(old, report, sizeof(*old));
+    merged = true;
+    break;
+  case REPORT_ID_MOUSE:
+    merged = merge_mouse((struct superhid_report_mouse *)old,
+                         (struct superhid_report_mouse *)report);
+    break;
+  case REPORT_ID_MOUSE_WIDE:
+    merged = merge_mouse_wide((struct superhid_report_mouse_wide *)old,
+                              (struct superhid_report_mouse_wide *)report);
+    break;
+  case REPORT_ID_MULTITOUCH:
+    merged = merge_multitouch((struct superhid_report_multitouch *)old,
+                              (struct superhid_report_multitouch *)report,
+                              superback->fingers_per_report);
+    break;
+  default:
+    merged = false;
+    break;
+  }
+  if (merged)
+    entry->stamp = stamp;
+
+  return merged;
+}
+
+/**
+ * Move the queued motion reports of a given kind to the lossless
+ * queue, so that they don't get delivered after a lossless report of
+ * the same kind that is about to be queued. It's all or nothing, the
+ * lossless report must not overtake any of them.
+ *
+ * @param superback The backend of the domain
+ * @param report_id The kind of report
+ *
+ * @return true if they got moved and there's room left for the
+ *         lossless report, false if the lossless queue is too full
+ */
+static bool promote(struct superhid_backend *superback, uint8_t report_id)
+{
+  struct superhid_queue *motion = &superback->queues[SUPERHID_CLASS_MOTION];
+  struct superhid_queue *lossless = &superback->queues[SUPERHID_CLASS_LOSSLESS];
+  unsigned int i;
+  int count = 0;
+
+  for (i = motion->head; i != motion->tail; i = (i + 1) % SUPERHID_QUEUE_LENGTH)
+    if (motion->reports[i].report.report_id == report_id)
+      count++;
+  if (queue_room(lossless) < count + 1)
+    return false;
+
+  i = motion->head;
+  while (i != motion->tail) {
+    if (motion->reports[i].report.report_id != report_id) {
+      i = (i + 1) % SUPERHID_QUEUE_LENGTH;
+      continue;
+    }
+    lossless->reports[lossless->tail] = motion->reports[i];
+    lossless->tail = (lossless->tail + 1) % SUPERHID_QUEUE_LENGTH;
+    queue_remove(motion, i);
+  }
+
+  return true;
+}
+
+/**
+ * Make room for promote(), dropping the oldest lossless report, or the
+ * oldest motion report of the kind being promoted when there's no
+ * lossless report left. The state gets resynced later.
+ *
+ * @param superback The backend of the domain
+ * @param report_id The kind of report being promoted
+ */
+static void make_room(struct superhid_backend *superback, uint8_t report_id)
+{
+  struct superhid_queue *motion = &superback->queues[SUPERHID_CLASS_MOTION];
+  struct superhid_queue *lossless = &superback->queues[SUPERHID_CLASS_LOSSLESS];
+  unsigned int i;
+
+  if (!queue_empty(lossless)) {
+    superback->stats[SUPERHID_CLASS_LOSSLESS].dropped++;
+    superback->resync = true;
+    lossless->head = (lossless->head + 1) % SUPERHID_QUEUE_LENGTH;
+    return;
+  }
+
+  for (i = motion->head; i != motion->tail; i = (i + 1) % SUPERHID_QUEUE_LENGTH) {
+    if (motion->reports[i].report.report_id == report_id) {
+      superback->stats[SUPERHID_CLASS_MOTION].dropped++;
+      queue_remove(motion, i);
+      return;
+    }
+  }
+}
+
+/**
+ * Check if a report gets superseded by a newer one, so that it can go
+ * without the guest missing anything
+ *
+ * @param old The queued report
+ * @param new A report queued after it
+ *
+ * @return true if new makes old useless
+ */
+static bool supersedes(struct superhid_report *old, struct superhid_report *new)
+{
+  struct superhid_report_multitouch *old_mt, *new_mt;
+  int i, j;
+
+  if (old->report_id != new->report_id)
+    return false;
+  if (old->report_id != REPORT_ID_MULTITOUCH)
+    return true;
+
+  /* All the contacts of the old report have to get a newer position */
+  old_mt = (struct superhid_report_multitouch *)old;
+  new_mt = (struct superhid_report_multitouch *)new;
+  for (i = 0; i < old_mt->count; ++i) {
+    for (j = 0; j < new_mt->count; ++j)
+      if (new_mt->fingers[j].finger_id == old_mt->fingers[i].finger_id)
+        break;
+    if (j == new_mt->count)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Drop the motion reports that got too old to be worth delivering.
+ * Relative moves go, absolute ones only go when superseded, so that
+ * the guest still ends up where the pointer and the fingers are.
+ *
+ * @param superback The backend of the domain
+ */
+static void expire(struct superhid_backend *superback)
+{
+  struct superhid_queue *queue = &superback->queues[SUPERHID_CLASS_MOTION];
+  struct superhid_stats *stats = &superback->stats[SUPERHID_CLASS_MOTION];
+  struct superhid_report *report;
+  uint64_t now;
+  unsigned int i, j;
+  bool stale;
+
+  if (superback->max_age == 0)
+    return;
+
+  now = superhid_now();
+  i = queue->head;
+  while (i != queue->tail) {
+    /* Merged reports get the stamp of their newest input, so the queue
+     * isn't quite in chronological order */
+    if (now - queue->reports[i].stamp <= superback->max_age) {
+      i = (i + 1) % SUPERHID_QUEUE_LENGTH;
+      continue;
+    }
+    report = &queue->reports[i].report;
+    stale = (report->report_id == REPORT_ID_MOUSE ||
+             report->report_id == REPORT_ID_MOUSE_WIDE);
+    for (j = (i + 1) % SUPERHID_QUEUE_LENGTH;
+         !stale && j != queue->tail;
+         j = (j + 1) % SUPERHID_QUEUE_LENGTH)
+      stale = supersedes(report, &queue->reports[j].report);
+    if (stale) {
+      stats->expired++;
+      queue_remove(queue, i);
+    } else
+      i = (i + 1) % SUPERHID_QUEUE_LENGTH;
+  }
+}
+
+/**
+ * Queue a report for delivery to the frontends of a domain
+ *
+ * @param superback The backend of the domain
+ * @param report    The report to queue, copied
+ * @param cls       The class of the report, SUPERHID_CLASS_*
+ * @param stamp     superhid_now() when the input of the report got in
+ *
+ * @return 0 on success, -1 if the report got dropped
+ */
+int superscheduler_queue(struct superhid_backend *superback,
+                         struct superhid_report *report,
+                         enum superhid_class cls,
+                         uint64_t stamp)
+{
+  struct superhid_queue *queue = &superback->queues[cls];
+  struct superhid_stats *stats = &superback->stats[cls];
+  struct superhid_queued_report *entry;
+
+  if (cls == SUPERHID_CLASS_MOTION) {
+    if (merge(superback, report, stamp)) {
+      stats->merged++;
+      return 0;
+    }
+    if (queue_full(queue)) {
+      /* Motion gets superseded, drop the oldest one */
+      stats->dropped++;
+      queue->head = (queue->head + 1) % SUPERHID_QUEUE_LENGTH;
+    }
+  } else if (!promote(superback, report->report_id)) {
+    if (superback->overflow != SUPERHID_OVERFLOW_DROP) {
+      /* Only input_server can be paused before it comes to that. The
+       * other sources keep going, the state has to be sent again once
+       * there's room */
+      stats->dropped++;
+      superback->resync = true;
+      superlog(LOG_ERR, "COULD NOT SEND REPORT %d", report->report_id);
+      return -1;
+    }
+    /* The state will have to be sent again once there's room */
+    do {
+      make_room(superback, report->report_id);
+    } while (!promote(superback, report->report_id));
+  }
+
+  entry = &queue->reports[queue->tail];
+  memcpy(&entry->report, report, sizeof(*report));
+  entry->stamp = stamp;
+  entry->length = 0;
+  queue->tail = (queue->tail + 1) % SUPERHID_QUEUE_LENGTH;
+
+  return 0;
+}
+
+/**
+ * Queue a native HID report for the passthrough device of a domain.
+ * Those are opaque to us, so they're lossless and never get merged.
+ *
+ * @param superback The backend of the domain
+ * @param data      The report, as read from the physical device
+ * @param length    The length of the report
+ * @param stamp     superhid_now() when the report got in
+ *
+ * @return 0 on success, -1 if the report got dropped
+ */
+int superscheduler_queue_raw(struct superhid_backend *superback,
+                             const void *data, int length, uint64_t stamp)
+{
+  struct superhid_queue *queue = &superback->queues[SUPERHID_CLASS_LOSSLESS];
+  struct superhid_stats *stats = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  struct superhid_queued_report *entry;
+
+  if (length <= 0 || length > sizeof(entry->report))
+    return -1;
+
+  if (queue_full(queue)) {
+    stats->dropped++;
+    if (superback->overflow != SUPERHID_OVERFLOW_DROP)
+      return -1;
+    queue->head = (queue->head + 1) % SUPERHID_QUEUE_LENGTH;
+  }
+
+  entry = &queue->reports[queue->tail];
+  memcpy(&entry->report, data, length);
+  entry->stamp = stamp;
+  entry->length = length;
+  queue->tail = (queue->tail + 1) % SUPERHID_QUEUE_LENGTH;
+
+  return 0;
+}
+
+/**
+ * Deliver the reports of a queue in order, until the budget of the
+ * domain is spent or none of the frontends they're for is pending any
+ * more. A report waiting for its frontend holds up the reports of its
+ * kind, not the ones for the other devices. Reports the domain has no
+ * device for go, they'd wait forever.
+ *
+ * @param superback The backend of the domain
+ * @param cls       The class to deliver
+ *
+ * @return The number of reports delivered
+ */
+static int serve_class(struct superhid_backend *superback, enum superhid_class cls)
+{
+  struct superhid_queue *queue = &superback->queues[cls];
+  struct superhid_stats *stats = &superback->stats[cls];
+  struct superhid_queued_report *entry;
+  bool blocked[256] = { false };
+  bool raw_blocked = false;
+  unsigned int i = queue->head;
+  uint64_t stamp, delay;
+  int ret, sents = 0;
+
+  while (superback->deficit > 0 && i != queue->tail) {
+    entry = &queue->reports[i];
+    if (entry->length != 0 ? raw_blocked : blocked[entry->report.report_id]) {
+      i = (i + 1) % SUPERHID_QUEUE_LENGTH;
+      continue;
+    }
+    if (entry->length != 0)
+      ret = superbackend_send_raw_to_frontends(&entry->report, entry->length, superback);
+    else
+      ret = superbackend_send_report_to_frontends(&entry->report, superback);
+    if (ret == -1) {
+      /* Everything of that kind has to wait behind it */
+      if (entry->length != 0)
+        raw_blocked = true;
+      else
+        blocked[entry->report.report_id] = true;
+      i = (i + 1) % SUPERHID_QUEUE_LENGTH;
+      continue;
+    }
+    stamp = entry->stamp;
+    if (i == queue->head) {
+      queue->head = (queue->head + 1) % SUPERHID_QUEUE_LENGTH;
+      i = queue->head;
+    } else
+      queue_remove(queue, i);
+    if (ret < 0) {
+      stats->unroutable++;
+      continue;
+    }
+    if (ret > 0) {
+      /* The guest already has that, it didn't cost a request */
+      stats->suppressed++;
+      continue;
+    }
+    delay = superhid_now() - stamp;
+    if (stats->delivered == 0)
+      stats->delay_recent = delay;
+    else
+      stats->delay_recent += ((int64_t)delay - (int64_t)stats->delay_recent) /
+        SUPERHID_DELAY_SMOOTHING;
+    stats->delivered++;
+    stats->delay_total += delay;
+    if (delay > stats->delay_max)
+      stats->delay_max = delay;
+    superback->deficit--;
+    sents++;
+  }
+
+  return sents;
+}
+
+/**
+ * Deliver queued reports for one domain, lossless ones first, until
+ * its budget is spent, its queues are empty or its frontends aren't
+ * pending any more.
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of reports delivered
+ */
+static int serve(struct superhid_backend *superback)
+{
+  int cls, sents = 0;
+  bool empty = true;
+
+  superback->deficit += SUPERHID_SCHED_QUANTUM * superback->weight;
+
+  expire(superback);
+
+  for (cls = 0; cls < SUPERHID_CLASSES; ++cls) {
+    sents += serve_class(superback, cls);
+    if (!queue_empty(&superback->queues[cls]))
+      empty = false;
+  }
+
+  /* Like in deficit round-robin, an idle or blocked domain doesn't
+   * get to save up budget for later */
+  if (empty || sents == 0)
+    superback->deficit = 0;
+
+  /* Lossless reports got lost, make sure the guest doesn't end up
+   * with keys or fingers stuck down */
+  if (superback->resync &&
+      queue_room(&superback->queues[SUPERHID_CLASS_LOSSLESS]) >= SUPERHID_QUEUE_RESERVE) {
+    superback->resync = false;
+    superplugin_resync(superback);
+  }
+
+  /* Room got freed, let the input flow again */
+  if (superback->input_paused && superscheduler_room(superback) >= SUPERHID_QUEUE_RESERVE)
+    superplugin_resume(superback);
+
+  return sents;
+}
+
+/**
+ * Deliver as many queued reports as the frontends can take, going
+ * round-robin over all the domains and giving each of them a budget
+ * proportional to its weight on every round.
+ */
+void superscheduler_run(void)
+{
+  int i, slot, sents;
+
+  do {
+    sents = 0;
+    for (i = 0; i < SUPERHID_MAX_BACKENDS; ++i) {
+      slot = (next_slot + i) % SUPERHID_MAX_BACKENDS;
+      if (superbacks[slot].di.di_dompath != NULL)
+        sents += serve(&superbacks[slot]);
+    }
+    next_slot = (next_slot + 1) % SUPERHID_MAX_BACKENDS;
+  } while (sents > 0);
+
+  /* Let input_server know how much each domain can take now */
+  if (superhid_credits)
+    for (i = 0; i < SUPERHID_MAX_BACKENDS; ++i)
+      if (superbacks[i].di.di_dompath != NULL)
+        superplugin_credit(&superbacks[i]);
+}
+
+/**
+ * Throw away everything that's queued for a domain, for when there's
+ * nowhere to deliver it, like when benchmarking
+ *
+ * @param superback The backend of the domain
+ *
+ * @return The number of reports thrown away
+ */
+int superscheduler_discard(struct superhid_backend *superback)
+{
+  int ret = superscheduler_queued(superback);
+  int cls;
+
+  for (cls = 0; cls < SUPERHID_CLASSES; ++cls)
+    superback->queues[cls].head = superback->queues[cls].tail;
+  superback->resync = false;
+
+  return ret;
+}
+
+/**
+ * Log the delivery statistics of a domain
+ *
+ * @param superback The backend of the domain
+ */
+void superscheduler_print_stats(struct superhid_backend *superback)
+{
+  struct superhid_stats *stats;
+  uint64_t average;
+  int cls;
+
+  superlog(LOG_INFO, "domid %d: weight %d", superback->di.di_domid, superback->weight);
+  for (cls = 0; cls < SUPERHID_CLASSES; ++cls) {
+    stats = &superback->stats[cls];
+    average = 0;
+    if (stats->delivered > 0)
+      average = stats->delay_total / stats->delivered;
+    superlog(LOG_INFO, "  %s: %"PRIu64" reports delivered, %"PRIu64" merged, "
+             "%"PRIu64" suppressed, %"PRIu64" dropped, %"PRIu64" expired, "
+             "%"PRIu64" unroutable, delay avg %"PRIu64"us max %"PRIu64"us",
+             class_names[cls], stats->delivered, stats->merged,
+             stats->suppressed, stats->dropped, stats->expired,
+             stats->unroutable, average, stats->delay_max);
+  }
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   supershm.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 19 16:52:48 2026
+ *
+ * @brief  Shared memory input channel
+ *
+ * Instead of streaming event records over the socket, input_server can
+ * write them straight into a ring that SuperHID shares with it, and
+ * only wake us up through an eventfd when we're idle. See struct
+ * shm_ring in superproto.h for the protocol.
+ * The socket stays open for the commands, and an input_server that
+ * ignores the offer just keeps streaming.
+ */
+
+/* For memfd_create() */
+#define _GNU_SOURCE
+
+#include "project.h"
+
+struct supershm
+{
+  int              memfd;
+  int              evfd;
+  size_t           size;
+  struct shm_ring *ring;
+  struct event     event;
+};
+
+bool superhid_shm;
+
+static void shm_handler(int fd, short event, void *priv)
+{
+  struct superhid_backend *superback = priv;
+  struct shm_ring *ring = superback->shm->ring;
+  uint64_t count, stamp;
+  uint32_t head, tail;
+  int queued = 0;
+
+  /* Reset the eventfd, we're about to drain everything anyway */
+  if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    superlog(LOG_ERR, "Failed to read the eventfd of domid %d", superback->di.di_domid);
+
+  stamp = superhid_now();
+  head = ring->head;
+  for (;;) {
+    __atomic_store_n(&ring->idle, 0, __ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    while (head != tail && !superback->input_paused) {
+      queued += superplugin_process(superback, &ring->records[head % SHM_RING_RECORDS], stamp);
+      head++;
+      /* Give the entry back right away, the producer may be waiting */
+      __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+      if (superback->overflow == SUPERHID_OVERFLOW_BLOCK &&
+          superscheduler_room(superback) < SUPERHID_QUEUE_RESERVE)
+        /* The rest waits in the ring, superplugin_resume() kicks us */
+        superback->input_paused = true;
+    }
+    if (superback->input_paused)
+      break;
+    /* Going to sleep, unless something came in meanwhile */
+    __atomic_store_n(&ring->idle, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+      break;
+  }
+
+  if (queued > 0)
+    superscheduler_run();
+}
+
+/**
+ * Create a shared ring for a domain and offer it to input_server
+ *
+ * @param superback The backend of the domain, connected to input_server
+ *
+ * @return 0 on success, -1 on error
+ */
+int supershm_offer(struct superhid_backend *superback)
+{
+  struct supershm *shm;
+  struct event_record e;
+  struct msghdr msg = { 0 };
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE(2 * sizeof(int))];
+  int fds[2];
+
+  shm = calloc(1, sizeof(*shm));
+  if (shm == NULL)
+    return -1;
+  shm->evfd = -1;
+  shm->size = sizeof(struct shm_ring) + SHM_RING_RECORDS * sizeof(struct event_record);
+
+  shm->memfd = memfd_create("superhid-ring", MFD_CLOEXEC);
+  if (shm->memfd < 0 || ftruncate(shm->memfd, shm->size) < 0) {
+    superlog(LOG_ERR, "Failed to create the shared ring: %s", strerror(errno));
+    goto fail;
+  }
+  shm->ring = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+  if (shm->ring == MAP_FAILED) {
+    shm->ring = NULL;
+    goto fail;
+  }
+  shm->ring->magic = MAGIC;
+  shm->ring->size = SHM_RING_RECORDS;
+  shm->ring->idle = 1;
+
+  shm->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shm->evfd < 0)
+    goto fail;
+
+  /* The command, with both fds attached */
+  e.magic = MAGIC;
+  e.itype = EV_CMD;
+  e.icode = CMD_SHM;
+  e.ivalue = SHM_RING_RECORDS;
+  iov.iov_base = &e;
+  iov.iov_len = sizeof(e);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  fds[0] = shm->memfd;
+  fds[1] = shm->evfd;
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(superback->buffers.s, &msg, 0) < 0) {
+    superlog(LOG_ERR, "Failed to offer the shared ring: %s", strerror(errno));
+    goto fail;
+  }
+
+  superback->shm = shm;
+  event_set(&shm->event, shm->evfd, EV_READ | EV_PERSIST,
+            shm_handler, superback);
+  event_add(&shm->event, NULL);
+  superlog(LOG_INFO, "Offered a shared ring of %d records for domid %d",
+           SHM_RING_RECORDS, superback->di.di_domid);
+
+  return 0;
+
+fail:
+  if (shm->ring != NULL)
+    munmap(shm->ring, shm->size);
+  if (shm->memfd >= 0)
+    close(shm->memfd);
+  if (shm->evfd >= 0)
+    close(shm->evfd);
+  free(shm);
+  return -1;
+}
+
+/**
+ * Go through the records that got left in the ring when the input
+ * got paused
+ *
+ * @param superback The backend of the domain
+ */
+void supershm_kick(struct superhid_backend *superback)
+{
+  if (superback->shm != NULL)
+    event_active(&superback->shm->event, EV_READ, 0);
+}
+
+/**
+ * Tear down the shared ring of a domain
+ *
+ * @param superback The backend of the domain
+ */
+void supershm_release(struct superhid_backend *superback)
+{
+  struct supershm *shm = superback->shm;
+
+  if (shm == NULL)
+    return;
+
+  event_del(&shm->event);
+  munmap(shm->ring, shm->size);
+  close(shm->memfd);
+  close(shm->evfd);
+  free(shm);
+  superback->shm = NULL;
+}
@@ -0,0 +1,1582 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   supertest.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Mon Oct 26 10:12:45 2026
+ *
+ * @brief  SuperHID tests
+ *
+ * "make check" runs this. It links everything but main.c, and plays
+ * both the guests and input_server: grant maps and event channel
+ * notifications are faked, connect() gets a socket pair, ioctl() plays
+ * an evdev device, and the clock only moves when a test says so.
+ */
+
+#include "project.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n",                  \
+              __FILE__, __LINE__, __func__, #cond);                     \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+/* The clock, the tests move it as they need */
+static uint64_t now = 1000000;
+
+uint64_t superhid_now(void)
+{
+  return now;
+}
+
+/* The guest side. Every device has one page, its grant ref is its
+ * devid, and we count what lands there. */
+static uint8_t guest_pages[SUPERHID_MAX_BACKENDS][BACKEND_DEVICE_MAX][4096];
+static int guest_reports[SUPERHID_MAX_BACKENDS][BACKEND_DEVICE_MAX];
+
+/* The domids in the order they got their reports */
+#define DELIVERIES_MAX 256
+static int deliveries[DELIVERIES_MAX];
+static int delivery_count = 0;
+
+void *xc_gnttab_map_grant_ref(xc_gnttab *xcg, uint32_t domid, uint32_t ref, int prot)
+{
+  if (domid >= SUPERHID_MAX_BACKENDS || ref >= BACKEND_DEVICE_MAX)
+    return NULL;
+  guest_reports[domid][ref]++;
+  if (delivery_count < DELIVERIES_MAX)
+    deliveries[delivery_count++] = domid;
+  return guest_pages[domid][ref];
+}
+
+int xc_gnttab_munmap(xc_gnttab *xcg, void *start, uint32_t count)
+{
+  return 0;
+}
+
+void backend_evtchn_notify(xen_backend_t xenback, int devid)
+{
+}
+
+/* The input_server end of the last connect() */
+static int input_server = -1;
+
+int connect(int fd, const struct sockaddr *addr, socklen_t len)
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    return -1;
+  dup2(sv[0], fd);
+  close(sv[0]);
+  input_server = sv[1];
+
+  return 0;
+}
+
+/* The absolute axes of the fake evdev device */
+static struct input_absinfo fake_abs[ABS_CNT];
+/* Its ID and, per event type, the codes it has. The first one is the
+ * event types, like EVIOCGBIT(0) */
+static struct input_id fake_id;
+static unsigned long fake_bits[EV_CNT][KEY_CNT / (sizeof(long) * 8) + 1];
+/* The fake hidraw device */
+static struct hidraw_report_descriptor fake_rdesc;
+static struct hidraw_devinfo fake_rawinfo;
+
+int ioctl(int fd, unsigned long request, ...)
+{
+  va_list ap;
+  void *arg;
+  int code;
+
+  va_start(ap, request);
+  arg = va_arg(ap, void *);
+  va_end(ap);
+
+  if (request == EVIOCGID) {
+    memcpy(arg, &fake_id, sizeof(fake_id));
+    return 0;
+  }
+  if (request == HIDIOCGRDESCSIZE) {
+    *(int *)arg = fake_rdesc.size;
+    return 0;
+  }
+  if (request == HIDIOCGRDESC) {
+    memcpy(((struct hidraw_report_descriptor *)arg)->value, fake_rdesc.value, fake_rdesc.size);
+    return 0;
+  }
+  if (request == HIDIOCGRAWINFO) {
+    memcpy(arg, &fake_rawinfo, sizeof(fake_rawinfo));
+    return 0;
+  }
+  if (_IOC_TYPE(request) == 'E' && _IOC_NR(request) >= _IOC_NR(EVIOCGBIT(0, 0)) &&
+      _IOC_NR(request) < _IOC_NR(EVIOCGBIT(EV_CNT, 0))) {
+    code = _IOC_NR(request) - _IOC_NR(EVIOCGBIT(0, 0));
+    memset(arg, 0, _IOC_SIZE(request));
+    memcpy(arg, fake_bits[code], _IOC_SIZE(request) < sizeof(fake_bits[code]) ?
+           _IOC_SIZE(request) : sizeof(fake_bits[code]));
+    return 0;
+  }
+  for (code = 0; code < ABS_CNT; ++code) {
+    if (request == EVIOCGABS(code)) {
+      /* Like evdev, axes the device doesn't have come back empty */
+      memcpy(arg, &fake_abs[code], sizeof(fake_abs[code]));
+      return 0;
+    }
+  }
+  errno = ENOTTY;
+  return -1;
+}
+
+static void set_axis(int code, int32_t min, int32_t max)
+{
+  fake_abs[code].minimum = min;
+  fake_abs[code].maximum = max;
+}
+
+static void test_evdev_range(void)
+{
+  int32_t x, y;
+  uint16_t out_x, out_y;
+
+  /* A tablet, ABS_X/ABS_Y and no multitouch axes */
+  memset(fake_abs, 0, sizeof(fake_abs));
+  set_axis(ABS_X, 0, 4095);
+  set_axis(ABS_Y, 0, 2047);
+  CHECK(superevdev_probe_range(0, 1) == 0);
+  x = 4095;
+  y = 2047;
+  supertransform_apply(1, &x, &y, &out_x, &out_y, 1);
+  CHECK(out_x == SUPERTRANSFORM_MAX && out_y == SUPERTRANSFORM_MAX);
+  x = 2048;
+  y = 1024;
+  supertransform_apply(1, &x, &y, &out_x, &out_y, 1);
+  CHECK(abs(out_x - 2048 * SUPERTRANSFORM_MAX / 4095) <= 1);
+  CHECK(abs(out_y - 1024 * SUPERTRANSFORM_MAX / 2047) <= 1);
+
+  /* A touchscreen, the multitouch axes win */
+  set_axis(ABS_MT_POSITION_X, 0, 1023);
+  set_axis(ABS_MT_POSITION_Y, 0, 767);
+  CHECK(superevdev_probe_range(0, 2) == 0);
+  x = 1023;
+  y = 767;
+  supertransform_apply(2, &x, &y, &out_x, &out_y, 1);
+  CHECK(out_x == SUPERTRANSFORM_MAX && out_y == SUPERTRANSFORM_MAX);
+
+  /* A keyboard, back to the input_server range */
+  memset(fake_abs, 0, sizeof(fake_abs));
+  CHECK(superevdev_probe_range(0, 1) < 0);
+  x = 4095;
+  y = 2047;
+  supertransform_apply(1, &x, &y, &out_x, &out_y, 1);
+  CHECK(out_x == 4095 && out_y == 2047);
+}
+
+static void test_transform(void)
+{
+  /* Where the corners of the source land for each rotation, clockwise
+   * from the top left, as multiples of SUPERTRANSFORM_MAX */
+  static const int corners[4][4][2] = {
+    { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } },
+    { { 1, 0 }, { 1, 1 }, { 0, 1 }, { 0, 0 } },
+    { { 1, 1 }, { 0, 1 }, { 0, 0 }, { 1, 0 } },
+    { { 0, 1 }, { 0, 0 }, { 1, 0 }, { 1, 1 } },
+  };
+  int32_t x[11] = { 0, 1023, 1023, 0, 512, -50, 2000, 100, 900, 3, 1020 };
+  int32_t y[11] = { 0, 0, 767, 767, 384, 900, -10, 700, 50, 767, 1 };
+  uint16_t out_x[11], out_y[11], one_x, one_y;
+  char spec[16];
+  int r, i;
+
+  supertransform_init();
+  supertransform_set_range(3, 0, 1023, 0, 767);
+
+  /* 4 corners at once take the SSE2 path when there is one */
+  for (r = 0; r < 4; ++r) {
+    snprintf(spec, sizeof(spec), "3:%d", r * 90);
+    CHECK(supertransform_parse(spec) == 0);
+    supertransform_apply(3, x, y, out_x, out_y, 4);
+    for (i = 0; i < 4; ++i) {
+      CHECK(abs(out_x[i] - corners[r][i][0] * SUPERTRANSFORM_MAX) <= 1);
+      CHECK(abs(out_y[i] - corners[r][i][1] * SUPERTRANSFORM_MAX) <= 1);
+    }
+  }
+
+  /* The right half of the screen */
+  CHECK(supertransform_parse("3:0:50,0,50,100") == 0);
+  supertransform_apply(3, x, y, out_x, out_y, 4);
+  CHECK(abs(out_x[0] - SUPERTRANSFORM_MAX / 2) <= 1 && out_y[0] == 0);
+  CHECK(abs(out_x[2] - SUPERTRANSFORM_MAX) <= 1 && abs(out_y[2] - SUPERTRANSFORM_MAX) <= 1);
+  /* Rotated, in the top left quarter */
+  CHECK(supertransform_parse("3:90:0,0,50,50") == 0);
+  supertransform_apply(3, x, y, out_x, out_y, 4);
+  CHECK(abs(out_x[0] - SUPERTRANSFORM_MAX / 2) <= 1 && out_y[0] == 0);
+  CHECK(out_x[2] <= 1 && abs(out_y[2] - SUPERTRANSFORM_MAX / 2) <= 1);
+  CHECK(supertransform_parse("3:45") < 0);
+  CHECK(supertransform_parse("3:90:0,0,101,100") < 0);
+
+  /* A batch gives the same as one at a time, out of range included */
+  CHECK(supertransform_parse("3:270:10,20,30,40") == 0);
+  supertransform_apply(3, x, y, out_x, out_y, 11);
+  for (i = 0; i < 11; ++i) {
+    supertransform_apply(3, &x[i], &y[i], &one_x, &one_y, 1);
+    CHECK(out_x[i] == one_x && out_y[i] == one_y);
+  }
+
+  supertransform_init();
+}
+
+static void set_bit(int type, int code)
+{
+  fake_bits[type][code / (sizeof(long) * 8)] |= 1UL << (code % (sizeof(long) * 8));
+  fake_bits[0][type / (sizeof(long) * 8)] |= 1UL << (type % (sizeof(long) * 8));
+}
+
+static void test_evdev_wanted(void)
+{
+  /* A mouse */
+  memset(&fake_id, 0, sizeof(fake_id));
+  memset(fake_bits, 0, sizeof(fake_bits));
+  set_bit(EV_REL, REL_X);
+  set_bit(EV_KEY, BTN_LEFT);
+  CHECK(superevdev_wanted(0));
+
+  /* A power button has keys, but it's not a keyboard */
+  memset(fake_bits, 0, sizeof(fake_bits));
+  set_bit(EV_KEY, KEY_POWER);
+  CHECK(!superevdev_wanted(0));
+
+  /* A keyboard */
+  set_bit(EV_KEY, KEY_A);
+  set_bit(EV_KEY, KEY_Z);
+  CHECK(superevdev_wanted(0));
+
+  /* Our own uhid touchscreen */
+  memset(fake_bits, 0, sizeof(fake_bits));
+  set_bit(EV_ABS, ABS_MT_POSITION_X);
+  CHECK(superevdev_wanted(0));
+  fake_id.vendor = SUPERHID_VENDOR;
+  fake_id.product = SUPERHID_DEVICE;
+  CHECK(!superevdev_wanted(0));
+  memset(&fake_id, 0, sizeof(fake_id));
+  memset(fake_bits, 0, sizeof(fake_bits));
+}
+
+/**
+ * Set up a domain with devices of the given types, their rings ready
+ * and no INT request pending
+ */
+static struct superhid_backend *make_domain(int slot, int domid,
+                                            const enum superhid_type *types, int count)
+{
+  struct superhid_backend *superback = &superbacks[slot];
+  struct superhid_device *dev;
+  usbif_sring_t *sring;
+  dominfo_t di;
+  int i;
+
+  memset(superback, 0, sizeof(*superback));
+  memset(&di, 0, sizeof(di));
+  di.di_domid = domid;
+  di.di_name = "test";
+  di.di_dompath = "test";
+  superbackend_setup(superback, di);
+  for (i = 0; i < count; ++i) {
+    dev = calloc(1, sizeof(*dev));
+    dev->devid = types[i];
+    dev->type = types[i];
+    dev->superback = superback;
+    dev->evtfd = -1;
+    dev->uhid = -1;
+    sring = calloc(1, 4096);
+    SHARED_RING_INIT(sring);
+    BACK_RING_INIT(&dev->back_ring, sring, 4096);
+    dev->back_ring_ready = true;
+    superback->devices[types[i]] = dev;
+  }
+  memset(guest_reports[domid], 0, sizeof(guest_reports[domid]));
+
+  return superback;
+}
+
+static void free_domain(struct superhid_backend *superback)
+{
+  int i;
+
+  for (i = 0; i < BACKEND_DEVICE_MAX; ++i) {
+    if (superback->devices[i] == NULL)
+      continue;
+    free(superback->devices[i]->back_ring.sring);
+    free(superback->devices[i]);
+  }
+  memset(superback, 0, sizeof(*superback));
+}
+
+/**
+ * The guest pends INT requests on a device
+ */
+static void post_requests(struct superhid_device *dev, int count)
+{
+  static uint64_t id = 0;
+
+  while (count-- > 0) {
+    dev->pendings[dev->pendingtail] = id++;
+    dev->pendingrefs[dev->pendingtail] = dev->devid;
+    dev->pendingoffsets[dev->pendingtail] = 0;
+    dev->pendingtail = (dev->pendingtail + 1) % 32;
+  }
+}
+
+static int queue_length(struct superhid_queue *queue)
+{
+  return (queue->tail + SUPERHID_QUEUE_LENGTH - queue->head) % SUPERHID_QUEUE_LENGTH;
+}
+
+/**
+ * The last report a device of a domain got
+ */
+static void *last_report(struct superhid_backend *superback, enum superhid_type type)
+{
+  return guest_pages[superback->di.di_domid][type];
+}
+
+static void send_record(int s, uint16_t itype, uint16_t icode, uint32_t ivalue)
+{
+  struct event_record r;
+
+  r.magic = MAGIC;
+  r.itype = itype;
+  r.icode = icode;
+  r.ivalue = ivalue;
+  CHECK(send(s, &r, sizeof(r), 0) == sizeof(r));
+}
+
+/**
+ * Connect a domain to our input_server, and check that it offered v2
+ * and asked for its input. We stay in v1 unless the test answers.
+ */
+static int connect_domain(struct superhid_backend *superback)
+{
+  struct event_record r;
+  int s;
+
+  CHECK(superplugin_create(superback) == 0);
+  s = input_server;
+  CHECK(recv(s, &r, sizeof(r), MSG_DONTWAIT) == sizeof(r));
+  CHECK(r.magic == MAGIC && r.itype == EV_CMD && r.icode == CMD_VERSION);
+  CHECK(r.ivalue == PROTO_VERSION);
+  CHECK(recv(s, &r, sizeof(r), MSG_DONTWAIT) == sizeof(r));
+  CHECK(r.magic == MAGIC && r.itype == EV_CMD && r.icode == CMD_SUCK);
+  CHECK(r.ivalue == superback->di.di_domid);
+
+  return s;
+}
+
+static void test_concurrent_domains(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *first = make_domain(0, 1, types, 1);
+  struct superhid_backend *second = make_domain(1, 2, types, 1);
+  struct superhid_report_keyboard *keyboard;
+  int first_s, second_s;
+
+  first_s = connect_domain(first);
+  second_s = connect_domain(second);
+  post_requests(first->devices[SUPERHID_TYPE_KEYBOARD], 4);
+  post_requests(second->devices[SUPERHID_TYPE_KEYBOARD], 4);
+
+  /* Shift held in the second domain, A typed in the first one */
+  send_record(second_s, EV_KEY, KEY_LEFTSHIFT, 1);
+  send_record(second_s, EV_SYN, SYN_REPORT, 0);
+  send_record(first_s, EV_KEY, KEY_A, 1);
+  send_record(first_s, EV_SYN, SYN_REPORT, 0);
+  event_loop(EVLOOP_NONBLOCK);
+
+  /* Both got their own input, and only theirs */
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 1);
+  CHECK(guest_reports[2][SUPERHID_TYPE_KEYBOARD] == 1);
+  keyboard = last_report(first, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->report_id == REPORT_ID_KEYBOARD);
+  CHECK(keyboard->modifier == 0 && keyboard->keycode[0] == 4);
+  keyboard = last_report(second, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->report_id == REPORT_ID_KEYBOARD);
+  CHECK(keyboard->modifier != 0 && keyboard->keycode[0] == 0);
+
+  /* Releasing one leaves the other connected */
+  superplugin_release(first);
+  send_record(second_s, EV_KEY, KEY_B, 1);
+  send_record(second_s, EV_SYN, SYN_REPORT, 0);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[2][SUPERHID_TYPE_KEYBOARD] == 2);
+  keyboard = last_report(second, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->modifier != 0 && keyboard->keycode[0] == 5);
+
+  superplugin_release(second);
+  close(first_s);
+  close(second_s);
+  free_domain(first);
+  free_domain(second);
+}
+
+static int queue_touch(struct superhid_backend *superback, int id, int tip,
+                       enum superhid_class cls)
+{
+  struct superhid_report_multitouch mt;
+  struct superhid_report report;
+
+  memset(&mt, 0, sizeof(mt));
+  mt.report_id = REPORT_ID_MULTITOUCH;
+  mt.count = 1;
+  mt.fingers[0].finger_id = id;
+  mt.fingers[0].tip_switch = tip;
+  mt.fingers[0].x = 100 + now / 1000 % 1000;
+  mt.fingers[0].y = 100;
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, &mt, sizeof(mt));
+  return superscheduler_queue(superback, &report, cls, now);
+}
+
+static void queue_key(struct superhid_backend *superback, uint8_t scancode)
+{
+  struct superhid_report_keyboard keyboard;
+  struct superhid_report report;
+
+  memset(&keyboard, 0, sizeof(keyboard));
+  keyboard.report_id = REPORT_ID_KEYBOARD;
+  keyboard.keycode[0] = scancode;
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, &keyboard, sizeof(keyboard));
+  superscheduler_queue(superback, &report, SUPERHID_CLASS_LOSSLESS, now);
+}
+
+static void test_fair_share(void)
+{
+  static const enum superhid_type touch[] = { SUPERHID_TYPE_DIGITIZER };
+  static const enum superhid_type keys[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *flood = make_domain(0, 1, touch, 1);
+  struct superhid_backend *typing = make_domain(1, 2, keys, 1);
+  int i, flood_first = 0;
+
+  /* A domain full of touch reports, another one with a key */
+  post_requests(flood->devices[SUPERHID_TYPE_DIGITIZER], 30);
+  post_requests(typing->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  for (i = 0; i < 30; ++i)
+    queue_touch(flood, i % SUPERHID_FINGERS, i % 2, SUPERHID_CLASS_LOSSLESS);
+  queue_key(typing, 4);
+  delivery_count = 0;
+  superscheduler_run();
+
+  /* The key doesn't wait for the flood, one round at most */
+  CHECK(delivery_count == 31);
+  while (flood_first < delivery_count && deliveries[flood_first] != 2)
+    flood_first++;
+  CHECK(flood_first <= SUPERHID_SCHED_QUANTUM);
+  CHECK(flood->stats[SUPERHID_CLASS_LOSSLESS].delivered == 30);
+  CHECK(typing->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+
+  /* With a weight of 3, a domain gets 3 times the share */
+  flood->weight = 3;
+  for (i = 0; i < 20; ++i) {
+    queue_touch(flood, 0, i % 2, SUPERHID_CLASS_LOSSLESS);
+    queue_key(typing, 4 + i % 2);
+  }
+  post_requests(flood->devices[SUPERHID_TYPE_DIGITIZER], 20);
+  post_requests(typing->devices[SUPERHID_TYPE_KEYBOARD], 20);
+  delivery_count = 0;
+  superscheduler_run();
+  CHECK(delivery_count == 40);
+  flood_first = 0;
+  for (i = 0; i < 16; ++i)
+    flood_first += deliveries[i] == 1;
+  CHECK(flood_first == 12);
+
+  free_domain(flood);
+  free_domain(typing);
+}
+
+static void test_unroutable(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_DIGITIZER };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+
+  /* A key for a domain that only has a digitizer can't go anywhere,
+   * it must not hold up the touch behind it */
+  post_requests(superback->devices[SUPERHID_TYPE_DIGITIZER], 2);
+  queue_key(superback, 4);
+  queue_touch(superback, 0, 1, SUPERHID_CLASS_LOSSLESS);
+  superscheduler_run();
+
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].unroutable == 1);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+  CHECK(guest_reports[1][SUPERHID_TYPE_DIGITIZER] == 1);
+
+  free_domain(superback);
+}
+
+static void send_keys(int s, int count)
+{
+  int i;
+
+  for (i = 0; i < count; ++i) {
+    send_record(s, EV_KEY, KEY_A, !(i % 2));
+    send_record(s, EV_SYN, SYN_REPORT, 0);
+  }
+}
+
+static void test_on_demand(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_device *keyboard = superback->devices[SUPERHID_TYPE_KEYBOARD];
+  int s, i;
+
+  /* As many reports go as the guest has requests pending, the rest
+   * waits for more */
+  s = connect_domain(superback);
+  post_requests(keyboard, 2);
+  send_keys(s, 10);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 2);
+  CHECK(superscheduler_room(superback) == SUPERHID_QUEUE_LENGTH - 1 - 8);
+  post_requests(keyboard, 3);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 5);
+
+  /* When the queue fills up, the input stays in the socket, and gets
+   * read again once the guest takes more */
+  send_keys(s, 100);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(superback->input_paused);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].dropped == 0);
+  for (i = 0; i < 10 && guest_reports[1][SUPERHID_TYPE_KEYBOARD] < 110; ++i) {
+    post_requests(keyboard, 20);
+    superscheduler_run();
+    event_loop(EVLOOP_NONBLOCK);
+  }
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 110);
+  CHECK(!superback->input_paused);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].dropped == 0);
+
+  superplugin_release(superback);
+  close(s);
+  free_domain(superback);
+}
+
+static void test_frames(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_report_keyboard *keyboard;
+  struct {
+    struct frame_header h;
+    struct frame_event events[2];
+  } __attribute__ ((__packed__)) frame;
+  int s;
+
+  /* Once input_server agrees on v2, frames follow */
+  s = connect_domain(superback);
+  send_record(s, EV_CMD, CMD_VERSION, PROTO_VERSION);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(superback->buffers.version == 2);
+
+  /* A frame split across two reads gets translated once it's whole,
+   * stamped with the time input_server read it */
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  frame.h.magic = MAGIC_V2;
+  frame.h.count = 2;
+  frame.h.source = 0;
+  frame.h.timestamp = now - 500;
+  frame.events[0].type = EV_KEY;
+  frame.events[0].code = KEY_A;
+  frame.events[0].value = 1;
+  frame.events[1].type = EV_SYN;
+  frame.events[1].code = SYN_REPORT;
+  frame.events[1].value = 0;
+  CHECK(send(s, &frame, 10, 0) == 10);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 0);
+  CHECK(send(s, (char *)&frame + 10, sizeof(frame) - 10, 0) == sizeof(frame) - 10);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 1);
+  keyboard = last_report(superback, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->keycode[0] == 0x04);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].delay_max == 500);
+
+  superplugin_release(superback);
+  close(s);
+  free_domain(superback);
+}
+
+static void test_junk(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  static const uint8_t junk[3] = { 0x12, 0x34, 0x56 };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_report_keyboard *keyboard;
+  struct timespec start, end;
+  int s;
+
+  /* Junk in the record stream gets skipped right away */
+  s = connect_domain(superback);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  CHECK(send(s, junk, sizeof(junk), 0) == sizeof(junk));
+  send_record(s, EV_KEY, KEY_A, 1);
+  send_record(s, EV_SYN, SYN_REPORT, 0);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  event_loop(EVLOOP_NONBLOCK);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  CHECK(end.tv_sec - start.tv_sec < 1);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 1);
+  keyboard = last_report(superback, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->keycode[0] == 0x04);
+
+  superplugin_release(superback);
+  close(s);
+  free_domain(superback);
+}
+
+static void test_blocked_kind(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_DIGITIZER, SUPERHID_TYPE_KEYBOARD
+  };
+  struct superhid_backend *superback = make_domain(0, 1, types, 2);
+  int i;
+
+  /* A key waits for a keyboard the guest doesn't poll, the touches
+   * behind it still go */
+  queue_key(superback, 4);
+  for (i = 0; i < 5; ++i)
+    queue_touch(superback, 0, i % 2, SUPERHID_CLASS_LOSSLESS);
+  post_requests(superback->devices[SUPERHID_TYPE_DIGITIZER], 5);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_DIGITIZER] == 5);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 0);
+  CHECK(superscheduler_room(superback) == SUPERHID_QUEUE_LENGTH - 2);
+
+  /* Keys stay in order behind it, and go once it's polled */
+  queue_key(superback, 5);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 2);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 2);
+  CHECK(((struct superhid_report_keyboard *)
+         last_report(superback, SUPERHID_TYPE_KEYBOARD))->keycode[0] == 5);
+  CHECK(superscheduler_room(superback) == SUPERHID_QUEUE_LENGTH - 1);
+
+  free_domain(superback);
+}
+
+static void test_classes(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_DIGITIZER, SUPERHID_TYPE_KEYBOARD
+  };
+  struct superhid_backend *superback = make_domain(0, 1, types, 2);
+  struct superhid_stats *lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  struct superhid_stats *motion = &superback->stats[SUPERHID_CLASS_MOTION];
+  struct superhid_report_multitouch *mt;
+  int i;
+
+  /* A key typed during heavy touch input goes first, and the moves
+   * get merged while the guest is slow */
+  for (i = 0; i < 40; ++i)
+    queue_touch(superback, i % SUPERHID_FINGERS, 1, SUPERHID_CLASS_MOTION);
+  queue_key(superback, 4);
+  post_requests(superback->devices[SUPERHID_TYPE_DIGITIZER], 1);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  superscheduler_run();
+  CHECK(lossless->delivered == 1);
+  CHECK(motion->delivered == 1);
+  CHECK(motion->merged > 0);
+  CHECK(motion->dropped == 0);
+  free_domain(superback);
+
+  /* A lift-off doesn't overtake the moves before it. When there's no
+   * room for all of them, it doesn't get queued at all. */
+  superback = make_domain(0, 1, types, 2);
+  lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  superback->fingers_per_report = 1;
+  for (i = 0; i < SUPERHID_QUEUE_LENGTH - 3; ++i)
+    queue_key(superback, 4 + i % 2);
+  for (i = 0; i < 3; ++i)
+    queue_touch(superback, i, 1, SUPERHID_CLASS_MOTION);
+  CHECK(queue_touch(superback, 0, 0, SUPERHID_CLASS_LOSSLESS) < 0);
+  CHECK(lossless->dropped == 1);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 3);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_LOSSLESS]) ==
+        SUPERHID_QUEUE_LENGTH - 3);
+
+  /* Once there's room, the moves go to the lossless queue with it */
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 20);
+  superscheduler_run();
+  CHECK(queue_touch(superback, 0, 0, SUPERHID_CLASS_LOSSLESS) == 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 0);
+  post_requests(superback->devices[SUPERHID_TYPE_DIGITIZER], 4);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_DIGITIZER] == 4);
+  mt = last_report(superback, SUPERHID_TYPE_DIGITIZER);
+  CHECK(mt->fingers[0].finger_id == 0 && mt->fingers[0].tip_switch == 0);
+  free_domain(superback);
+}
+
+static void queue_mouse(struct superhid_backend *superback, int8_t x)
+{
+  struct superhid_report_mouse mouse;
+  struct superhid_report report;
+
+  memset(&mouse, 0, sizeof(mouse));
+  mouse.report_id = REPORT_ID_MOUSE;
+  mouse.x = x;
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, &mouse, sizeof(mouse));
+  superscheduler_queue(superback, &report, SUPERHID_CLASS_MOTION, now);
+}
+
+static void test_passthrough(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_PASSTHROUGH, SUPERHID_TYPE_KEYBOARD
+  };
+  static const uint8_t raw[5] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+  struct superhid_backend *superback = make_domain(0, 1, types, 2);
+  struct superhid_stats *lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+
+  /* Native reports go as they are, with their own length, and one
+   * waiting for a request doesn't hold up the keys */
+  CHECK(superscheduler_queue_raw(superback, raw, sizeof(raw), now) == 0);
+  queue_key(superback, 4);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_PASSTHROUGH] == 0);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 1);
+  post_requests(superback->devices[SUPERHID_TYPE_PASSTHROUGH], 1);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_PASSTHROUGH] == 1);
+  CHECK(!memcmp(last_report(superback, SUPERHID_TYPE_PASSTHROUGH), raw, sizeof(raw)));
+  CHECK(lossless->delivered == 2);
+  free_domain(superback);
+
+  /* A domain without the device doesn't keep them */
+  superback = make_domain(0, 1, types + 1, 1);
+  lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  CHECK(superscheduler_queue_raw(superback, raw, sizeof(raw), now) == 0);
+  superscheduler_run();
+  CHECK(lossless->unroutable == 1);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_LOSSLESS]) == 0);
+  free_domain(superback);
+}
+
+static void test_hidraw(void)
+{
+  /* A mouse: 3 buttons, 5 bits of padding, X and Y */
+  static const uint8_t mouse[] = {
+    0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+    0x75, 0x01, 0x95, 0x03, 0x81, 0x02, 0x75, 0x05, 0x95, 0x01, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+    0xc0
+  };
+  /* Two reports, the sizes pushed and popped around the longest one */
+  static const uint8_t reports[] = {
+    0x85, 0x01, 0x75, 0x08, 0x95, 0x02, 0x81, 0x02,
+    0xa4, 0x85, 0x02, 0x75, 0x10, 0x95, 0x02, 0x81, 0x02, 0xb4,
+    0x85, 0x03, 0x81, 0x02, 0x91, 0x02
+  };
+  static const enum superhid_type types[] = { SUPERHID_TYPE_PASSTHROUGH };
+  static const uint8_t raw[5] = { 0x02, 0x01, 0x02, 0x03, 0x04 };
+  uint8_t long_raw[8] = { 0x02 };
+  struct superhid_backend *superback;
+  struct superhid_device *dev;
+  struct input_id id;
+  char path[64];
+  int w;
+
+  CHECK(superhidraw_report_length(mouse, sizeof(mouse)) == 3);
+  CHECK(superhidraw_report_length(reports, sizeof(reports)) == 5);
+  /* Output reports don't count, truncated items are an error */
+  CHECK(superhidraw_report_length(reports + sizeof(reports) - 2, 2) < 0);
+  CHECK(superhidraw_report_length(mouse, sizeof(mouse) - 2) < 0);
+
+  /* A FIFO stands in for the hidraw node, the ioctls are faked */
+  snprintf(path, sizeof(path), "/tmp/superhid-test-hidraw.%d", getpid());
+  unlink(path);
+  CHECK(mkfifo(path, 0600) == 0);
+  fake_rdesc.size = sizeof(reports);
+  memcpy(fake_rdesc.value, reports, sizeof(reports));
+  fake_rawinfo.bustype = BUS_USB;
+  fake_rawinfo.vendor = 0x1234;
+  fake_rawinfo.product = 0x5678;
+  CHECK(superhidraw_init(path) == 0);
+  CHECK(superhid_passthrough_desc != NULL &&
+        superhid_passthrough_desc->report_length == 5);
+  w = open(path, O_WRONLY | O_NONBLOCK);
+  CHECK(w >= 0);
+  superhidraw_start();
+
+  /* Its evdev node is left to the kernel */
+  memset(&id, 0, sizeof(id));
+  id.bustype = BUS_USB;
+  id.vendor = 0x1234;
+  id.product = 0x5678;
+  CHECK(superhidraw_matches(&id));
+  id.product = 0x5679;
+  CHECK(!superhidraw_matches(&id));
+
+  /* Reports go through as is, the ones that are too long don't */
+  superback = make_domain(0, 1, types, 1);
+  superback->passthrough = true;
+  dev = superback->devices[SUPERHID_TYPE_PASSTHROUGH];
+  post_requests(dev, 2);
+  CHECK(write(w, raw, sizeof(raw)) == sizeof(raw));
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_PASSTHROUGH] == 1);
+  CHECK(!memcmp(last_report(superback, SUPERHID_TYPE_PASSTHROUGH), raw, sizeof(raw)));
+  CHECK(write(w, long_raw, sizeof(long_raw)) == sizeof(long_raw));
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_PASSTHROUGH] == 1);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+
+  id.product = 0x5678;
+  superhidraw_close();
+  CHECK(!superhidraw_matches(&id));
+  close(w);
+  unlink(path);
+  free(superhid_passthrough_desc);
+  superhid_passthrough_desc = NULL;
+  free_domain(superback);
+}
+
+static void test_overflow(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_DIGITIZER, SUPERHID_TYPE_KEYBOARD
+  };
+  static const enum superhid_type mice[] = { SUPERHID_TYPE_MOUSE };
+  struct superhid_backend *superback = make_domain(0, 1, types, 2);
+  struct superhid_queue *lossless = &superback->queues[SUPERHID_CLASS_LOSSLESS];
+  struct superhid_queue *motion = &superback->queues[SUPERHID_CLASS_MOTION];
+  struct superhid_report_multitouch *mt;
+  unsigned int i, last;
+
+  /* Nothing gets dropped unless the domain asks for it */
+  CHECK(superback->overflow == SUPERHID_OVERFLOW_BLOCK);
+  CHECK(superback->max_age == 0);
+
+  /* Sources that can't be paused still overflow, the report that
+   * didn't fit gets lost but the state gets sent again */
+  for (i = 0; i < SUPERHID_QUEUE_LENGTH; ++i)
+    queue_key(superback, 4 + i % 2);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].dropped == 1);
+  CHECK(superback->resync);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 20);
+  for (i = 0; i < 20; ++i)
+    superscheduler_run();
+  CHECK(!superback->resync);
+  free_domain(superback);
+  superback = make_domain(0, 1, types, 2);
+
+  /* When it does, keys go to make room for a release and the state
+   * gets sent again later */
+  superback->overflow = SUPERHID_OVERFLOW_DROP;
+  for (i = 0; i < SUPERHID_QUEUE_LENGTH - 3; ++i)
+    queue_key(superback, 4 + i % 2);
+  for (i = 0; i < 20; ++i) {
+    now += 1000;
+    queue_touch(superback, i % SUPERHID_FINGERS, 1, SUPERHID_CLASS_MOTION);
+  }
+  now += 1000;
+  CHECK(queue_touch(superback, 0, 0, SUPERHID_CLASS_LOSSLESS) == 0);
+  CHECK(superback->resync);
+  CHECK(superback->stats[SUPERHID_CLASS_LOSSLESS].dropped > 0);
+  CHECK(queue_length(motion) == 0);
+  last = (lossless->tail + SUPERHID_QUEUE_LENGTH - 1) % SUPERHID_QUEUE_LENGTH;
+  mt = (struct superhid_report_multitouch *)&lossless->reports[last].report;
+  CHECK(mt->report_id == REPORT_ID_MULTITOUCH && mt->fingers[0].tip_switch == 0);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 20);
+  for (i = 0; i < 10; ++i)
+    superscheduler_run();
+  CHECK(!superback->resync);
+  free_domain(superback);
+
+  /* A move that keeps getting refreshed doesn't get old */
+  superback = make_domain(0, 1, mice, 1);
+  superback->max_age = 10000;
+  for (i = 0; i < 5; ++i) {
+    now += 8000;
+    queue_mouse(superback, 1);
+    superscheduler_run();
+  }
+  CHECK(superback->stats[SUPERHID_CLASS_MOTION].expired == 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 1);
+  now += 11000;
+  superscheduler_run();
+  CHECK(superback->stats[SUPERHID_CLASS_MOTION].expired == 1);
+  free_domain(superback);
+}
+
+static void queue_tablet(struct superhid_backend *superback, uint16_t x)
+{
+  struct superhid_report_tablet tablet;
+  struct superhid_report report;
+
+  memset(&tablet, 0, sizeof(tablet));
+  tablet.report_id = REPORT_ID_TABLET;
+  tablet.x = x;
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, &tablet, sizeof(tablet));
+  superscheduler_queue(superback, &report, SUPERHID_CLASS_MOTION, now);
+}
+
+static void test_duplicates(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_TABLET, SUPERHID_TYPE_KEYBOARD
+  };
+  struct superhid_backend *superback = make_domain(0, 1, types, 2);
+  struct superhid_stats *motion = &superback->stats[SUPERHID_CLASS_MOTION];
+  struct superhid_stats *lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+
+  post_requests(superback->devices[SUPERHID_TYPE_TABLET], 8);
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  CHECK(superback->keepalive == SUPERHID_DEFAULT_KEEPALIVE * 1000);
+
+  /* The same position again is skipped, and the request stays pending */
+  queue_tablet(superback, 5);
+  superscheduler_run();
+  now += 100000;
+  queue_tablet(superback, 5);
+  superscheduler_run();
+  CHECK(motion->delivered == 1 && motion->suppressed == 1);
+  CHECK(guest_reports[1][SUPERHID_TYPE_TABLET] == 1);
+
+  /* Until the keep-alive is due, then it goes again */
+  now += superback->keepalive;
+  queue_tablet(superback, 5);
+  superscheduler_run();
+  CHECK(motion->delivered == 2 && motion->suppressed == 1);
+
+  /* A change always goes */
+  queue_tablet(superback, 6);
+  superscheduler_run();
+  CHECK(motion->delivered == 3);
+
+  /* Keys aren't absolute, the same report twice is two presses */
+  queue_key(superback, 4);
+  queue_key(superback, 4);
+  superscheduler_run();
+  CHECK(lossless->delivered == 2 && lossless->suppressed == 0);
+
+  /* Without a keep-alive, nothing gets skipped */
+  superback->keepalive = 0;
+  queue_tablet(superback, 6);
+  superscheduler_run();
+  CHECK(motion->delivered == 4 && motion->suppressed == 1);
+  CHECK(guest_reports[1][SUPERHID_TYPE_TABLET] == 4);
+  free_domain(superback);
+}
+
+static void test_predict(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_TABLET };
+  struct superhid_backend *superback;
+  struct superhid_stats *motion;
+  struct superpredict predict;
+  int32_t out = 0;
+  int i;
+
+  /* A fast swipe to the edge stops at the edge */
+  memset(&predict, 0, sizeof(predict));
+  predict.source = 1;
+  supertransform_set_range(1, 0, 4095, 0, 4095);
+  for (i = 0; i <= 8; ++i)
+    out = superpredict_update(&predict, 0, 0, 3600 + i * 50, now + i * 8000, 50000);
+  CHECK(out == 4095);
+  for (i = 0; i <= 8; ++i)
+    out = superpredict_update(&predict, 0, 1, 400 - i * 50, now + i * 8000, 50000);
+  CHECK(out == 0);
+  supertransform_init();
+
+  /* The lead follows the recent delays, not the whole history */
+  superback = make_domain(0, 1, types, 1);
+  motion = &superback->stats[SUPERHID_CLASS_MOTION];
+  for (i = 0; i < 40; ++i) {
+    now += 1000;
+    queue_tablet(superback, i);
+    if (i >= 20)
+      now += 5000;
+    post_requests(superback->devices[SUPERHID_TYPE_TABLET], 1);
+    superscheduler_run();
+  }
+  CHECK(motion->delivered == 40);
+  CHECK(motion->delay_total / motion->delivered == 2500);
+  CHECK(motion->delay_recent > 4500 && motion->delay_recent <= 5000);
+  free_domain(superback);
+}
+
+static void queue_scan(struct superhid_backend *superback, uint16_t scan_time, uint16_t x)
+{
+  struct superhid_report_multitouch mt;
+  struct superhid_report report;
+
+  memset(&mt, 0, sizeof(mt));
+  mt.report_id = REPORT_ID_MULTITOUCH;
+  mt.count = 1;
+  mt.scan_time = scan_time;
+  mt.fingers[0].tip_switch = 1;
+  mt.fingers[0].x = x;
+  memset(&report, 0, sizeof(report));
+  memcpy(&report, &mt, sizeof(mt));
+  superscheduler_queue(superback, &report, SUPERHID_CLASS_MOTION, now);
+}
+
+static void test_scan_time(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_DIGITIZER };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_device *dev = superback->devices[SUPERHID_TYPE_DIGITIZER];
+  struct superhid_report_multitouch *mt;
+
+  /* Merged moves carry the scan time of the latest frame */
+  post_requests(dev, 2);
+  queue_scan(superback, 10, 100);
+  queue_scan(superback, 20, 110);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_DIGITIZER] == 1);
+  mt = last_report(superback, SUPERHID_TYPE_DIGITIZER);
+  CHECK(mt->scan_time == 20 && mt->fingers[0].x == 110);
+
+  /* A contact that didn't move is a duplicate, whatever its scan time */
+  queue_scan(superback, 30, 110);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_DIGITIZER] == 1);
+  CHECK(superback->stats[SUPERHID_CLASS_MOTION].suppressed == 1);
+  free_domain(superback);
+}
+
+static void test_report_lengths(void)
+{
+  /* Single-report devices send what their descriptor declares */
+  CHECK(superhid_report_length(SUPERHID_TYPE_MOUSE) == SUPERHID_MOUSE_REPORT_LENGTH);
+  CHECK(superhid_report_length(SUPERHID_TYPE_KEYBOARD) == SUPERHID_KEYBOARD_REPORT_LENGTH);
+  CHECK(superhid_report_length(SUPERHID_TYPE_DIGITIZER) == SUPERHID_DIGITIZER_REPORT_LENGTH);
+  CHECK(superhid_report_length(SUPERHID_TYPE_DIGITIZER_FULL) == SUPERHID_FULL_REPORT_LENGTH);
+  CHECK(superhid_input_length(SUPERHID_TYPE_TABLET, REPORT_ID_TABLET) ==
+        SUPERHID_TABLET_REPORT_LENGTH);
+
+  /* Multi devices size each report by its ID, up to the longest */
+  CHECK(superhid_input_length(SUPERHID_TYPE_MULTI, REPORT_ID_MOUSE) ==
+        SUPERHID_MOUSE_REPORT_LENGTH);
+  CHECK(superhid_input_length(SUPERHID_TYPE_MULTI, REPORT_ID_MULTITOUCH) ==
+        SUPERHID_DIGITIZER_REPORT_LENGTH);
+  CHECK(superhid_report_length(SUPERHID_TYPE_MULTI) >= SUPERHID_DIGITIZER_REPORT_LENGTH);
+}
+
+static void set_key(struct input_event *events, int code, int value)
+{
+  memset(events, 0, 2 * sizeof(*events));
+  events[0].type = EV_KEY;
+  events[0].code = code;
+  events[0].value = value;
+  events[1].type = EV_SYN;
+  events[1].code = SYN_REPORT;
+}
+
+static void test_concurrent_input(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_KEYBOARD, SUPERHID_TYPE_TABLET
+  };
+  struct superhid_backend *first = make_domain(0, 1, types, 2);
+  struct superhid_backend *second = make_domain(1, 2, types, 2);
+  struct input_event events[2], moves[3];
+  uint8_t *keys;
+
+  /* Both domains get the same frame from a local device */
+  superhid_evdev = true;
+  CHECK(superplugin_create(first) == 0);
+  CHECK(superplugin_create(second) == 0);
+  post_requests(first->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  post_requests(second->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  set_key(events, KEY_A, 1);
+  superplugin_input(3, events, 2, now);
+  CHECK(first->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+  CHECK(second->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+  keys = last_report(second, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keys[0] == REPORT_ID_KEYBOARD && keys[3] == 0x04);
+
+  /* Even through a filter that would drop it the second time around */
+  CHECK(superfilter_parse("3:all:dedupe") == 0);
+  post_requests(first->devices[SUPERHID_TYPE_TABLET], 1);
+  post_requests(second->devices[SUPERHID_TYPE_TABLET], 1);
+  memset(moves, 0, sizeof(moves));
+  moves[0].type = EV_ABS;
+  moves[0].code = ABS_X;
+  moves[0].value = 1000;
+  moves[1].type = EV_ABS;
+  moves[1].code = ABS_Y;
+  moves[1].value = 2000;
+  moves[2].type = EV_SYN;
+  moves[2].code = SYN_REPORT;
+  now += 1000;
+  superplugin_input(3, moves, 3, now);
+  CHECK(first->stats[SUPERHID_CLASS_MOTION].delivered == 1);
+  CHECK(second->stats[SUPERHID_CLASS_MOTION].delivered == 1);
+  superfilter_count = 0;
+
+  /* In focus mode, only the focused one does */
+  superhid_focus = true;
+  CHECK(superplugin_focus(second) == 0);
+  post_requests(first->devices[SUPERHID_TYPE_KEYBOARD], 1);
+  post_requests(second->devices[SUPERHID_TYPE_KEYBOARD], 4);
+  set_key(events, KEY_A, 0);
+  superplugin_input(3, events, 2, now);
+  CHECK(first->stats[SUPERHID_CLASS_LOSSLESS].delivered == 1);
+  CHECK(second->stats[SUPERHID_CLASS_LOSSLESS].delivered == 2);
+  superplugin_release(first);
+  superplugin_release(second);
+  superhid_focus = false;
+  superhid_evdev = false;
+
+  free_domain(first);
+  free_domain(second);
+}
+
+static void set_event(struct frame_event *event, uint16_t type, uint16_t code, uint32_t value)
+{
+  event->type = type;
+  event->code = code;
+  event->value = value;
+}
+
+static void process_record(struct superhid_backend *superback, uint16_t itype,
+                           uint16_t icode, uint32_t ivalue)
+{
+  struct event_record r;
+
+  r.magic = MAGIC;
+  r.itype = itype;
+  r.icode = icode;
+  r.ivalue = ivalue;
+  superplugin_process(superback, &r, now);
+}
+
+static void touch_frame(struct superhid_backend *superback, int fingers, uint32_t x)
+{
+  int i;
+
+  for (i = 0; i < fingers; ++i) {
+    process_record(superback, EV_ABS, ABS_MT_SLOT, i);
+    process_record(superback, EV_ABS, ABS_MT_TRACKING_ID, 10 + i);
+    process_record(superback, EV_ABS, ABS_MT_POSITION_X, x + i * 100);
+    process_record(superback, EV_ABS, ABS_MT_POSITION_Y, 500);
+  }
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+}
+
+static void test_stationary(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_DIGITIZER };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_stats *lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  struct superhid_stats *motion = &superback->stats[SUPERHID_CLASS_MOTION];
+  int i;
+
+  superplugin_state_init(&superback->state);
+  superback->fingers_per_report = SUPERHID_FINGER_WIDTH;
+  post_requests(superback->devices[SUPERHID_TYPE_DIGITIZER], 16);
+
+  /* Three fingers come down, that's two reports of two fingers */
+  touch_frame(superback, 3, 1000);
+  superscheduler_run();
+  CHECK(lossless->delivered == 2);
+
+  /* Holding them still, with the device repeating the same values or
+   * just sending empty frames, makes no report at all */
+  for (i = 0; i < 10; ++i) {
+    now += 8000;
+    touch_frame(superback, 3, 1000);
+    process_record(superback, EV_SYN, SYN_REPORT, 0);
+    superscheduler_run();
+  }
+  CHECK(lossless->delivered == 2);
+  CHECK(motion->delivered == 0);
+  /* Not even duplicates for the scheduler to skip */
+  CHECK(motion->suppressed == 0 && motion->merged == 0);
+  CHECK(superscheduler_queued(superback) == 0);
+
+  /* One of them moves, only that one gets reported */
+  now += 8000;
+  process_record(superback, EV_ABS, ABS_MT_SLOT, 1);
+  process_record(superback, EV_ABS, ABS_MT_POSITION_X, 1150);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  superscheduler_run();
+  CHECK(motion->delivered == 1);
+  CHECK(((struct superhid_report_multitouch *)
+         last_report(superback, SUPERHID_TYPE_DIGITIZER))->count == 1);
+  free_domain(superback);
+}
+
+/**
+ * A queued motion report, oldest first
+ */
+static void *queued_motion(struct superhid_backend *superback, int i)
+{
+  struct superhid_queue *queue = &superback->queues[SUPERHID_CLASS_MOTION];
+
+  return &queue->reports[(queue->head + i) % SUPERHID_QUEUE_LENGTH].report;
+}
+
+static void test_mouse_split(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_MOUSE };
+  static const enum superhid_type wide_types[] = { SUPERHID_TYPE_MOUSE_WIDE };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_report_mouse *mouse;
+  struct superhid_report_mouse_wide *wide;
+
+  /* A move too big for one report gets split */
+  superplugin_state_init(&superback->state);
+  process_record(superback, EV_REL, REL_X, 300);
+  process_record(superback, EV_REL, REL_Y, -200);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 3);
+  mouse = queued_motion(superback, 0);
+  CHECK((int8_t)mouse->x == 127 && (int8_t)mouse->y == -127);
+  mouse = queued_motion(superback, 1);
+  CHECK((int8_t)mouse->x == 127 && (int8_t)mouse->y == -73);
+  mouse = queued_motion(superback, 2);
+  CHECK((int8_t)mouse->x == 46 && (int8_t)mouse->y == 0);
+  CHECK(superback->state.mouse_x == 0 && superback->state.mouse_y == 0);
+  superscheduler_discard(superback);
+
+  /* Up to a point, the rest waits for the next frame */
+  process_record(superback, EV_REL, REL_X, -1000);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == SUPERHID_MOUSE_SPLIT);
+  CHECK(superback->state.mouse_x == -1000 + 127 * SUPERHID_MOUSE_SPLIT);
+  superscheduler_discard(superback);
+  process_record(superback, EV_REL, REL_X, -8);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 4);
+  mouse = queued_motion(superback, 3);
+  CHECK((int8_t)mouse->x == -(1008 - 127 * 7));
+  CHECK(superback->state.mouse_x == 0);
+  free_domain(superback);
+
+  /* The wide mouse takes a lot more at once */
+  superback = make_domain(0, 1, wide_types, 1);
+  superplugin_state_init(&superback->state);
+  superback->wide_mouse = true;
+  process_record(superback, EV_REL, REL_X, 40000);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 2);
+  wide = queued_motion(superback, 0);
+  CHECK(wide->report_id == REPORT_ID_MOUSE_WIDE && wide->x == 32767);
+  wide = queued_motion(superback, 1);
+  CHECK(wide->x == 40000 - 32767);
+  superscheduler_discard(superback);
+  free_domain(superback);
+}
+
+static void test_capture_replay(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *superback = make_domain(0, 1, types, 1);
+  struct superhid_stats *lossless = &superback->stats[SUPERHID_CLASS_LOSSLESS];
+  struct stat st;
+  char path[64];
+
+  post_requests(superback->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  superplugin_state_init(&superback->state);
+  snprintf(path, sizeof(path), "/tmp/superhid-test-capture.%d", getpid());
+  CHECK(supercapture_init(path, SUPERHID_CAPTURE_SIZE) == 0);
+  process_record(superback, EV_KEY, KEY_A, 1);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  process_record(superback, EV_KEY, KEY_A, 0);
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  superscheduler_run();
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 2);
+  supercapture_close();
+  CHECK(stat(path, &st) == 0);
+  CHECK(st.st_size == sizeof(struct capture_header) + 4 * sizeof(struct capture_record));
+
+  /* Replaying it gives the domain the same reports again */
+  CHECK(superreplay_init(path, true) == 0);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 4);
+  CHECK(lossless->delivered == 4);
+  CHECK(superback->state.keyboard.report_id == 0);
+
+  unlink(path);
+  free_domain(superback);
+}
+
+static void test_mixed_frame(void)
+{
+  static const enum superhid_type types[] = {
+    SUPERHID_TYPE_MOUSE, SUPERHID_TYPE_DIGITIZER, SUPERHID_TYPE_TABLET,
+    SUPERHID_TYPE_KEYBOARD
+  };
+  struct superhid_backend *superback = make_domain(0, 1, types, 4);
+  struct superplugin_state *st = &superback->state;
+  struct superhid_queue *lossless;
+
+  CHECK(superfilter_parse("6:all:dedupe") == 0);
+  superplugin_state_init(st);
+
+  /* One frame from a mouse, a tablet, a filtered touchscreen and a
+   * keyboard */
+  process_record(superback, EV_DEV, DEV_SET, 3);
+  process_record(superback, EV_REL, REL_X, 5);
+  process_record(superback, EV_DEV, DEV_SET, 4);
+  process_record(superback, EV_ABS, ABS_X, 100);
+  process_record(superback, EV_KEY, BTN_LEFT, 1);
+  process_record(superback, EV_DEV, DEV_SET, 6);
+  process_record(superback, EV_ABS, ABS_MT_SLOT, 0);
+  process_record(superback, EV_ABS, ABS_MT_TRACKING_ID, 7);
+  process_record(superback, EV_ABS, ABS_MT_POSITION_X, 300);
+  CHECK(st->held_count == 3);
+  CHECK(st->contact_x[0] == 0);
+
+  /* Switching source mid-frame runs what was held through the filters */
+  process_record(superback, EV_DEV, DEV_SET, 2);
+  CHECK(st->held_count == 0);
+  CHECK(st->contact_x[0] == 300);
+  CHECK(superscheduler_queued(superback) == 0);
+  process_record(superback, EV_KEY, KEY_A, 1);
+
+  /* Every device the frame touched gets its report on SYN_REPORT */
+  process_record(superback, EV_SYN, SYN_REPORT, 0);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_LOSSLESS]) == 3);
+  CHECK(queue_length(&superback->queues[SUPERHID_CLASS_MOTION]) == 1);
+  lossless = &superback->queues[SUPERHID_CLASS_LOSSLESS];
+  CHECK(lossless->reports[lossless->head].report.report_id == REPORT_ID_TABLET);
+  CHECK(lossless->reports[(lossless->head + 1) % SUPERHID_QUEUE_LENGTH].report.report_id == REPORT_ID_KEYBOARD);
+  CHECK(lossless->reports[(lossless->head + 2) % SUPERHID_QUEUE_LENGTH].report.report_id == REPORT_ID_MULTITOUCH);
+  CHECK(st->tablet.report_id == 0 && st->keyboard.report_id == 0);
+  CHECK(st->mouse_x == 0 && st->dirty == 0);
+
+  superscheduler_discard(superback);
+  superfilter_release(0);
+  superfilter_count = 0;
+  free_domain(superback);
+}
+
+static void test_filters(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_DIGITIZER };
+  struct superhid_backend *superback;
+  struct frame_event events[3];
+  struct event_record r;
+
+  /* Arguments out of range get refused */
+  CHECK(superfilter_parse("5:all:smooth:0") < 0);
+  CHECK(superfilter_parse("5:all:smooth:9") < 0);
+  CHECK(superfilter_parse("5:all:dedupe:3") < 0);
+  CHECK(superfilter_parse("5:all:predict:51") < 0);
+  CHECK(superfilter_parse("5:all:smooth:8") == 0);
+  CHECK(superfilter_parse("5:all:predict:0") == 0);
+
+  /* A slot we don't track doesn't get mixed up with the last valid
+   * one, until the next valid one */
+  CHECK(superfilter_parse("6:all:dedupe") == 0);
+  set_event(&events[0], EV_ABS, ABS_MT_SLOT, 0);
+  set_event(&events[1], EV_ABS, ABS_MT_POSITION_X, 100);
+  CHECK(superfilter_run(0, 6, events, 2, now) == 2);
+  set_event(&events[0], EV_ABS, ABS_MT_SLOT, SUPERPLUGIN_MAX_FINGERS);
+  CHECK(superfilter_run(0, 6, events, 2, now) == 2);
+  set_event(&events[0], EV_ABS, ABS_MT_POSITION_X, 100);
+  CHECK(superfilter_run(0, 6, events, 1, now) == 1);
+  set_event(&events[0], EV_ABS, ABS_MT_SLOT, 0);
+  CHECK(superfilter_run(0, 6, events, 2, now) == 1);
+
+  /* Every domain has its own state, and gets a fresh one when it goes */
+  CHECK(superfilter_run(1, 6, events, 2, now) == 2);
+  CHECK(superfilter_run(1, 6, events, 2, now) == 1);
+  superfilter_release(1);
+  CHECK(superfilter_run(1, 6, events, 2, now) == 2);
+  superfilter_release(0);
+  superfilter_release(1);
+  superfilter_count = 0;
+
+  /* The translation ignores that slot too */
+  superback = make_domain(0, 1, types, 1);
+  r.magic = MAGIC;
+  r.itype = EV_ABS;
+  r.icode = ABS_MT_SLOT;
+  r.ivalue = SUPERPLUGIN_MAX_FINGERS;
+  superplugin_process(superback, &r, now);
+  r.icode = ABS_MT_TRACKING_ID;
+  r.ivalue = 5;
+  superplugin_process(superback, &r, now);
+  r.icode = ABS_MT_POSITION_X;
+  r.ivalue = 300;
+  superplugin_process(superback, &r, now);
+  r.itype = EV_SYN;
+  r.icode = SYN_REPORT;
+  r.ivalue = 0;
+  superplugin_process(superback, &r, now);
+  CHECK(superback->state.fingers[0].tip_switch == 0);
+  CHECK(superback->state.contact_x[0] == 0);
+  CHECK(superscheduler_queued(superback) == 0);
+  free_domain(superback);
+}
+
+static void test_focus_mode(void)
+{
+  static const enum superhid_type types[] = { SUPERHID_TYPE_KEYBOARD };
+  struct superhid_backend *first, *second;
+  struct superhid_report_keyboard *keyboard;
+  struct event_record r;
+  int first_s, second_s;
+
+  /* Without focus mode, a new domain leaves the others alone */
+  first = make_domain(0, 1, types, 1);
+  second = make_domain(1, 2, types, 1);
+  post_requests(first->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  post_requests(second->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  first_s = connect_domain(first);
+  send_record(first_s, EV_KEY, KEY_A, 1);
+  send_record(first_s, EV_SYN, SYN_REPORT, 0);
+  event_loop(EVLOOP_NONBLOCK);
+  second_s = connect_domain(second);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 1);
+  CHECK(superplugin_focused() == NULL);
+  CHECK(superplugin_focus(first) == 0);
+  CHECK(recv(first_s, &r, sizeof(r), MSG_DONTWAIT) < 0);
+  superplugin_release(first);
+  superplugin_release(second);
+  close(first_s);
+  close(second_s);
+  free_domain(first);
+  free_domain(second);
+
+  /* In focus mode, the last domain created takes the focus, and the
+   * keys held in the previous one get released */
+  superhid_focus = true;
+  first = make_domain(0, 1, types, 1);
+  second = make_domain(1, 2, types, 1);
+  post_requests(first->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  post_requests(second->devices[SUPERHID_TYPE_KEYBOARD], 8);
+  first_s = connect_domain(first);
+  CHECK(superplugin_focused() == first);
+  send_record(first_s, EV_KEY, KEY_A, 1);
+  send_record(first_s, EV_SYN, SYN_REPORT, 0);
+  event_loop(EVLOOP_NONBLOCK);
+  second_s = connect_domain(second);
+  superscheduler_run();
+  CHECK(superplugin_focused() == second);
+  CHECK(guest_reports[1][SUPERHID_TYPE_KEYBOARD] == 2);
+  keyboard = last_report(first, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->keycode[0] == 0);
+  /* The tablet release has nowhere to go, it must not get stuck */
+  CHECK(superscheduler_room(first) == SUPERHID_QUEUE_LENGTH - 1);
+
+  /* Moving the focus back asks input_server for the events on the
+   * connection we have, and releases the other domain */
+  send_record(second_s, EV_KEY, KEY_B, 1);
+  send_record(second_s, EV_SYN, SYN_REPORT, 0);
+  event_loop(EVLOOP_NONBLOCK);
+  CHECK(guest_reports[2][SUPERHID_TYPE_KEYBOARD] == 1);
+  CHECK(superplugin_focus(first) == 0);
+  CHECK(superplugin_focused() == first);
+  CHECK(recv(first_s, &r, sizeof(r), MSG_DONTWAIT) == sizeof(r));
+  CHECK(r.magic == MAGIC && r.itype == EV_CMD && r.icode == CMD_SUCK && r.ivalue == 1);
+  CHECK(guest_reports[2][SUPERHID_TYPE_KEYBOARD] == 2);
+  keyboard = last_report(second, SUPERHID_TYPE_KEYBOARD);
+  CHECK(keyboard->keycode[0] == 0);
+  CHECK(second->state.keyboard.keycode[0] == 0);
+
+  superplugin_release(first);
+  superplugin_release(second);
+  CHECK(superplugin_focused() == NULL);
+  close(first_s);
+  close(second_s);
+  free_domain(first);
+  free_domain(second);
+
+  /* With evdev, every device of a domain that connects sets the input
+   * up, only the first one counts */
+  superhid_evdev = true;
+  first = make_domain(0, 1, types, 1);
+  second = make_domain(1, 2, types, 1);
+  CHECK(superplugin_create(first) == 0);
+  CHECK(superplugin_create(second) == 0);
+  CHECK(superplugin_focused() == second);
+  first->state.keyboard.keycode[0] = 0x04;
+  CHECK(superplugin_create(first) == 0);
+  CHECK(superplugin_focused() == second);
+  CHECK(first->state.keyboard.keycode[0] == 0x04);
+  CHECK(superplugin_focus(first) == 0);
+  CHECK(superplugin_focused() == first);
+  superplugin_release(first);
+  superplugin_release(second);
+  CHECK(superplugin_focus(first) < 0);
+  superhid_evdev = false;
+  superhid_focus = false;
+  free_domain(first);
+  free_domain(second);
+}
+
+int main(int argc, char **argv)
+{
+  /* Globals init, like main.c */
+  xcg_handle = NULL;
+  superhid_focus = false;
+  superhid_socket_path = SOCK_PATH;
+  supertransform_init();
+  event_init();
+
+  test_evdev_range();
+  test_transform();
+  test_evdev_wanted();
+  test_concurrent_domains();
+  test_fair_share();
+  test_unroutable();
+  test_focus_mode();
+  test_on_demand();
+  test_frames();
+  test_junk();
+  test_blocked_kind();
+  test_classes();
+  test_overflow();
+  test_passthrough();
+  test_hidraw();
+  test_concurrent_input();
+  test_filters();
+  test_stationary();
+  test_mouse_split();
+  test_mixed_frame();
+  test_capture_replay();
+  test_duplicates();
+  test_predict();
+  test_scan_time();
+  test_report_lengths();
+
+  if (failures > 0) {
+    fprintf(stderr, "%d check(s) failed\n", failures);
+    return 1;
+  }
+
+  return 0;
+}
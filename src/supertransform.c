@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   supertransform.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Tue Oct 20 16:02:18 2026
+ *
+ * @brief  Coordinate transform
+ *
+ * Absolute coordinates go through a per-source transform before they
+ * end up in a report. Every source (DEV_SET device) has a range, which
+ * comes from the device when we know it (evdev) and defaults to the
+ * 0-0x7FFF input_server uses, and a calibration: a rotation and the
+ * rectangle of the output space it covers, for multi-monitor setups.
+ * Both get folded into a 2x2 fixed-point matrix and an offset whenever
+ * they change, so applying the transform is just a couple of multiply
+ * adds per contact, done 4 contacts at a time with SSE2.
+ * The output space is 0-SUPERTRANSFORM_MAX on both axes.
+ */
+
+#include "project.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* The biggest coefficient, leaves room for the sum and the rounding */
+#define COEF_MAX                16383
+#define FRAC_MAX                14
+
+struct supertransform
+{
+  /* The range of the source */
+  int32_t  min[2];
+  int32_t  max[2];
+  /* The calibration */
+  int      rotation;   /* Clockwise, in degrees */
+  int32_t  rect[4];    /* x, y, width, height in the output space */
+  /* Precomputed from the above.
+   * out = (m[0] * x' + m[1] * y' + round) >> frac + off[0], same with
+   * m[2], m[3] for y, where x' = (x - min) >> shift fits in 15 bits */
+  int16_t  m[4];
+  int32_t  off[2];
+  uint8_t  shift;
+  uint8_t  frac;
+};
+
+static struct supertransform transforms[SUPERTRANSFORM_MAX_SOURCES];
+/* For the sources we don't know anything about */
+static struct supertransform identity;
+
+static void compute(struct supertransform *t)
+{
+  double span[2], coef[4], biggest = 0;
+  int32_t x = t->rect[0], y = t->rect[1], w = t->rect[2], h = t->rect[3];
+  int i;
+
+  t->shift = 0;
+  while ((t->max[0] - t->min[0]) >> t->shift > SUPERTRANSFORM_MAX ||
+         (t->max[1] - t->min[1]) >> t->shift > SUPERTRANSFORM_MAX)
+    t->shift++;
+  for (i = 0; i < 2; ++i) {
+    span[i] = (t->max[i] - t->min[i]) >> t->shift;
+    if (span[i] < 1)
+      span[i] = 1;
+  }
+
+  switch (t->rotation) {
+  case 90:
+    coef[0] = 0;              coef[1] = -w / span[1];
+    coef[2] = h / span[0];    coef[3] = 0;
+    t->off[0] = x + w;        t->off[1] = y;
+    break;
+  case 180:
+    coef[0] = -w / span[0];   coef[1] = 0;
+    coef[2] = 0;              coef[3] = -h / span[1];
+    t->off[0] = x + w;        t->off[1] = y + h;
+    break;
+  case 270:
+    coef[0] = 0;              coef[1] = w / span[1];
+    coef[2] = -h / span[0];   coef[3] = 0;
+    t->off[0] = x;            t->off[1] = y + h;
+    break;
+  default:
+    coef[0] = w / span[0];    coef[1] = 0;
+    coef[2] = 0;              coef[3] = h / span[1];
+    t->off[0] = x;            t->off[1] = y;
+    break;
+  }
+
+  /* As many fractional bits as the biggest coefficient allows */
+  for (i = 0; i < 4; ++i) {
+    if (coef[i] > biggest)
+      biggest = coef[i];
+    if (-coef[i] > biggest)
+      biggest = -coef[i];
+  }
+  t->frac = FRAC_MAX;
+  while (t->frac > 0 && biggest * (1 << t->frac) > COEF_MAX)
+    t->frac--;
+  for (i = 0; i < 4; ++i) {
+    coef[i] *= 1 << t->frac;
+    if (coef[i] > COEF_MAX)
+      coef[i] = COEF_MAX;
+    if (coef[i] < -COEF_MAX)
+      coef[i] = -COEF_MAX;
+    t->m[i] = coef[i] + (coef[i] < 0 ? -0.5 : 0.5);
+  }
+}
+
+static struct supertransform *find(int source)
+{
+  if (source < 0 || source >= SUPERTRANSFORM_MAX_SOURCES)
+    return NULL;
+
+  return &transforms[source];
+}
+
+/**
+ * Reset all the sources to the input_server range, without any
+ * calibration
+ */
+void supertransform_init(void)
+{
+  struct supertransform *t;
+  int i;
+
+  for (i = 0; i <= SUPERTRANSFORM_MAX_SOURCES; ++i) {
+    t = i < SUPERTRANSFORM_MAX_SOURCES ? &transforms[i] : &identity;
+    t->min[0] = t->min[1] = 0;
+    t->max[0] = t->max[1] = SUPERTRANSFORM_MAX;
+    t->rotation = 0;
+    t->rect[0] = t->rect[1] = 0;
+    t->rect[2] = t->rect[3] = SUPERTRANSFORM_MAX;
+    compute(t);
+  }
+}
+
+/**
+ * Set the range of the absolute axes of a source
+ *
+ * @param source The source (DEV_SET) device
+ * @param min_x  The lowest X the device reports
+ * @param max_x  The highest X the device reports
+ * @param min_y  The lowest Y the device reports
+ * @param max_y  The highest Y the device reports
+ */
+void supertransform_set_range(int source, int32_t min_x, int32_t max_x,
+                              int32_t min_y, int32_t max_y)
+{
+  struct supertransform *t = find(source);
+
+  if (t == NULL || max_x <= min_x || max_y <= min_y)
+    return;
+
+  t->min[0] = min_x;
+  t->max[0] = max_x;
+  t->min[1] = min_y;
+  t->max[1] = max_y;
+  compute(t);
+}
+
+/**
+ * Get the range of an absolute axis of a source
+ *
+ * @param source The source (DEV_SET) device
+ * @param axis   0 for X, 1 for Y
+ * @param min    Where to put the lowest value the device reports
+ * @param max    Where to put the highest value the device reports
+ */
+void supertransform_get_range(int source, int axis, int32_t *min, int32_t *max)
+{
+  struct supertransform *t = find(source);
+
+  if (t == NULL)
+    t = &identity;
+  *min = t->min[axis];
+  *max = t->max[axis];
+}
+
+/**
+ * Set the calibration of a source from a string like
+ * "SOURCE:ROTATION[:X,Y,WIDTH,HEIGHT]", where the rectangle is in
+ * percents of the output space, "5:90:50,0,50,100" for a touchscreen
+ * rotated clockwise on the right half of the screen.
+ *
+ * @param spec The calibration
+ *
+ * @return 0 on success, -1 if spec is invalid
+ */
+int supertransform_parse(const char *spec)
+{
+  struct supertransform *t;
+  int source, rotation, rect[4] = { 0, 0, 100, 100 };
+  int n, i;
+
+  n = sscanf(spec, "%d:%d:%d,%d,%d,%d", &source, &rotation,
+             &rect[0], &rect[1], &rect[2], &rect[3]);
+  if (n != 2 && n != 6)
+    return -1;
+  t = find(source);
+  if (t == NULL || rotation % 90 != 0 || rotation < 0 || rotation >= 360)
+    return -1;
+  for (i = 0; i < 4; ++i)
+    if (rect[i] < 0 || rect[i] > 100)
+      return -1;
+
+  t->rotation = rotation;
+  for (i = 0; i < 4; ++i)
+    t->rect[i] = rect[i] * SUPERTRANSFORM_MAX / 100;
+  compute(t);
+
+  return 0;
+}
+
+static inline int16_t reduce(const struct supertransform *t, int axis, int32_t value)
+{
+  if (value < t->min[axis])
+    value = t->min[axis];
+  if (value > t->max[axis])
+    value = t->max[axis];
+
+  return (value - t->min[axis]) >> t->shift;
+}
+
+static inline uint16_t clamp(int32_t value)
+{
+  if (value < 0)
+    return 0;
+  if (value > SUPERTRANSFORM_MAX)
+    return SUPERTRANSFORM_MAX;
+
+  return value;
+}
+
+#ifdef __SSE2__
+/**
+ * 4 contacts at a time: the reduced coordinates get interleaved, and
+ * one pmaddwd per axis does both multiplies and the add
+ *
+ * @return The number of contacts transformed
+ */
+static int apply_sse2(const struct supertransform *t, const int32_t *x, const int32_t *y,
+                      uint16_t *out_x, uint16_t *out_y, int count)
+{
+  int16_t xy[8] __attribute__ ((aligned(16)));
+  int16_t out[8] __attribute__ ((aligned(16)));
+  __m128i mx, my, round, offx, offy, frac, zero, v, rx, ry;
+  int i, j;
+
+  mx = _mm_set_epi16(t->m[1], t->m[0], t->m[1], t->m[0],
+                     t->m[1], t->m[0], t->m[1], t->m[0]);
+  my = _mm_set_epi16(t->m[3], t->m[2], t->m[3], t->m[2],
+                     t->m[3], t->m[2], t->m[3], t->m[2]);
+  round = _mm_set1_epi32(t->frac > 0 ? 1 << (t->frac - 1) : 0);
+  offx = _mm_set1_epi32(t->off[0]);
+  offy = _mm_set1_epi32(t->off[1]);
+  frac = _mm_cvtsi32_si128(t->frac);
+  zero = _mm_setzero_si128();
+
+  for (i = 0; i + 4 <= count; i += 4) {
+    for (j = 0; j < 4; ++j) {
+      xy[j * 2] = reduce(t, 0, x[i + j]);
+      xy[j * 2 + 1] = reduce(t, 1, y[i + j]);
+    }
+    v = _mm_load_si128((__m128i *)xy);
+    rx = _mm_add_epi32(_mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(v, mx), round), frac), offx);
+    ry = _mm_add_epi32(_mm_sra_epi32(_mm_add_epi32(_mm_madd_epi16(v, my), round), frac), offy);
+    /* Saturating to 16 bits clamps the top at 0x7FFF, max() the bottom */
+    _mm_store_si128((__m128i *)out, _mm_max_epi16(_mm_packs_epi32(rx, ry), zero));
+    for (j = 0; j < 4; ++j) {
+      out_x[i + j] = out[j];
+      out_y[i + j] = out[j + 4];
+    }
+  }
+
+  return i;
+}
+#endif
+
+/**
+ * Transform a batch of absolute coordinates from a source to the
+ * output space
+ *
+ * @param source The source (DEV_SET) device they come from
+ * @param x      The X coordinates, as the source reported them
+ * @param y      The Y coordinates, as the source reported them
+ * @param out_x  Filled with the X coordinates, 0-SUPERTRANSFORM_MAX
+ * @param out_y  Filled with the Y coordinates, 0-SUPERTRANSFORM_MAX
+ * @param count  The number of coordinates
+ */
+void supertransform_apply(int source, const int32_t *x, const int32_t *y,
+                          uint16_t *out_x, uint16_t *out_y, int count)
+{
+  const struct supertransform *t = find(source);
+  int32_t rx, ry;
+  int16_t ax, ay;
+  int i = 0;
+
+  if (t == NULL)
+    t = &identity;
+
+#ifdef __SSE2__
+  i = apply_sse2(t, x, y, out_x, out_y, count);
+#endif
+  for (; i < count; ++i) {
+    ax = reduce(t, 0, x[i]);
+    ay = reduce(t, 1, y[i]);
+    rx = t->m[0] * ax + t->m[1] * ay;
+    ry = t->m[2] * ax + t->m[3] * ay;
+    if (t->frac > 0) {
+      rx += 1 << (t->frac - 1);
+      ry += 1 << (t->frac - 1);
+    }
+    out_x[i] = clamp((rx >> t->frac) + t->off[0]);
+    out_y[i] = clamp((ry >> t->frac) + t->off[1]);
+  }
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2015 Assured Information Security, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/**
+ * @file   superuhid.c
+ * @author Jed Lejosne <lejosnej@ainfosec.com>
+ * @date   Tue Oct 20 14:12:40 2026
+ *
+ * @brief  Local uhid devices
+ *
+ * Without Xen, SuperHID can deliver to uhid devices instead of usbif
+ * frontends. A single local domain gets created, with one uhid device
+ * per requested type, using the same report descriptors as the guests
+ * get. The input goes through the usual translation and scheduling,
+ * and the kernel HID parser gets the reports, so the whole path can be
+ * measured on any Linux box.
+ * uhid devices never have to wait for a request, they're always
+ * pending as far as the scheduler is concerned.
+ */
+
+#include "project.h"
+
+#define UHID_PATH               "/dev/uhid"
+
+static const char *type_names[SUPERHID_TYPE_LAST + 1] = {
+  [SUPERHID_TYPE_MULTI]          = "multi",
+  [SUPERHID_TYPE_MOUSE]          = "mouse",
+  [SUPERHID_TYPE_DIGITIZER]      = "digitizer",
+  [SUPERHID_TYPE_TABLET]         = "tablet",
+  [SUPERHID_TYPE_KEYBOARD]       = "keyboard",
+  [SUPERHID_TYPE_DIGITIZER_FULL] = "digitizer-full",
+  [SUPERHID_TYPE_MOUSE_WIDE]     = "mouse-wide",
+  [SUPERHID_TYPE_PASSTHROUGH]    = "passthrough",
+};
+
+static struct superhid_backend *local = NULL;
+
+static int uhid_write(int fd, struct uhid_event *ev, size_t size)
+{
+  ssize_t n;
+
+  n = write(fd, ev, size);
+  if (n < 0) {
+    superlog(LOG_ERR, "Failed to write to uhid: %s", strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Answer a GET_REPORT/SET_REPORT from the kernel like we would answer
+ * the control request of a guest, see superhid_setup()
+ */
+static void answer_report(struct superhid_device *dev, struct uhid_event *ev)
+{
+  struct usb_ctrlrequest setup;
+  struct uhid_event reply;
+  uint8_t rtype, rnum;
+  int ret;
+
+  if (ev->type == UHID_GET_REPORT) {
+    rtype = ev->u.get_report.rtype;
+    rnum = ev->u.get_report.rnum;
+    setup.bRequestType = USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    setup.bRequest = HID_REQ_GET_REPORT;
+  } else {
+    rtype = ev->u.set_report.rtype;
+    rnum = ev->u.set_report.rnum;
+    setup.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+    setup.bRequest = HID_REQ_SET_REPORT;
+  }
+  switch (rtype) {
+  case UHID_FEATURE_REPORT:
+    setup.wValue = (HID_REPORT_TYPE_FEATURE << 8) | rnum;
+    break;
+  case UHID_OUTPUT_REPORT:
+    setup.wValue = (HID_REPORT_TYPE_OUTPUT << 8) | rnum;
+    break;
+  default:
+    setup.wValue = (HID_REPORT_TYPE_INPUT << 8) | rnum;
+    break;
+  }
+  setup.wIndex = 0;
+
+  memset(&reply, 0, sizeof(reply));
+  if (ev->type == UHID_GET_REPORT) {
+    setup.wLength = UHID_DATA_MAX;
+    ret = superhid_setup(&setup, (char *)reply.u.get_report_reply.data, dev->type);
+    reply.type = UHID_GET_REPORT_REPLY;
+    reply.u.get_report_reply.id = ev->u.get_report.id;
+    reply.u.get_report_reply.err = ret < 0 ? EIO : 0;
+    reply.u.get_report_reply.size = ret < 0 ? 0 : ret;
+  } else {
+    setup.wLength = ev->u.set_report.size;
+    ret = superhid_setup(&setup, (char *)ev->u.set_report.data, dev->type);
+    reply.type = UHID_SET_REPORT_REPLY;
+    reply.u.set_report_reply.id = ev->u.set_report.id;
+    reply.u.set_report_reply.err = ret < 0 ? EIO : 0;
+  }
+  uhid_write(dev->uhid, &reply, sizeof(reply));
+}
+
+static void uhid_handler(int fd, short event, void *priv)
+{
+  struct superhid_device *dev = priv;
+  struct uhid_event ev;
+  ssize_t n;
+
+  n = read(fd, &ev, sizeof(ev));
+  if (n <= 0)
+    return;
+
+  switch (ev.type) {
+  case UHID_START:
+    superlog(LOG_INFO, "uhid %s device started", type_names[dev->type]);
+    break;
+  case UHID_GET_REPORT:
+  case UHID_SET_REPORT:
+    answer_report(dev, &ev);
+    break;
+  default:
+    /* Open, close, output... nothing to do */
+    break;
+  }
+}
+
+static int create_device(struct superhid_backend *superback, enum superhid_type type)
+{
+  struct superhid_device *dev;
+  struct hid_report_desc *desc;
+  struct uhid_event ev;
+
+  desc = superhid_report_desc(type);
+  if (desc == NULL) {
+    superlog(LOG_ERR, "No descriptor for a local %s device", type_names[type]);
+    return -1;
+  }
+
+  dev = malloc(sizeof(*dev));
+  if (dev == NULL)
+    return -1;
+  memset(dev, 0, sizeof(*dev));
+  dev->devid = type;
+  dev->evtfd = -1;
+  dev->superback = superback;
+  dev->type = type;
+  dev->uhid = open(UHID_PATH, O_RDWR | O_CLOEXEC);
+  if (dev->uhid < 0) {
+    superlog(LOG_ERR, "Failed to open %s: %s", UHID_PATH, strerror(errno));
+    free(dev);
+    return -1;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_CREATE2;
+  snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+           "%s %s", SUPERHID_REAL_NAME, type_names[type]);
+  snprintf((char *)ev.u.create2.phys, sizeof(ev.u.create2.phys),
+           "%s/%d", SUPERHID_NAME, type);
+  ev.u.create2.rd_size = desc->report_desc_length;
+  ev.u.create2.bus = BUS_USB;
+  ev.u.create2.vendor = SUPERHID_VENDOR;
+  ev.u.create2.product = SUPERHID_DEVICE;
+  memcpy(ev.u.create2.rd_data, desc->report_desc, desc->report_desc_length);
+  if (uhid_write(dev->uhid, &ev, sizeof(ev)) < 0) {
+    close(dev->uhid);
+    free(dev);
+    return -1;
+  }
+
+  /* Same as what superback_alloc() does for a frontend */
+  if (type == SUPERHID_TYPE_DIGITIZER_FULL)
+    superback->fingers_per_report = SUPERHID_FINGERS;
+  if (type == SUPERHID_TYPE_MOUSE_WIDE)
+    superback->wide_mouse = true;
+  if (type == SUPERHID_TYPE_PASSTHROUGH)
+    superback->passthrough = true;
+  superback->devices[type] = dev;
+
+  event_set(&dev->event, dev->uhid, EV_READ | EV_PERSIST, uhid_handler, dev);
+  event_add(&dev->event, NULL);
+
+  return 0;
+}
+
+static void destroy_device(struct superhid_device *dev)
+{
+  struct uhid_event ev;
+
+  event_del(&dev->event);
+  memset(&ev, 0, sizeof(ev));
+  ev.type = UHID_DESTROY;
+  uhid_write(dev->uhid, &ev, sizeof(ev));
+  close(dev->uhid);
+  free(dev);
+}
+
+/**
+ * Create the local domain and its uhid devices, and start getting
+ * input for it. Must be called after event_init().
+ *
+ * @param types Comma-separated list of device types, like
+ *              "mouse,digitizer,tablet,keyboard"
+ *
+ * @return 0 on success, -1 on error
+ */
+int superuhid_init(const char *types)
+{
+  dominfo_t di;
+  char *list, *name, *saveptr;
+  int type, ret = 0;
+
+  di.di_domid = SUPERHID_DOMID;
+  di.di_name = "local";
+  /* The scheduler only serves the slots that have a dompath */
+  di.di_dompath = "local";
+  local = &superbacks[0];
+  superbackend_setup(local, di);
+
+  list = strdup(types);
+  if (list == NULL)
+    return -1;
+  for (name = strtok_r(list, ",", &saveptr); name != NULL && ret == 0;
+       name = strtok_r(NULL, ",", &saveptr)) {
+    for (type = SUPERHID_TYPE_MULTI; type <= SUPERHID_TYPE_LAST; ++type)
+      if (!strcmp(name, type_names[type]))
+        break;
+    if (type > SUPERHID_TYPE_LAST) {
+      superlog(LOG_ERR, "Unknown device type %s", name);
+      ret = -1;
+    } else if (local->devices[type] == NULL) {
+      ret = create_device(local, type);
+    }
+  }
+  free(list);
+
+  if (ret == 0)
+    ret = superplugin_create(local);
+  if (ret < 0)
+    superuhid_close();
+
+  return ret;
+}
+
+/**
+ * Hand a report to the kernel
+ *
+ * @param dev    The local device
+ * @param report The report
+ * @param length The length of the report
+ */
+void superuhid_send(struct superhid_device *dev, struct superhid_report *report,
+                    int length)
+{
+  struct uhid_event ev;
+
+  ev.type = UHID_INPUT2;
+  ev.u.input2.size = length;
+  memcpy(ev.u.input2.data, report, length);
+  /* No need to write the whole event, uhid takes the size into
+   * account */
+  uhid_write(dev->uhid, &ev, offsetof(struct uhid_event, u.input2.data) + length);
+}
+
+/**
+ * Destroy the local devices and domain
+ */
+void superuhid_close(void)
+{
+  int i;
+
+  if (local == NULL)
+    return;
+
+  superplugin_release(local);
+  for (i = 0; i < BACKEND_DEVICE_MAX; ++i) {
+    if (local->devices[i] != NULL)
+      destroy_device(local->devices[i]);
+    local->devices[i] = NULL;
+  }
+  superscheduler_print_stats(local);
+  memset(local, 0, sizeof(*local));
+  local = NULL;
+}
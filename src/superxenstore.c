@@ -33,6 +33,11 @@ enum XenBusStates {
   XB_CLOSING, XB_CLOSED
 };
 
+/**
+ * The toolstack writes the domid that should get the input here
+ */
+#define FOCUS_PATH "/superhid/focus"
+
 /**
  * The xenstore handle and dom0 path, set by xenstore_init()
  */
@@ -437,6 +442,70 @@ static void spawn(int domid, enum superhid_type type)
   superxenstore_create_usb(&di, &ui);
 }
 
+/**
+ * Read an optional integer setting of a VM, "/xenmgr/vms/<uuid>/<key>"
+ *
+ * @param uuid The uuid of the VM
+ * @param key  The name of the setting
+ * @param def  The value to return if the setting is absent
+ *
+ * @return The value of the setting, or def
+ */
+static int read_vm_int(const char *uuid, const char *key, int def)
+{
+  char path[256];
+  char *value;
+  unsigned int len;
+  int ret = def;
+
+  snprintf(path, 256, "/xenmgr/vms/%s/%s", uuid, key);
+  value = xs_read(xs_handle, XBT_NULL, path, &len);
+  if (value != NULL) {
+    ret = strtol(value, NULL, 10);
+    free(value);
+  }
+
+  return ret;
+}
+
+/**
+ * Apply the per-VM SuperHID settings to the backend of a new domain
+ *
+ * @param superback The backend of the domain
+ * @param uuid      The uuid of the VM
+ */
+static void configure(struct superhid_backend *superback, const char *uuid)
+{
+  char path[256];
+  char *policy;
+  unsigned int len;
+  int value;
+
+  superback->weight = read_vm_int(uuid, "superhid-weight", SUPERHID_DEFAULT_WEIGHT);
+  if (superback->weight < 1)
+    superback->weight = 1;
+  /* In milliseconds in xenstore, 0 disables the duplicate suppression */
+  value = read_vm_int(uuid, "superhid-keepalive", SUPERHID_DEFAULT_KEEPALIVE);
+  superback->keepalive = value > 0 ? (uint64_t)value * 1000 : 0;
+  /* In milliseconds too, 0 (the default) delivers everything no matter
+   * how late */
+  value = read_vm_int(uuid, "superhid-max-age", 0);
+  superback->max_age = value > 0 ? (uint64_t)value * 1000 : 0;
+  /* "block" (the default) keeps every event, "drop" keeps the latency
+   * bounded */
+  snprintf(path, 256, "/xenmgr/vms/%s/superhid-overflow", uuid);
+  policy = xs_read(xs_handle, XBT_NULL, path, &len);
+  if (policy != NULL) {
+    if (!strcmp(policy, "block"))
+      superback->overflow = SUPERHID_OVERFLOW_BLOCK;
+    else if (!strcmp(policy, "drop"))
+      superback->overflow = SUPERHID_OVERFLOW_DROP;
+    else
+      superlog(LOG_ERR, "Unknown overflow policy %s", policy);
+    free(policy);
+  }
+}
+
 #define D4         "[0-9a-z][0-9a-z][0-9a-z][0-9a-z]"
 #define MATCH_UUID D4 D4 "-" D4 "-" D4 "-" D4 "-" D4 D4 D4
 
@@ -456,6 +525,18 @@ void superxenstore_handler(void)
 
   /* Watch away */
   paths = xs_read_watch(xs_handle, &len);
+  if (!strcmp(paths[XS_WATCH_PATH], FOCUS_PATH)) {
+    value = xs_read(xs_handle, XBT_NULL, FOCUS_PATH, &len);
+    if (value != NULL) {
+      domid = strtol(value, NULL, 10);
+      free(value);
+      slot = superbackend_find_slot(domid);
+      if (slot != -1 && superplugin_focus(&superbacks[slot]) != 0)
+        superlog(LOG_ERR, "Can't move the input focus to domid %d", domid);
+    }
+    free(paths);
+    return;
+  }
   if (!fnmatch("/vm/" MATCH_UUID, paths[XS_WATCH_PATH], 0)) {
     value = xs_read(xs_handle, XBT_NULL, paths[XS_WATCH_PATH], &len);
     if (value == NULL) {
@@ -514,11 +595,27 @@ void superxenstore_handler(void)
           /* if (*type == 'm') { */
             /* spawn(domid, SUPERHID_TYPE_MULTI); */
           /* } else { */
-          spawn(domid, SUPERHID_TYPE_MOUSE);
-          spawn(domid, SUPERHID_TYPE_DIGITIZER);
+          /* Wide mice take big moves in one report */
+          if (read_vm_int(paths[i], "superhid-wide-mouse", 0))
+            spawn(domid, SUPERHID_TYPE_MOUSE_WIDE);
+          else
+            spawn(domid, SUPERHID_TYPE_MOUSE);
+          /* Full-frame digitizers take a whole touch frame in one
+           * report, but need a guest that handles big reports */
+          if (read_vm_int(paths[i], "superhid-full-frame", 0))
+            spawn(domid, SUPERHID_TYPE_DIGITIZER_FULL);
+          else
+            spawn(domid, SUPERHID_TYPE_DIGITIZER);
           spawn(domid, SUPERHID_TYPE_TABLET);
           spawn(domid, SUPERHID_TYPE_KEYBOARD);
+          /* The physical HID device, as is, if we have one */
+          if (superhid_passthrough_desc != NULL &&
+              read_vm_int(paths[i], "superhid-passthrough", 0))
+            spawn(domid, SUPERHID_TYPE_PASSTHROUGH);
           /* } */
+          slot = superbackend_find_slot(domid);
+          if (slot != -1)
+            configure(&superbacks[slot], paths[i]);
         }
       }
       free(state);
@@ -552,6 +649,7 @@ int superxenstore_init(void)
   }
 
   xs_watch(xs_handle, "/vm", "/vm");
+  xs_watch(xs_handle, FOCUS_PATH, FOCUS_PATH);
 
   return xs_fileno(xs_handle);
 }